@@ -0,0 +1,198 @@
+// Encoder and decoder inference latency with and without ONNX shape buckets.
+//
+// Feeds the encoder random phoneme ids of varying length, then decodes its
+// output in the same windows textToAudio uses, timing every call. Each mode
+// runs the same sequence of lengths, so the only difference is whether the
+// inputs are padded up to a bucket (a few shapes, memory planned once each)
+// or passed as they are (a new shape for nearly every call).
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <spdlog/spdlog.h>
+
+#include "piper.hpp"
+
+using namespace std;
+
+struct Timings {
+  vector<double> encoder;
+  vector<double> decoder;
+};
+
+static double percentile(vector<double> samples, double p) {
+  if (samples.empty())
+    return 0;
+  sort(samples.begin(), samples.end());
+  size_t idx = min(samples.size() - 1, (size_t)(p * (samples.size() - 1) + 0.5));
+  return samples[idx];
+}
+
+static void report(const string &mode, const string &stage,
+                   const vector<double> &samples) {
+  cout << mode << "\t" << stage << "\t" << samples.size() << "\t"
+       << percentile(samples, 0.5) * 1000.0 << "\t"
+       << percentile(samples, 0.99) * 1000.0 << endl;
+}
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static Timings run(piper::Voice &voice, const vector<vector<int64_t>> &inputs,
+                   optional<int64_t> sid) {
+  // Same windows as textToAudio
+  const size_t chunkSize = 45;
+  const size_t padding = 5;
+
+  Timings timings;
+  vector<float> audio;
+  for (auto &ids : inputs) {
+    auto start = chrono::steady_clock::now();
+    auto params = voice.encoder.infer(ids, ids.size(), sid,
+                                      voice.synthesisConfig.noiseScale,
+                                      voice.synthesisConfig.lengthScale,
+                                      voice.synthesisConfig.noiseW);
+    timings.encoder.push_back(secondsSince(start));
+
+    optional<xt::xarray<float>> g;
+    if (params.count("g"))
+      g = std::move(params["g"]);
+    auto &z = params["z"];
+    auto &y_mask = params["y_mask"];
+    size_t nslices = z.shape()[2];
+
+    if (nslices < chunkSize + padding * 2) {
+      start = chrono::steady_clock::now();
+      voice.decoder->infer(z, y_mask, g, audio);
+      timings.decoder.push_back(secondsSince(start));
+      continue;
+    }
+    for (size_t i = 0; i < nslices; i += chunkSize) {
+      size_t begin = i > padding ? i - padding : 0;
+      size_t end = min(nslices, i + chunkSize + padding);
+      xt::xarray<float> zChunk =
+          xt::view(z, xt::all(), xt::all(), xt::range(begin, end));
+      xt::xarray<float> maskChunk =
+          xt::view(y_mask, xt::all(), xt::all(), xt::range(begin, end));
+      start = chrono::steady_clock::now();
+      voice.decoder->infer(zChunk, maskChunk, g, audio);
+      timings.decoder.push_back(secondsSince(start));
+    }
+  }
+  return timings;
+}
+
+static void printUsage(const char *argv0) {
+  cerr << endl;
+  cerr << "usage: " << argv0 << " [options]" << endl;
+  cerr << endl;
+  cerr << "options:" << endl;
+  cerr << "   --encoder               FILE  path to encoder model file" << endl;
+  cerr << "   --decoder               FILE  path to decoder model file" << endl;
+  cerr << "   -c  FILE  --config      FILE  path to model config file" << endl;
+  cerr << "   --accelerator           STR   accelerator for ONNX" << endl;
+  cerr << "   --runs                  NUM   encoder calls per mode "
+          "(default: 200)"
+       << endl;
+  cerr << "   --max_length            NUM   longest input in phoneme ids "
+          "(default: 400)"
+       << endl;
+  cerr << "   --encoder_buckets       LIST  buckets for the bucketed run"
+       << endl;
+  cerr << "   --decoder_buckets       LIST  buckets for the bucketed run"
+       << endl;
+  cerr << endl;
+}
+
+int main(int argc, char *argv[]) {
+  spdlog::set_default_logger(spdlog::stderr_color_st("paroli-bench"));
+  spdlog::set_level(spdlog::level::warn);
+
+  string encoderPath, decoderPath, configPath, accelerator;
+  size_t runs = 200;
+  size_t maxLength = 400;
+  piper::PiperConfig piperConfig;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--encoder" && hasValue) {
+      encoderPath = argv[++i];
+    } else if (arg == "--decoder" && hasValue) {
+      decoderPath = argv[++i];
+    } else if ((arg == "-c" || arg == "--config") && hasValue) {
+      configPath = argv[++i];
+    } else if (arg == "--accelerator" && hasValue) {
+      accelerator = argv[++i];
+    } else if (arg == "--runs" && hasValue) {
+      runs = max(1, stoi(argv[++i]));
+    } else if ((arg == "--max_length" || arg == "--max-length") && hasValue) {
+      maxLength = max(8, stoi(argv[++i]));
+    } else if ((arg == "--encoder_buckets" || arg == "--encoder-buckets") &&
+               hasValue) {
+      piperConfig.encoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
+    } else if ((arg == "--decoder_buckets" || arg == "--decoder-buckets") &&
+               hasValue) {
+      piperConfig.decoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
+    } else {
+      printUsage(argv[0]);
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+  if (encoderPath.empty() || decoderPath.empty() || configPath.empty()) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  piper::Voice voice;
+  optional<piper::SpeakerId> speakerId;
+  piper::loadVoice(piperConfig, "", encoderPath, decoderPath, configPath,
+                   voice, speakerId, accelerator);
+  optional<int64_t> sid;
+  if (voice.synthesisConfig.speakerId)
+    sid = *voice.synthesisConfig.speakerId;
+
+  // Random phonemes laid out like phonemes_to_ids does: BOS, then each id
+  // followed by a pad, then EOS
+  vector<piper::PhonemeId> vocabulary;
+  for (auto &[phoneme, ids] : voice.phonemizeConfig.phonemeIdMap)
+    vocabulary.insert(vocabulary.end(), ids.begin(), ids.end());
+  if (vocabulary.empty())
+    throw runtime_error("Voice has no phoneme ids");
+
+  mt19937 rng(1234);
+  uniform_int_distribution<size_t> lengthDist(8, maxLength);
+  uniform_int_distribution<size_t> idDist(0, vocabulary.size() - 1);
+  vector<vector<int64_t>> inputs(runs);
+  for (auto &ids : inputs) {
+    size_t length = lengthDist(rng);
+    ids.push_back(voice.phonemizeConfig.idBos);
+    while (ids.size() + 1 < length) {
+      ids.push_back(vocabulary[idDist(rng)]);
+      ids.push_back(voice.phonemizeConfig.idPad);
+    }
+    ids.push_back(voice.phonemizeConfig.idEos);
+  }
+
+  cout << "mode\tstage\tcalls\tp50_ms\tp99_ms" << endl;
+
+  auto bucketed = run(voice, inputs, sid);
+  report("bucketed", "encoder", bucketed.encoder);
+  report("bucketed", "decoder", bucketed.decoder);
+
+  voice.encoder.shapeBuckets.clear();
+  if (auto *decoder = dynamic_cast<piper::OnnxDecoderInferer *>(voice.decoder.get()))
+    decoder->shapeBuckets.clear();
+  auto unbucketed = run(voice, inputs, sid);
+  report("unbucketed", "encoder", unbucketed.encoder);
+  report("unbucketed", "decoder", unbucketed.decoder);
+
+  return 0;
+}
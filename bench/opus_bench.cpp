@@ -0,0 +1,132 @@
+// Opus encoding cost per core, Ogg and raw packets.
+//
+// Runs back-to-back requests on one thread, each leasing a pooled encoder and
+// feeding it decoder-sized chunks, and divides the audio encoded by the
+// thread's CPU time: the result is how many real-time streams one core keeps
+// up with. In builds with -DCOUNT_ALLOCATIONS=ON it also reports heap
+// allocations per encode() call, which should be zero once the pool is warm.
+// Leasing the encoder and finishing a request are not counted.
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "paroli-daemon/AllocationCounter.hpp"
+#include "paroli-daemon/OggOpusEncoder.hpp"
+
+using namespace std;
+
+static double threadCpuSeconds() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void printUsage(const char *argv0) {
+  cerr << endl;
+  cerr << "usage: " << argv0 << " [options]" << endl;
+  cerr << endl;
+  cerr << "options:" << endl;
+  cerr << "   --sample_rate           NUM   encoder input rate (default: 24000)"
+       << endl;
+  cerr << "   --chunk                 NUM   samples per chunk (default: 12544)"
+       << endl;
+  cerr << "   --requests              NUM   requests per run (default: 20)"
+       << endl;
+  cerr << "   --seconds               NUM   audio per request (default: 5)"
+       << endl;
+  cerr << endl;
+}
+
+int main(int argc, char *argv[]) {
+  int sampleRate = 24000;
+  size_t chunkSize = 12544;
+  size_t requests = 20;
+  double seconds = 5;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if ((arg == "--sample_rate" || arg == "--sample-rate") && hasValue) {
+      sampleRate = stoi(argv[++i]);
+    } else if (arg == "--chunk" && hasValue) {
+      chunkSize = max(64, stoi(argv[++i]));
+    } else if (arg == "--requests" && hasValue) {
+      requests = max(1, stoi(argv[++i]));
+    } else if (arg == "--seconds" && hasValue) {
+      seconds = max(0.1, stod(argv[++i]));
+    } else {
+      printUsage(argv[0]);
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+
+  // A few drifting partials plus noise, roughly the spectrum of speech
+  mt19937 rng(1234);
+  normal_distribution<float> noise(0.0f, 0.02f);
+  vector<float> signal(size_t(seconds * sampleRate));
+  for (size_t i = 0; i < signal.size(); i++) {
+    double t = double(i) / sampleRate;
+    signal[i] = 0.3f * sin(2 * M_PI * (180 + 40 * sin(t)) * t) +
+                0.1f * sin(2 * M_PI * 1200 * t) +
+                0.05f * sin(2 * M_PI * 3400 * t) + noise(rng);
+  }
+
+  cout << "format\tframe_ms\tcomplexity\trequests\tkbps\tx_realtime_per_core"
+       << (allocations::enabled() ? "\tallocs_per_chunk" : "") << endl;
+
+  for (bool raw : {false, true}) {
+    for (double frameMs : {10.0, 20.0}) {
+      for (int complexity : {0, 5, 10}) {
+        OpusOptions options;
+        options.frameMs = frameMs;
+        options.complexity = complexity;
+        options.lowLatency = true;
+
+        // Fill the pool and the output buffer's capacity first
+        vector<uint8_t> out;
+        {
+          auto encoder = makeOpusEncoder(raw, sampleRate, 1, options);
+          encoder->encode(signal, out);
+          encoder->finish(out);
+        }
+
+        size_t bytes = 0, chunks = 0;
+        uint64_t allocs = 0;
+        double t0 = threadCpuSeconds();
+        for (size_t r = 0; r < requests; r++) {
+          auto encoder = makeOpusEncoder(raw, sampleRate, 1, options);
+          for (size_t offset = 0; offset < signal.size(); offset += chunkSize) {
+            span<const float> chunk(signal.data() + offset,
+                                    min(chunkSize, signal.size() - offset));
+            out.clear();
+            uint64_t allocs0 = allocations::thisThread();
+            encoder->encode(chunk, out);
+            allocs += allocations::thisThread() - allocs0;
+            bytes += out.size();
+            chunks++;
+          }
+          out.clear();
+          encoder->finish(out);
+          bytes += out.size();
+        }
+        double cpu = threadCpuSeconds() - t0;
+
+        double audioSeconds = requests * seconds;
+        cout << (raw ? "opus_raw" : "opus") << "\t" << frameMs << "\t"
+             << complexity << "\t" << requests << "\t"
+             << bytes * 8 / audioSeconds / 1000 << "\t"
+             << (cpu > 0 ? audioSeconds / cpu : 0);
+        if (allocations::enabled())
+          cout << "\t" << double(allocs) / chunks;
+        cout << endl;
+      }
+    }
+  }
+
+  return 0;
+}
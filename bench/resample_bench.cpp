@@ -0,0 +1,114 @@
+// Resampling cost per decoder chunk, built-in polyphase filter against soxr.
+//
+// Streams a synthetic voice-band signal through one resampler per engine in
+// chunks the size textToAudio emits (one 45-frame decoder window), timing
+// every process() call, for each rate pair and quality the daemon serves.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "paroli-daemon/Resampler.hpp"
+
+using namespace std;
+
+static double percentile(vector<double> samples, double p) {
+  if (samples.empty())
+    return 0;
+  sort(samples.begin(), samples.end());
+  size_t idx = min(samples.size() - 1, (size_t)(p * (samples.size() - 1) + 0.5));
+  return samples[idx];
+}
+
+static const char *qualityName(ResampleQuality quality) {
+  switch (quality) {
+  case ResampleQuality::Low:
+    return "low";
+  case ResampleQuality::Medium:
+    return "medium";
+  case ResampleQuality::High:
+    return "high";
+  }
+  return "";
+}
+
+static void printUsage(const char *argv0) {
+  cerr << endl;
+  cerr << "usage: " << argv0 << " [options]" << endl;
+  cerr << endl;
+  cerr << "options:" << endl;
+  cerr << "   --input_rate            NUM   voice sample rate (default: 22050)"
+       << endl;
+  cerr << "   --chunk                 NUM   samples per chunk (default: 11520)"
+       << endl;
+  cerr << "   --chunks                NUM   chunks per run (default: 500)"
+       << endl;
+  cerr << endl;
+}
+
+int main(int argc, char *argv[]) {
+  int inRate = 22050;
+  size_t chunkSize = 45 * 256;
+  size_t chunks = 500;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if ((arg == "--input_rate" || arg == "--input-rate") && hasValue) {
+      inRate = max(1000, stoi(argv[++i]));
+    } else if (arg == "--chunk" && hasValue) {
+      chunkSize = max(64, stoi(argv[++i]));
+    } else if (arg == "--chunks" && hasValue) {
+      chunks = max(1, stoi(argv[++i]));
+    } else {
+      printUsage(argv[0]);
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+
+  // A few drifting partials plus noise, roughly the spectrum of speech
+  mt19937 rng(1234);
+  normal_distribution<float> noise(0.0f, 0.02f);
+  vector<float> signal(chunkSize * 8);
+  for (size_t i = 0; i < signal.size(); i++) {
+    double t = double(i) / inRate;
+    signal[i] = 0.3f * sin(2 * M_PI * (180 + 40 * sin(t)) * t) +
+                0.1f * sin(2 * M_PI * 1200 * t) +
+                0.05f * sin(2 * M_PI * 3400 * t) + noise(rng);
+  }
+
+  cout << "engine\tquality\tout_rate\tchunks\tp50_us\tp99_us\tx_realtime"
+       << endl;
+
+  const double chunkSeconds = double(chunkSize) / inRate;
+  for (int outRate : {24000, 16000, 8000, 48000}) {
+    for (auto quality : {ResampleQuality::Low, ResampleQuality::Medium,
+                         ResampleQuality::High}) {
+      for (bool builtIn : {true, false}) {
+        Resampler resampler(inRate, outRate, quality, builtIn);
+        vector<float> out;
+        vector<double> timings;
+        for (size_t c = 0; c < chunks; c++) {
+          size_t offset = (c % 8) * chunkSize;
+          span<const float> chunk(signal.data() + offset, chunkSize);
+          auto start = chrono::steady_clock::now();
+          resampler.process(chunk, out);
+          timings.push_back(
+              chrono::duration<double>(chrono::steady_clock::now() - start)
+                  .count());
+        }
+        double p50 = percentile(timings, 0.5);
+        cout << (resampler.builtIn() ? "builtin" : "soxr") << "\t"
+             << qualityName(quality) << "\t" << outRate << "\t" << chunks
+             << "\t" << p50 * 1e6 << "\t" << percentile(timings, 0.99) * 1e6
+             << "\t" << (p50 > 0 ? chunkSeconds / p50 : 0) << endl;
+      }
+    }
+  }
+
+  return 0;
+}
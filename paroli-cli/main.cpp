@@ -77,7 +77,9 @@ struct RunConfig {
 
   // stdin input is lines of JSON instead of text with format:
   // {
-  //   "text": str,               (required)
+  //   "text": str,               (required, unless one of the next two)
+  //   "phonemes": str,           (optional, IPA; skips eSpeak)
+  //   "phoneme_ids": [int],      (optional, or [[int]] per sentence)
   //   "speaker_id": int,         (optional)
   //   "speaker": str,            (optional)
   //   "output_file": str,        (optional)
@@ -87,6 +89,13 @@ struct RunConfig {
   // Seconds of extra silence to insert after a single phoneme
   optional<std::map<piper::Phoneme, float>> phonemeSilenceSeconds;
 
+  // Split phrases longer than this many phonemes at clause boundaries
+  optional<std::size_t> maxPhrasePhonemes;
+
+  // ONNX input shape buckets (see piper::PiperConfig)
+  optional<std::vector<int64_t>> encoderShapeBuckets;
+  optional<std::vector<int64_t>> decoderShapeBuckets;
+
   // Set to whatever accelerator is available for ONNX. Ex: "cuda"
   // This has 0 affect if the underlying model is not handled by ONNX.
   std::string accelerator = "";
@@ -113,6 +122,13 @@ int main(int argc, char *argv[]) {
   spdlog::debug("Encoder model: {}", runConfig.encoderPath.string());
   spdlog::debug("Decoder model: {}", runConfig.decoderPath.string());
 
+  if (runConfig.encoderShapeBuckets) {
+    piperConfig.encoderShapeBuckets = *runConfig.encoderShapeBuckets;
+  }
+  if (runConfig.decoderShapeBuckets) {
+    piperConfig.decoderShapeBuckets = *runConfig.decoderShapeBuckets;
+  }
+
   auto startTime = chrono::steady_clock::now();
   loadVoice(piperConfig, "", runConfig.encoderPath.string(), runConfig.decoderPath.string(),
             runConfig.modelConfigPath.string(), voice, runConfig.speakerId,
@@ -222,6 +238,10 @@ int main(int argc, char *argv[]) {
 
   } // if phonemeSilenceSeconds
 
+  if (runConfig.maxPhrasePhonemes) {
+    voice.synthesisConfig.maxPhrasePhonemes = runConfig.maxPhrasePhonemes;
+  }
+
   if (runConfig.outputType == OUTPUT_DIRECTORY) {
     runConfig.outputPath = filesystem::absolute(runConfig.outputPath.value());
     spdlog::info("Output directory: {}", runConfig.outputPath.value().string());
@@ -233,13 +253,29 @@ int main(int argc, char *argv[]) {
     auto outputType = runConfig.outputType;
     auto speakerId = voice.synthesisConfig.speakerId;
     std::optional<filesystem::path> maybeOutputPath = runConfig.outputPath;
+    piper::SynthesisInput input;
 
     if (runConfig.jsonInput) {
       // Each line is a JSON object
       json lineRoot = json::parse(line);
 
-      // Text is required
-      line = lineRoot["text"].get<std::string>();
+      // Text is required, unless phonemes or phoneme ids are given
+      if (lineRoot.contains("phoneme_ids")) {
+        auto &ids = lineRoot["phoneme_ids"];
+        if (!ids.empty() && ids[0].is_array()) {
+          input.phonemeIds =
+              ids.get<std::vector<std::vector<piper::PhonemeId>>>();
+        } else {
+          input.phonemeIds = std::vector<std::vector<piper::PhonemeId>>{
+              ids.get<std::vector<piper::PhonemeId>>()};
+        }
+        line.clear();
+      } else if (lineRoot.contains("phonemes")) {
+        input.phonemes = lineRoot["phonemes"].get<std::string>();
+        line.clear();
+      } else {
+        line = lineRoot["text"].get<std::string>();
+      }
 
       if (lineRoot.contains("output_file")) {
         // Override output WAV file path
@@ -265,6 +301,8 @@ int main(int argc, char *argv[]) {
       }
     }
 
+    input.text = line;
+
     // Timestamp is used for path to output WAV file
     const auto now = chrono::system_clock::now();
     const auto timestamp =
@@ -280,7 +318,7 @@ int main(int argc, char *argv[]) {
 
       // Output audio to automatically-named WAV file in a directory
       ofstream audioFile(outputPath.string(), ios::binary);
-      piper::textToWavFile(piperConfig, voice, line, audioFile, result);
+      piper::textToWavFile(piperConfig, voice, input, audioFile, result);
       spdlog::info("Wrote {}", outputPath.string());
     } else if (outputType == OUTPUT_FILE) {
       if (!maybeOutputPath || maybeOutputPath->empty()) {
@@ -300,31 +338,31 @@ int main(int argc, char *argv[]) {
 
         line = text.str();
       }
+      input.text = line;
 
       // Output audio to WAV file
       ofstream audioFile(outputPath.string(), ios::binary);
-      piper::textToWavFile(piperConfig, voice, line, audioFile, result);
+      piper::textToWavFile(piperConfig, voice, input, audioFile, result);
       cout << outputPath.string() << endl;
     } else if (outputType == OUTPUT_STDOUT) {
       // Output WAV to stdout
-      piper::textToWavFile(piperConfig, voice, line, cout, result);
+      piper::textToWavFile(piperConfig, voice, input, cout, result);
     } else if (outputType == OUTPUT_RAW) {
       // Raw output to stdout
-      vector<int16_t> audioBuffer;
 #ifdef _WIN32
       // Needed on Windows to avoid terminal conversions
       setmode(fileno(stdout), O_BINARY);
       setmode(fileno(stdin), O_BINARY);
 #endif
 
-      auto audioCallback = [&audioBuffer]() {
-        // Signal thread that audio is ready
-        cout.write((const char *)audioBuffer.data(),
-                   sizeof(int16_t) * audioBuffer.size());
+      vector<int16_t> pcm;
+      auto audioCallback = [&pcm](const piper::AudioChunk &chunk) {
+        pcm.resize(chunk.samples.size());
+        piper::audioToPcm16(chunk.samples, pcm.data());
+        cout.write((const char *)pcm.data(), sizeof(int16_t) * pcm.size());
         cout.flush();
       };
-      piper::textToAudio(piperConfig, voice, line, audioBuffer, result,
-                         audioCallback);
+      piper::textToAudio(piperConfig, voice, input, result, audioCallback);
 
       // Wait for audio output to finish
       spdlog::info("Waiting for audio to finish playing...");
@@ -376,6 +414,15 @@ void printUsage(char *argv[]) {
   cerr << "   --sentence_silence      NUM   seconds of silence after each "
           "sentence (default: 0.2)"
        << endl;
+  cerr << "   --max_phrase_length     NUM   split phrases longer than NUM "
+          "phonemes at clauses (0 = never)"
+       << endl;
+  cerr << "   --encoder_buckets       LIST  pad encoder inputs up to these "
+          "phoneme id counts (default: 64,128,256,512; none = off)"
+       << endl;
+  cerr << "   --decoder_buckets       LIST  pad decoder windows up to these "
+          "frame counts (default: 55; none = off)"
+       << endl;
   cerr << "   --espeak_data           DIR   path to espeak-ng data directory"
        << endl;
   cerr << "   --tashkeel_model        FILE  path to libtashkeel onnx model "
@@ -449,6 +496,16 @@ void parseArgs(int argc, char *argv[], RunConfig &runConfig) {
     } else if (arg == "--sentence_silence" || arg == "--sentence-silence") {
       ensureArg(argc, argv, i);
       runConfig.sentenceSilenceSeconds = stof(argv[++i]);
+    } else if (arg == "--max_phrase_length" ||
+               arg == "--max-phrase-length") {
+      ensureArg(argc, argv, i);
+      runConfig.maxPhrasePhonemes = std::max(0, stoi(argv[++i]));
+    } else if (arg == "--encoder_buckets" || arg == "--encoder-buckets") {
+      ensureArg(argc, argv, i);
+      runConfig.encoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
+    } else if (arg == "--decoder_buckets" || arg == "--decoder-buckets") {
+      ensureArg(argc, argv, i);
+      runConfig.decoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
     } else if (arg == "--phoneme_silence" || arg == "--phoneme-silence") {
       ensureArg(argc, argv, i);
       ensureArg(argc, argv, i + 1);
@@ -0,0 +1,49 @@
+#include "AllocationCounter.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+thread_local uint64_t tAllocations = 0;
+}
+
+namespace allocations {
+#ifdef PAROLI_COUNT_ALLOCATIONS
+bool enabled() { return true; }
+#else
+bool enabled() { return false; }
+#endif
+
+uint64_t thisThread() { return tAllocations; }
+}
+
+#ifdef PAROLI_COUNT_ALLOCATIONS
+// The array and nothrow forms forward to these in libstdc++, so they are
+// counted too
+
+namespace {
+void* allocate(std::size_t size, std::size_t alignment) {
+    tAllocations++;
+    if (size == 0) size = 1;
+    while (true) {
+        void* p = alignment > alignof(std::max_align_t)
+                      ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+                      : std::malloc(size);
+        if (p) return p;
+        auto handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+}
+
+void* operator new(std::size_t size) { return allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// Heap allocations (global operator new) made by the calling thread, to check
+// that steady-state synthesis and output stay off the heap. Only counted in
+// builds configured with -DCOUNT_ALLOCATIONS=ON, which replace the global
+// allocation functions; otherwise enabled() is false and the count stays 0.
+namespace allocations {
+bool enabled();
+uint64_t thisThread();
+}
@@ -0,0 +1,77 @@
+#include "AudioEncoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "OggOpusEncoder.hpp"
+#include "piper/piper.hpp"
+
+using namespace std;
+
+array<uint8_t, 44> wavHeader(int sampleRate, int channels, uint32_t dataBytes) {
+    array<uint8_t, 44> h{};
+    auto put16 = [&](size_t at, uint16_t v) {
+        h[at] = v & 0xff;
+        h[at + 1] = v >> 8;
+    };
+    auto put32 = [&](size_t at, uint32_t v) {
+        put16(at, v & 0xffff);
+        put16(at + 2, v >> 16);
+    };
+    memcpy(h.data(), "RIFF", 4);
+    put32(4, dataBytes == UINT32_MAX ? UINT32_MAX : dataBytes + 36);
+    memcpy(h.data() + 8, "WAVEfmt ", 8);
+    put32(16, 16);
+    put16(20, 1); // PCM
+    put16(22, channels);
+    put32(24, sampleRate);
+    put32(28, sampleRate * channels * sizeof(int16_t));
+    put16(32, channels * sizeof(int16_t));
+    put16(34, 16);
+    memcpy(h.data() + 36, "data", 4);
+    put32(40, dataBytes);
+    return h;
+}
+
+PcmEncoder::PcmEncoder(int sampleRate, bool f32, bool wav) : sampleRate_(sampleRate), f32_(f32 && !wav), wav_(wav) {}
+
+void PcmEncoder::setLength(uint64_t samples) {
+    headerBytes_ = uint32_t(min<uint64_t>(samples * sizeof(int16_t), UINT32_MAX - 36));
+}
+
+void PcmEncoder::writeHeader(vector<uint8_t>& out) {
+    if (!wav_ || headerWritten_) return;
+    auto header = wavHeader(sampleRate_, 1, headerBytes_);
+    out.insert(out.end(), header.begin(), header.end());
+    headerWritten_ = true;
+}
+
+void PcmEncoder::encode(span<const float> data, vector<uint8_t>& out) {
+    writeHeader(out);
+    if (data.empty()) return;
+    const size_t bytes = data.size() * (f32_ ? sizeof(float) : sizeof(int16_t));
+    const size_t at = out.size();
+    out.resize(at + bytes);
+    if (f32_) {
+        piper::audioToPcmF32(data, reinterpret_cast<float*>(out.data() + at));
+    } else {
+        piper::audioToPcm16(data, reinterpret_cast<int16_t*>(out.data() + at));
+    }
+    dataBytes_ += bytes;
+}
+
+void PcmEncoder::finish(vector<uint8_t>& out) {
+    // An empty stream is still a valid file
+    writeHeader(out);
+}
+
+shared_ptr<AudioEncoder> makeEncoder(const string& format, int sampleRate, const OpusOptions& options) {
+    if (format == "opus" || format == "opus_raw") {
+        return makeOpusEncoder(format == "opus_raw", size_t(sampleRate), 1, options);
+    }
+    if (format == "wav" || format == "pcm" || format == "pcm_f32") {
+        return make_shared<PcmEncoder>(sampleRate, format == "pcm_f32", format == "wav");
+    }
+    throw runtime_error("Unsupported format (opus|opus_raw|wav|pcm|pcm_f32)");
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+struct OpusOptions;
+
+// Audio in and out of the encoders is float, as produced by the decoder;
+// libopus takes it without a round trip through 16 bits
+struct AudioEncoder {
+    virtual ~AudioEncoder() = default;
+    // Appends the bytes completed by `data` to `out`
+    virtual void encode(std::span<const float> data, std::vector<uint8_t>& out) = 0;
+    // Appends whatever is still buffered, and the end of the stream
+    virtual void finish(std::vector<uint8_t>& out) = 0;
+    // Length of the whole stream in samples, when it is known before the
+    // first audio; formats with nowhere to put it ignore it
+    virtual void setLength(uint64_t samples) {}
+};
+
+// 44-byte PCM WAV header; 0xFFFFFFFF sizes mark a stream of unknown length
+std::array<uint8_t, 44> wavHeader(int sampleRate, int channels, uint32_t dataBytes);
+
+// 16-bit or float32 PCM, clipped and converted in one pass, optionally
+// behind a WAV header. The header goes out ahead of the first audio with
+// the predicted length if one was set, else with sizes marked unknown; a
+// seekable destination can patch it with the real length once the stream
+// is done.
+class PcmEncoder : public AudioEncoder {
+public:
+    PcmEncoder(int sampleRate, bool f32, bool wav);
+
+    void encode(std::span<const float> data, std::vector<uint8_t>& out) override;
+    void finish(std::vector<uint8_t>& out) override;
+
+    // Goes into the WAV header
+    void setLength(uint64_t samples) override;
+
+    // Bytes of samples so far, not counting the header
+    uint64_t dataBytes() const { return dataBytes_; }
+
+private:
+    void writeHeader(std::vector<uint8_t>& out);
+
+    int sampleRate_;
+    bool f32_;
+    bool wav_;
+    bool headerWritten_ = false;
+    uint32_t headerBytes_ = UINT32_MAX;
+    uint64_t dataBytes_ = 0;
+};
+
+// Encoder for a response format (opus|opus_raw|wav|pcm|pcm_f32) at
+// `sampleRate`; throws for other formats
+std::shared_ptr<AudioEncoder> makeEncoder(const std::string& format, int sampleRate, const OpusOptions& options);
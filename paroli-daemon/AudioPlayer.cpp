@@ -0,0 +1,144 @@
+#include "AudioPlayer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+#include <alsa/asoundlib.h>
+#include <spdlog/spdlog.h>
+
+#include "piper/piper.hpp"
+
+using namespace std;
+
+namespace {
+[[noreturn]] void alsaError(snd_pcm_t* pcm, const string& what, int err) {
+    if (pcm) snd_pcm_close(pcm);
+    throw runtime_error(what + ": " + snd_strerror(err));
+}
+}
+
+AudioPlayer::AudioPlayer(const string& device, int sampleRate, int bufferMs, size_t ringChunks)
+    : sampleRate_(sampleRate), ring_(ringChunks) {
+    int err;
+    if ((err = snd_pcm_open(&pcm_, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        pcm_ = nullptr;
+        alsaError(nullptr, "Cannot open audio device " + device, err);
+    }
+
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(pcm_, params);
+    snd_pcm_hw_params_set_access(pcm_, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(pcm_, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(pcm_, params, 1);
+    unsigned int rate = unsigned(sampleRate);
+    if ((err = snd_pcm_hw_params_set_rate_near(pcm_, params, &rate, 0)) < 0) {
+        alsaError(pcm_, "Cannot set sample rate", err);
+    }
+    // Played at another rate, speech would come out at the wrong pitch and
+    // speed; a "plug" device resamples instead
+    if (rate != unsigned(sampleRate)) {
+        snd_pcm_close(pcm_);
+        throw runtime_error("Audio device " + device + " cannot play " + to_string(sampleRate) + " Hz (nearest is " +
+                            to_string(rate) + " Hz)");
+    }
+    // A few periods per buffer, so the device asks for more well before it
+    // runs dry
+    snd_pcm_uframes_t bufferSize = snd_pcm_uframes_t(rate) * unsigned(max(bufferMs, 20)) / 1000;
+    snd_pcm_uframes_t periodSize = bufferSize / 4;
+    if ((err = snd_pcm_hw_params_set_buffer_size_near(pcm_, params, &bufferSize)) < 0) {
+        alsaError(pcm_, "Cannot set buffer size", err);
+    }
+    snd_pcm_hw_params_set_period_size_near(pcm_, params, &periodSize, 0);
+    if ((err = snd_pcm_hw_params(pcm_, params)) < 0) {
+        alsaError(pcm_, "Cannot set parameters", err);
+    }
+    snd_pcm_get_params(pcm_, &bufferSize, &periodSize);
+
+    // Start with the first period instead of waiting for a full buffer
+    snd_pcm_sw_params_t *swParams;
+    snd_pcm_sw_params_alloca(&swParams);
+    snd_pcm_sw_params_current(pcm_, swParams);
+    snd_pcm_sw_params_set_start_threshold(pcm_, swParams, periodSize);
+    if ((err = snd_pcm_sw_params(pcm_, swParams)) < 0) {
+        alsaError(pcm_, "Cannot set start threshold", err);
+    }
+    if ((err = snd_pcm_prepare(pcm_)) < 0) {
+        alsaError(pcm_, "Cannot prepare audio device", err);
+    }
+
+    thread_ = thread([this]() { run(); });
+}
+
+AudioPlayer::~AudioPlayer() {
+    ring_.close();
+    thread_.join();
+    snd_pcm_close(pcm_);
+}
+
+void AudioPlayer::checkFailed() {
+    if (failed_.load(memory_order_acquire)) throw runtime_error(error_);
+}
+
+void AudioPlayer::write(span<const float> audio, float gain) {
+    if (audio.empty()) return;
+    checkFailed();
+    auto& chunk = ring_.claim();
+    chunk.samples.resize(audio.size());
+    piper::audioToPcm16(audio, chunk.samples.data(), gain);
+    chunk.last = false;
+    ring_.publish();
+}
+
+void AudioPlayer::endUtterance() {
+    auto& chunk = ring_.claim();
+    chunk.samples.clear();
+    chunk.last = true;
+    ring_.publish();
+}
+
+void AudioPlayer::run() {
+    while (ring_.wait() > 0) {
+        auto& chunk = ring_[0];
+        // After a failure, keep taking chunks so the producer never blocks;
+        // it throws on its next write instead
+        if (!failed_.load(memory_order_relaxed)) {
+            try {
+                play(chunk.samples);
+                if (chunk.last && ring_.ready() == 1) {
+                    // Nothing else queued: let the device play out and stop
+                    // rather than run dry
+                    snd_pcm_drain(pcm_);
+                    snd_pcm_prepare(pcm_);
+                }
+            } catch (const exception& e) {
+                error_ = e.what();
+                failed_.store(true, memory_order_release);
+                spdlog::error("Playback failed: {}", error_);
+            }
+        }
+        ring_.release(1);
+    }
+    if (!failed_.load(memory_order_relaxed)) snd_pcm_drain(pcm_);
+}
+
+void AudioPlayer::play(const vector<int16_t>& samples) {
+    const int16_t* data = samples.data();
+    size_t left = samples.size();
+    while (left > 0) {
+        snd_pcm_sframes_t frames = snd_pcm_writei(pcm_, data, left);
+        if (frames < 0) {
+            // Underrun or suspend: restart the stream and write the rest
+            if (frames == -EPIPE) {
+                underruns_.fetch_add(1, memory_order_relaxed);
+                spdlog::debug("Playback underrun");
+            }
+            int err = snd_pcm_recover(pcm_, int(frames), 1);
+            if (err < 0) throw runtime_error(string("Audio write failed: ") + snd_strerror(err));
+            continue;
+        }
+        data += frames;
+        left -= size_t(frames);
+    }
+}
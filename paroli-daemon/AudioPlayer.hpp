@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SpscRing.hpp"
+
+typedef struct _snd_pcm snd_pcm_t;
+
+// Plays mono audio on an ALSA device that stays open from one utterance to
+// the next. Chunks are queued as they are synthesized and a playback thread
+// feeds them to the device, so sound starts with the first decoder chunk and
+// the caller can go on to synthesize the next utterance while this one plays.
+// Utterances queued back to back play without a gap; the device is drained
+// only when nothing more is waiting.
+//
+// Audio waits in a ring of `ringChunks` chunks ahead of the device's own
+// buffer of `bufferMs`. The ring absorbs synthesis that briefly falls behind
+// real time, the device buffer scheduling jitter of the playback thread.
+//
+// One producer at a time: callers serialize write() and endUtterance().
+class AudioPlayer {
+public:
+    // Throws if `device` cannot be opened at `sampleRate`
+    AudioPlayer(const std::string& device, int sampleRate, int bufferMs = 200, size_t ringChunks = 8);
+    // Plays out whatever is queued, then closes the device
+    ~AudioPlayer();
+
+    AudioPlayer(const AudioPlayer&) = delete;
+    AudioPlayer& operator=(const AudioPlayer&) = delete;
+
+    int sampleRate() const { return sampleRate_; }
+
+    // Queue one chunk, scaled by `gain`, blocking while the ring is full.
+    // Throws once playback has failed.
+    void write(std::span<const float> audio, float gain = 1.0f);
+    // The utterance is complete; playback drains unless another follows
+    void endUtterance();
+
+    bool failed() const { return failed_.load(std::memory_order_acquire); }
+    // Times the device ran dry and was restarted
+    uint64_t underruns() const { return underruns_.load(std::memory_order_relaxed); }
+
+private:
+    struct Chunk {
+        std::vector<int16_t> samples; // keeps its capacity from chunk to chunk
+        bool last = false;
+    };
+
+    void run();
+    void play(const std::vector<int16_t>& samples);
+    void checkFailed();
+
+    snd_pcm_t* pcm_ = nullptr;
+    int sampleRate_;
+    SpscRing<Chunk> ring_;
+    std::atomic<bool> failed_{false};
+    std::string error_; // set before failed_
+    std::atomic<uint64_t> underruns_{0};
+    std::thread thread_;
+};
@@ -0,0 +1,41 @@
+#include "AudioSink.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+void AudioSink::writeAt(size_t, const uint8_t*, size_t) {
+    throw runtime_error("Audio sink is not seekable");
+}
+
+FileSink::FileSink(const filesystem::path& path) : file_(path, ios::binary | ios::trunc) {
+    if (!file_.is_open()) throw runtime_error("Cannot open file: " + path.string());
+}
+
+void FileSink::write(const uint8_t* data, size_t n) {
+    file_.write(reinterpret_cast<const char*>(data), n);
+    if (!file_) throw runtime_error("Audio file write failed");
+}
+
+void FileSink::writeAt(size_t offset, const uint8_t* data, size_t n) {
+    auto end = file_.tellp();
+    file_.seekp(offset);
+    file_.write(reinterpret_cast<const char*>(data), n);
+    file_.seekp(end);
+    if (!file_) throw runtime_error("Audio file write failed");
+}
+
+void FileSink::flush() {
+    file_.flush();
+}
+
+void MemorySink::write(const uint8_t* data, size_t n) {
+    buffer_.insert(buffer_.end(), data, data + n);
+}
+
+void MemorySink::writeAt(size_t offset, const uint8_t* data, size_t n) {
+    if (start_ + offset + n > buffer_.size()) throw runtime_error("Audio sink write past the end");
+    memcpy(buffer_.data() + start_ + offset, data, n);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <vector>
+
+// Destination that ParoliSynthesizer writes encoded audio into as each chunk
+// is produced, so a request never holds more than a chunk of it in memory.
+class AudioSink {
+public:
+    virtual ~AudioSink() = default;
+
+    virtual void write(const uint8_t* data, size_t n) = 0;
+
+    // Sinks that can rewrite earlier bytes let WAV patch its header with the
+    // real length once synthesis is done. The others get a header with sizes
+    // marked unknown, or the predicted ones when the caller asked for a
+    // prediction. Offsets count from the first byte written here.
+    virtual bool seekable() const { return false; }
+    virtual void writeAt(size_t offset, const uint8_t* data, size_t n);
+
+    virtual void flush() {}
+};
+
+class FileSink : public AudioSink {
+public:
+    explicit FileSink(const std::filesystem::path& path);
+
+    void write(const uint8_t* data, size_t n) override;
+    bool seekable() const override { return true; }
+    void writeAt(size_t offset, const uint8_t* data, size_t n) override;
+    void flush() override;
+
+private:
+    std::ofstream file_;
+};
+
+// Appends to a caller's buffer
+class MemorySink : public AudioSink {
+public:
+    explicit MemorySink(std::vector<uint8_t>& buffer) : buffer_(buffer) {}
+
+    void write(const uint8_t* data, size_t n) override;
+    bool seekable() const override { return true; }
+    void writeAt(size_t offset, const uint8_t* data, size_t n) override;
+
+private:
+    std::vector<uint8_t>& buffer_;
+    size_t start_ = buffer_.size();
+};
+
+// Hands every write to a function, e.g. a response channel
+class CallbackSink : public AudioSink {
+public:
+    using Fn = std::function<void(const uint8_t* data, size_t n)>;
+
+    explicit CallbackSink(Fn fn) : fn_(std::move(fn)) {}
+
+    void write(const uint8_t* data, size_t n) override { fn_(data, n); }
+
+private:
+    Fn fn_;
+};
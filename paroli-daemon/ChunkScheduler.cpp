@@ -0,0 +1,163 @@
+#include "ChunkScheduler.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+#include <spdlog/spdlog.h>
+
+using namespace std;
+
+namespace {
+// First-audio deadline of interactive requests that did not ask for one
+constexpr auto kDefaultFirstChunk = chrono::milliseconds(300);
+// Headroom before the client would run dry, for output and network delay
+constexpr auto kUnderrunMargin = chrono::milliseconds(100);
+// How long an interactive request may keep its slot between two units
+constexpr auto kReserveHold = chrono::milliseconds(50);
+}
+
+ChunkScheduler::ChunkScheduler(int slots) : freeSlots_(max(1, slots)) {}
+
+unique_ptr<ChunkScheduler::Ticket> ChunkScheduler::ticket(Priority priority, optional<Clock::time_point> deadline,
+                                                          int sampleRate, CancelToken* cancel) {
+    if (!deadline && priority == Priority::Interactive) deadline = Clock::now() + kDefaultFirstChunk;
+    return unique_ptr<Ticket>(new Ticket(*this, priority, deadline, sampleRate, cancel));
+}
+
+size_t ChunkScheduler::lateUnits() const {
+    lock_guard<mutex> lk(mtx_);
+    return lateUnits_;
+}
+
+const ChunkScheduler::Ticket* ChunkScheduler::next() const {
+    const Ticket* best = nullptr;
+    for (auto* t : waiting_) {
+        if (!best || make_tuple(t->priority_, t->deadline(), t->seq_) <
+                         make_tuple(best->priority_, best->deadline(), best->seq_)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+void ChunkScheduler::releaseLocked(Ticket* t) {
+    reserving_.erase(find(reserving_.begin(), reserving_.end(), t));
+    t->reservedAt_.reset();
+    freeSlots_++;
+}
+
+// Hands reserved slots back once another interactive unit wants one, or
+// once their holder has stopped producing; wakes the waiters if it did
+void ChunkScheduler::reclaimLocked() {
+    bool interactiveWaiting = any_of(waiting_.begin(), waiting_.end(),
+                                     [](const Ticket* t) { return t->priority_ == Priority::Interactive; });
+    auto now = Clock::now();
+    bool released = false;
+    for (size_t i = reserving_.size(); i-- > 0;) {
+        Ticket* t = reserving_[i];
+        if (interactiveWaiting || cancelled(t) || now - *t->reservedAt_ >= kReserveHold) {
+            releaseLocked(t);
+            released = true;
+        }
+    }
+    if (released) cv_.notify_all();
+}
+
+void ChunkScheduler::wakeAll() {
+    {
+        lock_guard<mutex> lk(mtx_);
+    }
+    cv_.notify_all();
+}
+
+// ----------------------------------------------------------------------------
+
+ChunkScheduler::Ticket::Ticket(ChunkScheduler& sched, Priority priority, optional<Clock::time_point> deadline,
+                               int sampleRate, CancelToken* cancel)
+    : sched_(sched), priority_(priority), firstDeadline_(deadline), sampleRate_(sampleRate), cancel_(cancel) {
+    lock_guard<mutex> lk(sched_.mtx_);
+    seq_ = sched_.nextSeq_++;
+}
+
+ChunkScheduler::Ticket::~Ticket() {
+    // Unwinding out of a unit without leave() must not leak the slot, and a
+    // finished request gives up its reservation
+    {
+        lock_guard<mutex> lk(sched_.mtx_);
+        if (holding_) {
+            holding_ = false;
+            sched_.freeSlots_++;
+        }
+        if (reservedAt_) sched_.releaseLocked(this);
+    }
+    sched_.cv_.notify_all();
+}
+
+ChunkScheduler::Clock::time_point ChunkScheduler::Ticket::deadline() const {
+    if (playStart_ && sampleRate_ > 0) {
+        auto played = chrono::duration<double>(double(samples_) / sampleRate_);
+        return *playStart_ + chrono::duration_cast<Clock::duration>(played) - kUnderrunMargin;
+    }
+    return firstDeadline_.value_or(Clock::time_point::max());
+}
+
+void ChunkScheduler::Ticket::enter() {
+    // Registered before taking the scheduler lock: cancel() calls the hook
+    // with the token's lock held
+    auto interrupt = CancelToken::interruptWith(cancel_, [this]() { sched_.wakeAll(); });
+
+    unique_lock<mutex> lk(sched_.mtx_);
+    if (reservedAt_ && !sched_.cancelled(this)) {
+        // Still ours from the previous unit
+        sched_.reserving_.erase(find(sched_.reserving_.begin(), sched_.reserving_.end(), this));
+        reservedAt_.reset();
+        holding_ = true;
+    } else {
+        if (reservedAt_) sched_.releaseLocked(this);
+        sched_.waiting_.push_back(this);
+        sched_.reclaimLocked();
+        // Reservations expire on their own, so poll while there are any
+        auto ready = [&]() { return sched_.cancelled(this) || (sched_.freeSlots_ > 0 && sched_.next() == this); };
+        while (!ready()) {
+            if (sched_.reserving_.empty()) {
+                sched_.cv_.wait(lk);
+            } else {
+                sched_.cv_.wait_for(lk, kReserveHold);
+            }
+            sched_.reclaimLocked();
+        }
+        sched_.waiting_.erase(find(sched_.waiting_.begin(), sched_.waiting_.end(), this));
+        if (!sched_.cancelled(this)) {
+            sched_.freeSlots_--;
+            holding_ = true;
+        }
+    }
+    if (holding_ && priority_ == Priority::Interactive && Clock::now() > deadline()) {
+        sched_.lateUnits_++;
+        spdlog::debug("Interactive unit started {} ms past its deadline",
+                      chrono::duration<double, milli>(Clock::now() - deadline()).count());
+    }
+    lk.unlock();
+    // Whoever is next in line re-evaluates
+    sched_.cv_.notify_all();
+}
+
+void ChunkScheduler::Ticket::leave(size_t samples) {
+    {
+        lock_guard<mutex> lk(sched_.mtx_);
+        if (samples > 0) {
+            if (!playStart_) playStart_ = Clock::now();
+            samples_ += samples;
+        }
+        if (!holding_) return;
+        holding_ = false;
+        if (priority_ == Priority::Interactive) {
+            reservedAt_ = Clock::now();
+            sched_.reserving_.push_back(this);
+            sched_.reclaimLocked();
+        } else {
+            sched_.freeSlots_++;
+        }
+    }
+    sched_.cv_.notify_all();
+}
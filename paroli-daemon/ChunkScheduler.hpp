@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "piper/inferer.hpp"
+
+// Shares a fixed number of compute slots among every in-flight synthesis, one
+// unit (encoder call or decoder window) at a time. Requests run on their own
+// threads but must hold a slot for each unit, so a long article gives way to
+// a short prompt at the next chunk boundary instead of holding a worker for
+// minutes.
+//
+// Waiting units are ordered by priority class, then by deadline (EDF), then
+// by arrival. A request's deadline is the time its first chunk is due, and
+// once audio is flowing the time the client will have played everything
+// produced so far, i.e. when it would underrun. Bulk requests without a
+// deadline run whenever no interactive unit is waiting.
+//
+// An interactive request keeps its slot between units, so bulk work cannot
+// slip in between its chunks. The slot goes back to the pool as soon as
+// another interactive unit is waiting, or once the request has not come
+// back for kReserveHold (e.g. a text stream waiting for more text).
+class ChunkScheduler {
+public:
+    enum class Priority { Interactive = 0, Bulk = 1 };
+
+    using Clock = std::chrono::steady_clock;
+
+    class Ticket : public UnitGate {
+    public:
+        ~Ticket() override;
+
+        void enter() override;
+        void leave(size_t samples) override;
+
+    private:
+        friend class ChunkScheduler;
+        Ticket(ChunkScheduler& sched, Priority priority, std::optional<Clock::time_point> deadline,
+               int sampleRate, CancelToken* cancel);
+
+        Clock::time_point deadline() const;
+
+        ChunkScheduler& sched_;
+        Priority priority_;
+        std::optional<Clock::time_point> firstDeadline_;
+        int sampleRate_;
+        CancelToken* cancel_;
+        uint64_t seq_;
+        bool holding_ = false;
+        std::optional<Clock::time_point> reservedAt_; // slot kept since leave()
+        size_t samples_ = 0;
+        std::optional<Clock::time_point> playStart_;
+    };
+
+    explicit ChunkScheduler(int slots);
+
+    // Gate for one request. `deadline` is when its first audio is due;
+    // interactive requests without one get kDefaultFirstChunk.
+    std::unique_ptr<Ticket> ticket(Priority priority, std::optional<Clock::time_point> deadline, int sampleRate,
+                                   CancelToken* cancel);
+
+    // Interactive units that started after their deadline, i.e. likely
+    // underruns on the client
+    size_t lateUnits() const;
+
+private:
+    bool cancelled(const Ticket* t) const { return t->cancel_ && t->cancel_->cancelled(); }
+    const Ticket* next() const;
+    void wakeAll();
+    void releaseLocked(Ticket* t);
+    void reclaimLocked();
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    int freeSlots_;
+    uint64_t nextSeq_ = 0;
+    std::vector<Ticket*> waiting_;
+    std::vector<Ticket*> reserving_;
+    size_t lateUnits_ = 0;
+};
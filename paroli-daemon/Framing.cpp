@@ -0,0 +1,90 @@
+#include "Framing.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+
+using namespace std;
+
+namespace {
+uint32_t getLe32(const char* p) {
+    return uint32_t(uint8_t(p[0])) | (uint32_t(uint8_t(p[1])) << 8) | (uint32_t(uint8_t(p[2])) << 16) |
+           (uint32_t(uint8_t(p[3])) << 24);
+}
+}
+
+string encodeFrame(uint32_t id, FrameType type, const uint8_t* data, size_t n) {
+    string frame(kFrameHeaderSize + n, '\0');
+    auto* p = reinterpret_cast<uint8_t*>(frame.data());
+    putLe32(p, id);
+    p[4] = static_cast<uint8_t>(type);
+    putLe32(p + 5, static_cast<uint32_t>(n));
+    if (n > 0) std::memcpy(p + kFrameHeaderSize, data, n);
+    return frame;
+}
+
+optional<size_t> binaryRequestSize(const char* data, size_t n) {
+    if (n < kBinaryRequestHeaderSize) return nullopt;
+    return kBinaryRequestHeaderSize + getLe32(data + 10);
+}
+
+BinaryRequest decodeBinaryRequest(const string& record) {
+    if (record.size() < kBinaryRequestHeaderSize || uint8_t(record[0]) != kBinaryRequestMarker) {
+        throw runtime_error("Malformed binary request");
+    }
+    const char* p = record.data();
+    BinaryRequest req;
+    req.id = getLe32(p + 1);
+    switch (uint8_t(p[5])) {
+    case 0: req.format = "wav"; break;
+    case 1: req.format = "pcm"; break;
+    case 2: req.format = "opus"; break;
+    case 3: req.format = "pcm_f32"; break;
+    case 4: req.format = "opus_raw"; break;
+    default: throw runtime_error("Unsupported format code in binary request");
+    }
+    uint32_t sampleRate = getLe32(p + 6);
+    if (sampleRate != 0) req.sampleRate = static_cast<int>(sampleRate);
+    uint32_t textLength = getLe32(p + 10);
+    if (record.size() != kBinaryRequestHeaderSize + textLength) {
+        throw runtime_error("Binary request length mismatch");
+    }
+    req.text = record.substr(kBinaryRequestHeaderSize);
+    return req;
+}
+
+// ----------------------------------------------------------------------------
+
+void FramedChannel::begin(const ResponseInfo& info) {
+    if (done_) return;
+    nlohmann::json j;
+    j["format"] = info.format;
+    j["sample_rate"] = info.sampleRate;
+    if (info.samples) {
+        j["samples"] = *info.samples;
+        j["duration_ms"] = info.durationMs();
+    }
+    auto s = j.dump();
+    sink_(encodeFrame(id_, FrameType::Metadata, reinterpret_cast<const uint8_t*>(s.data()), s.size()));
+}
+
+void FramedChannel::audio(const uint8_t* data, size_t n) {
+    if (done_ || n == 0) return;
+    sink_(encodeFrame(id_, FrameType::Audio, data, n));
+}
+
+void FramedChannel::error(const string& msg) {
+    if (done_) return;
+    done_ = true;
+    nlohmann::json j;
+    j["error"] = msg;
+    auto s = j.dump();
+    sink_(encodeFrame(id_, FrameType::Error, reinterpret_cast<const uint8_t*>(s.data()), s.size()));
+}
+
+void FramedChannel::end() {
+    if (done_) return;
+    done_ = true;
+    sink_(encodeFrame(id_, FrameType::End, nullptr, 0));
+}
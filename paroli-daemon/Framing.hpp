@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+#include "ResponseChannel.hpp"
+
+// Multiplexed output framing (--framed). Every frame is
+//
+//   u32 request id | u8 type | u32 payload length | payload
+//
+// with integers little-endian, so responses to concurrent requests can share
+// one stream and be told apart by the client.
+enum class FrameType : uint8_t {
+    Audio = 1,    // encoded audio bytes
+    Metadata = 2, // JSON: {"format":..., "sample_rate":..., ["samples":..., "duration_ms":...]}
+    End = 3,      // empty; the request completed
+    Error = 4,    // JSON: {"error": "..."}; the request failed
+};
+
+constexpr size_t kFrameHeaderSize = 9;
+
+// Longest request a client may send: a JSON line, or the text of a binary
+// request
+constexpr size_t kMaxLineBytes = 1024 * 1024;
+
+std::string encodeFrame(uint32_t id, FrameType type, const uint8_t* data, size_t n);
+
+// Binary request encoding, accepted wherever JSON request lines are, for
+// clients that want to skip JSON at high request rates:
+//
+//   u8 0x00 | u32 request id | u8 format | u32 sample rate | u32 text length | text
+//
+// format is 0 = wav, 1 = pcm, 2 = opus, 3 = pcm_f32, 4 = opus_raw; a sample
+// rate of 0 means default.
+// The leading zero byte can never start a JSON line.
+constexpr uint8_t kBinaryRequestMarker = 0x00;
+constexpr size_t kBinaryRequestHeaderSize = 14;
+
+struct BinaryRequest {
+    uint32_t id = 0;
+    std::string format;
+    std::optional<int> sampleRate;
+    std::string text;
+};
+
+// Total size of the binary request at the start of `data`, or nullopt if
+// more bytes are needed to tell
+std::optional<size_t> binaryRequestSize(const char* data, size_t n);
+
+// Throws on malformed input
+BinaryRequest decodeBinaryRequest(const std::string& record);
+
+// ResponseChannel producing frames for one request
+class FramedChannel : public ResponseChannel {
+public:
+    using Sink = std::function<void(std::string frame)>;
+
+    explicit FramedChannel(Sink sink) : sink_(std::move(sink)) {}
+
+    void setRequestId(uint32_t id) override { id_ = id; }
+    void begin(const ResponseInfo& info) override;
+    void audio(const uint8_t* data, size_t n) override;
+    void error(const std::string& msg) override;
+    void end() override;
+
+    // Frames are self-delimiting, so audio always goes out chunk by chunk
+    bool streaming() const override { return true; }
+
+protected:
+    bool done_ = false;
+
+private:
+    Sink sink_;
+    uint32_t id_ = 0;
+};
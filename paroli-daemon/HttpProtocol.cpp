@@ -0,0 +1,575 @@
+#include "HttpProtocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace {
+constexpr size_t kMaxHeadBytes = 64 * 1024;
+constexpr size_t kMaxBodyBytes = 1024 * 1024;
+constexpr size_t kMaxMessageBytes = 1024 * 1024;
+const string kWebSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+enum WsOpcode : uint8_t {
+    WsContinuation = 0x0,
+    WsText = 0x1,
+    WsBinary = 0x2,
+    WsClose = 0x8,
+    WsPing = 0x9,
+    WsPong = 0xA,
+};
+
+// ----------------------------------------------------------------------------
+// Small helpers
+
+array<uint8_t, 20> sha1(const string& input) {
+    auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    string msg = input;
+    uint64_t bitLen = static_cast<uint64_t>(input.size()) * 8;
+    msg.push_back(static_cast<char>(0x80));
+    while (msg.size() % 64 != 56) msg.push_back(0);
+    for (int i = 7; i >= 0; i--) msg.push_back(static_cast<char>((bitLen >> (i * 8)) & 0xFF));
+
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t(uint8_t(msg[chunk + i * 4])) << 24) | (uint32_t(uint8_t(msg[chunk + i * 4 + 1])) << 16) |
+                   (uint32_t(uint8_t(msg[chunk + i * 4 + 2])) << 8) | uint32_t(uint8_t(msg[chunk + i * 4 + 3]));
+        }
+        for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    array<uint8_t, 20> out;
+    for (int i = 0; i < 5; i++) {
+        out[i * 4] = (h[i] >> 24) & 0xFF;
+        out[i * 4 + 1] = (h[i] >> 16) & 0xFF;
+        out[i * 4 + 2] = (h[i] >> 8) & 0xFF;
+        out[i * 4 + 3] = h[i] & 0xFF;
+    }
+    return out;
+}
+
+string base64(const uint8_t* data, size_t n) {
+    static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < n) v |= uint32_t(data[i + 1]) << 8;
+        if (i + 2 < n) v |= data[i + 2];
+        out.push_back(table[(v >> 18) & 0x3F]);
+        out.push_back(table[(v >> 12) & 0x3F]);
+        out.push_back(i + 1 < n ? table[(v >> 6) & 0x3F] : '=');
+        out.push_back(i + 2 < n ? table[v & 0x3F] : '=');
+    }
+    return out;
+}
+
+string lower(string s) {
+    transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return tolower(c); });
+    return s;
+}
+
+string trim(const string& s) {
+    auto b = s.find_first_not_of(" \t");
+    if (b == string::npos) return "";
+    auto e = s.find_last_not_of(" \t");
+    return s.substr(b, e - b + 1);
+}
+
+bool hasToken(const string& headerValue, const string& token) {
+    return lower(headerValue).find(token) != string::npos;
+}
+
+string percentDecode(const string& s) {
+    string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '+') {
+            out.push_back(' ');
+        } else if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+            out.push_back(static_cast<char>(stoi(s.substr(i + 1, 2), nullptr, 16)));
+            i += 2;
+        } else {
+            out.push_back(s[i]);
+        }
+    }
+    return out;
+}
+
+map<string, string> parseQuery(const string& query) {
+    map<string, string> params;
+    size_t start = 0;
+    while (start <= query.size()) {
+        auto amp = query.find('&', start);
+        if (amp == string::npos) amp = query.size();
+        auto pair = query.substr(start, amp - start);
+        auto eq = pair.find('=');
+        if (!pair.empty()) {
+            if (eq == string::npos) {
+                params[percentDecode(pair)] = "";
+            } else {
+                params[percentDecode(pair.substr(0, eq))] = percentDecode(pair.substr(eq + 1));
+            }
+        }
+        start = amp + 1;
+    }
+    return params;
+}
+
+const char* statusText(int status) {
+    switch (status) {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 426: return "Upgrade Required";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+    }
+}
+
+string contentType(const string& format) {
+    if (format == "opus") return "audio/ogg; codecs=opus";
+    if (format == "wav") return "audio/wav";
+    if (format == "json") return "application/json";
+    return "application/octet-stream";
+}
+
+string jsonReply(int status, const json& body, bool keepAlive, const string& extraHeaders = "") {
+    auto text = body.dump();
+    return "HTTP/1.1 " + to_string(status) + " " + statusText(status) + "\r\n" +
+           "Content-Type: application/json\r\n" +
+           "Content-Length: " + to_string(text.size()) + "\r\n" +
+           "Connection: " + (keepAlive ? "keep-alive" : "close") + "\r\n" +
+           extraHeaders + "\r\n" + text;
+}
+
+string wsFrameHeader(uint8_t opcode, size_t len) {
+    string hdr;
+    hdr.push_back(static_cast<char>(0x80 | opcode));
+    if (len < 126) {
+        hdr.push_back(static_cast<char>(len));
+    } else if (len <= 0xFFFF) {
+        hdr.push_back(126);
+        hdr.push_back(static_cast<char>((len >> 8) & 0xFF));
+        hdr.push_back(static_cast<char>(len & 0xFF));
+    } else {
+        hdr.push_back(127);
+        for (int i = 7; i >= 0; i--) hdr.push_back(static_cast<char>((uint64_t(len) >> (i * 8)) & 0xFF));
+    }
+    return hdr;
+}
+
+// ----------------------------------------------------------------------------
+// Channels
+
+// One POST /synthesize response. Headers go out with the first chunk, so an
+// error raised before any audio still gets a proper status code.
+class HttpChannel : public ResponseChannel {
+public:
+    HttpChannel(shared_ptr<Connection> conn, bool keepAlive) : conn_(std::move(conn)), keepAlive_(keepAlive) {}
+
+    ~HttpChannel() override {
+        if (!done_) end();
+    }
+
+    void begin(const ResponseInfo& info) override { info_ = info; }
+
+    void audio(const uint8_t* data, size_t n) override {
+        if (done_ || n == 0) return;
+        char size[20];
+        snprintf(size, sizeof(size), "%zx\r\n", n);
+        conn_->write({headers(), size, {reinterpret_cast<const char*>(data), n}, "\r\n"});
+    }
+
+    void error(const string& msg) override {
+        if (done_) return;
+        done_ = true;
+        if (headersSent_) {
+            // Too late for a status code; a truncated chunked body tells the
+            // client the response is incomplete
+            spdlog::warn("HTTP response failed after headers were sent: {}", msg);
+            conn_->fail();
+            return;
+        }
+        json e;
+        e["error"] = msg;
+        conn_->write({jsonReply(400, e, keepAlive_)});
+        conn_->finish();
+    }
+
+    void end() override {
+        if (done_) return;
+        done_ = true;
+        conn_->write({headers(), "0\r\n\r\n"});
+        conn_->finish();
+    }
+
+    bool closed() const override { return conn_->isClosed(); }
+    bool streaming() const override { return true; }
+    void onDisconnect(function<void()> fn) override { watch_.set(conn_, std::move(fn)); }
+    uint64_t client() const override { return conn_->serial; }
+    bool waitWritable(chrono::steady_clock::duration timeout) override { return conn_->waitWritable(timeout); }
+
+private:
+    // Response headers on first use, empty afterwards
+    string headers() {
+        if (headersSent_) return "";
+        headersSent_ = true;
+        string h = "HTTP/1.1 200 OK\r\n";
+        h += "Content-Type: " + contentType(info_.format) + "\r\n";
+        if (info_.sampleRate > 0) h += "X-Sample-Rate: " + to_string(info_.sampleRate) + "\r\n";
+        if (info_.samples) {
+            h += "X-Audio-Samples: " + to_string(*info_.samples) + "\r\n";
+            h += "X-Audio-Duration-Ms: " + to_string(llround(info_.durationMs())) + "\r\n";
+        }
+        h += "Transfer-Encoding: chunked\r\n";
+        h += string("Connection: ") + (keepAlive_ ? "keep-alive" : "close") + "\r\n\r\n";
+        return h;
+    }
+
+    shared_ptr<Connection> conn_;
+    DisconnectWatch watch_;
+    bool keepAlive_;
+    bool headersSent_ = false;
+    bool done_ = false;
+    ResponseInfo info_;
+};
+
+// One request on a WebSocket session
+class WebSocketChannel : public ResponseChannel {
+public:
+    explicit WebSocketChannel(shared_ptr<Connection> conn) : conn_(std::move(conn)) {}
+
+    ~WebSocketChannel() override {
+        if (!done_) end();
+    }
+
+    void begin(const ResponseInfo& info) override {
+        json j;
+        j["event"] = "start";
+        j["format"] = info.format;
+        j["sample_rate"] = info.sampleRate;
+        if (info.samples) {
+            j["samples"] = *info.samples;
+            j["duration_ms"] = info.durationMs();
+        }
+        text(j);
+    }
+
+    void audio(const uint8_t* data, size_t n) override {
+        if (done_ || n == 0) return;
+        conn_->write({wsFrameHeader(WsBinary, n), {reinterpret_cast<const char*>(data), n}});
+    }
+
+    void error(const string& msg) override {
+        if (done_) return;
+        json j;
+        j["event"] = "error";
+        j["error"] = msg;
+        text(j);
+        done_ = true;
+        conn_->finish();
+    }
+
+    void end() override {
+        if (done_) return;
+        json j;
+        j["event"] = "end";
+        text(j);
+        done_ = true;
+        conn_->finish();
+    }
+
+    bool closed() const override { return conn_->isClosed(); }
+    bool streaming() const override { return true; }
+    void onDisconnect(function<void()> fn) override { watch_.set(conn_, std::move(fn)); }
+    uint64_t client() const override { return conn_->serial; }
+    bool waitWritable(chrono::steady_clock::duration timeout) override { return conn_->waitWritable(timeout); }
+
+private:
+    void text(const json& j) {
+        auto s = j.dump();
+        conn_->write({wsFrameHeader(WsText, s.size()), s});
+    }
+
+    shared_ptr<Connection> conn_;
+    DisconnectWatch watch_;
+    bool done_ = false;
+};
+
+// ----------------------------------------------------------------------------
+
+struct HttpProtocol : Protocol {
+    bool websocket = false;
+    bool inMessage = false;
+    string message;
+
+    // HTTP and WebSocket clients that stop sending are gone (a WebSocket
+    // client says goodbye with a Close frame instead)
+    bool halfClose() const override { return false; }
+
+    bool parse(const shared_ptr<Connection>& conn) override {
+        if (websocket) return parseFrames(conn);
+
+        // One request at a time; the rest stays buffered until it is answered
+        while (conn->inFlight == 0 && conn->pending.empty() && !conn->closeWhenDone) {
+            auto headEnd = conn->inBuf.find("\r\n\r\n");
+            if (headEnd == string::npos) {
+                if (conn->inBuf.size() <= kMaxHeadBytes) return true;
+                conn->writeNow({jsonReply(431, json::object(), false)});
+                return false;
+            }
+
+            // Request line and headers
+            string head = conn->inBuf.substr(0, headEnd);
+            size_t lineEnd = head.find("\r\n");
+            string requestLine = head.substr(0, lineEnd);
+            map<string, string> headers;
+            for (size_t pos = lineEnd; pos != string::npos && pos < head.size();) {
+                size_t start = pos + 2;
+                size_t next = head.find("\r\n", start);
+                string line = head.substr(start, next == string::npos ? string::npos : next - start);
+                auto colon = line.find(':');
+                if (colon != string::npos) headers[lower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+                pos = next;
+            }
+
+            auto sp1 = requestLine.find(' ');
+            auto sp2 = requestLine.rfind(' ');
+            if (sp1 == string::npos || sp2 == sp1) {
+                conn->writeNow({jsonReply(400, json::object(), false)});
+                return false;
+            }
+            string method = requestLine.substr(0, sp1);
+            string target = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+            string version = requestLine.substr(sp2 + 1);
+
+            bool keepAlive = version == "HTTP/1.1";
+            if (headers.count("connection")) {
+                if (hasToken(headers["connection"], "close")) keepAlive = false;
+                if (hasToken(headers["connection"], "keep-alive")) keepAlive = true;
+            }
+
+            if (headers.count("transfer-encoding")) {
+                conn->writeNow({jsonReply(501, {{"error", "Chunked request bodies are not supported"}}, false)});
+                return false;
+            }
+            size_t contentLength = 0;
+            if (headers.count("content-length")) {
+                try {
+                    contentLength = stoul(headers["content-length"]);
+                } catch (const exception&) {
+                    conn->writeNow({jsonReply(400, {{"error", "Invalid Content-Length"}}, false)});
+                    return false;
+                }
+            }
+            if (contentLength > kMaxBodyBytes) {
+                conn->writeNow({jsonReply(413, json::object(), false)});
+                return false;
+            }
+            size_t total = headEnd + 4 + contentLength;
+            if (conn->inBuf.size() < total) return true;
+            string body = conn->inBuf.substr(headEnd + 4, contentLength);
+            conn->inBuf.erase(0, total);
+
+            string path = target;
+            string query;
+            if (auto q = target.find('?'); q != string::npos) {
+                path = target.substr(0, q);
+                query = target.substr(q + 1);
+            }
+
+            if (path == "/health") {
+                if (method != "GET") {
+                    conn->writeNow({jsonReply(405, json::object(), keepAlive, "Allow: GET\r\n")});
+                } else {
+                    conn->writeNow({jsonReply(200, {{"status", "ok"}}, keepAlive)});
+                }
+            } else if (path == "/ws") {
+                return upgrade(conn, method, headers);
+            } else if (path == "/synthesize") {
+                if (method != "POST") {
+                    conn->writeNow({jsonReply(405, json::object(), keepAlive, "Allow: POST\r\n")});
+                } else {
+                    queueSynthesis(conn, body, query, keepAlive);
+                }
+            } else {
+                conn->writeNow({jsonReply(404, json::object(), keepAlive)});
+            }
+
+            if (!keepAlive) {
+                conn->closeWhenDone = true;
+                conn->inBuf.clear();
+            }
+        }
+        return true;
+    }
+
+    void queueSynthesis(const shared_ptr<Connection>& conn, const string& body, const string& query, bool keepAlive) {
+        string request = body;
+        auto first = body.find_first_not_of(" \t\r\n");
+        if (first == string::npos || body[first] != '{') {
+            // Plain text body; options come from the query string
+            auto params = parseQuery(query);
+            json j;
+            j["text"] = body;
+            if (params.count("format")) j["format"] = params["format"];
+            if (params.count("sample_rate")) {
+                try {
+                    j["sample_rate"] = stoi(params["sample_rate"]);
+                } catch (const exception&) {
+                    conn->writeNow({jsonReply(400, {{"error", "Invalid sample_rate"}}, keepAlive)});
+                    return;
+                }
+            }
+            request = j.dump();
+        }
+        // Every POST is answered, so none is out of band
+        conn->pending.push_back(PendingRequest{std::move(request), [conn, keepAlive](bool) {
+            return make_shared<HttpChannel>(conn, keepAlive);
+        }, false});
+    }
+
+    bool upgrade(const shared_ptr<Connection>& conn, const string& method, map<string, string>& headers) {
+        if (method != "GET" || !hasToken(headers["upgrade"], "websocket") || !headers.count("sec-websocket-key")) {
+            conn->writeNow({jsonReply(400, {{"error", "Expected a WebSocket upgrade"}}, false)});
+            return false;
+        }
+        if (headers["sec-websocket-version"] != "13") {
+            conn->writeNow({jsonReply(426, json::object(), false, "Sec-WebSocket-Version: 13\r\n")});
+            return false;
+        }
+
+        auto digest = sha1(headers["sec-websocket-key"] + kWebSocketGuid);
+        conn->writeNow({"HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: " + base64(digest.data(), digest.size()) + "\r\n\r\n"});
+        websocket = true;
+        return parseFrames(conn);
+    }
+
+    // No data frame may follow a Close (RFC 6455 5.5.1): the request in
+    // flight is cancelled and whatever it still writes is dropped
+    bool closeSession(const shared_ptr<Connection>& conn, uint16_t code) {
+        char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+        conn->writeNow({wsFrameHeader(WsClose, 2), {payload, 2}});
+        conn->seal();
+        conn->pending.clear();
+        return false;
+    }
+
+    bool parseFrames(const shared_ptr<Connection>& conn) {
+        auto& in = conn->inBuf;
+        while (in.size() >= 2) {
+            uint8_t b0 = in[0];
+            uint8_t b1 = in[1];
+            bool fin = b0 & 0x80;
+            uint8_t opcode = b0 & 0x0F;
+            bool masked = b1 & 0x80;
+            uint64_t len = b1 & 0x7F;
+            size_t off = 2;
+            if (len == 126) {
+                if (in.size() < 4) return true;
+                len = (uint64_t(uint8_t(in[2])) << 8) | uint8_t(in[3]);
+                off = 4;
+            } else if (len == 127) {
+                if (in.size() < 10) return true;
+                len = 0;
+                for (int i = 0; i < 8; i++) len = (len << 8) | uint8_t(in[2 + i]);
+                off = 10;
+            }
+
+            // Clients must mask their frames (RFC 6455 5.1)
+            if (!masked) return closeSession(conn, 1002);
+            if (len > kMaxMessageBytes) return closeSession(conn, 1009);
+            if (in.size() < off + 4 + len) return true;
+
+            const char* mask = in.data() + off;
+            string payload = in.substr(off + 4, len);
+            for (size_t i = 0; i < payload.size(); i++) payload[i] ^= mask[i % 4];
+            in.erase(0, off + 4 + len);
+
+            switch (opcode) {
+            case WsText:
+            case WsContinuation:
+                if ((opcode == WsText) == inMessage) return closeSession(conn, 1002);
+                if (!inMessage) message.clear();
+                inMessage = true;
+                message += payload;
+                if (message.size() > kMaxMessageBytes) return closeSession(conn, 1009);
+                if (fin) {
+                    inMessage = false;
+                    conn->pending.push_back(PendingRequest{std::move(message), [conn](bool outOfBand) -> shared_ptr<ResponseChannel> {
+                        if (outOfBand) return make_shared<OutOfBandChannel>(conn->serial);
+                        return make_shared<WebSocketChannel>(conn);
+                    }});
+                    message.clear();
+                }
+                break;
+            case WsBinary:
+                return closeSession(conn, 1003);
+            case WsClose:
+                return closeSession(conn, 1000);
+            case WsPing:
+                conn->writeNow({wsFrameHeader(WsPong, payload.size()), payload});
+                break;
+            case WsPong:
+                break;
+            default:
+                return closeSession(conn, 1002);
+            }
+        }
+        return true;
+    }
+};
+}
+
+unique_ptr<Protocol> makeHttpProtocol() {
+    return make_unique<HttpProtocol>();
+}
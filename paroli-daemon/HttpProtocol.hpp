@@ -0,0 +1,22 @@
+#pragma once
+
+#include <memory>
+
+#include "SocketServer.hpp"
+
+// HTTP/1.1 and WebSocket protocol for http: listeners.
+//
+//   POST /synthesize   Body is a daemon JSON request, or plain text with
+//                      ?format=&sample_rate= query parameters. The audio is
+//                      returned with Transfer-Encoding: chunked, one HTTP
+//                      chunk per synthesized chunk, as soon as the decoder
+//                      produces it.
+//   GET  /ws           WebSocket upgrade. Every text message is a daemon JSON
+//                      request. Audio comes back as binary messages framed by
+//                      {"event":"start",...} and {"event":"end"} (or
+//                      {"event":"error",...}) text messages.
+//   GET  /health       Liveness probe.
+//
+// Connections are kept alive between requests; pipelined requests are
+// answered in order.
+std::unique_ptr<Protocol> makeHttpProtocol();
@@ -1,103 +1,330 @@
 #include <ogg/ogg.h>
 #include <opus/opus.h>
-#include <opus/opusenc.h>
 
 #include "OggOpusEncoder.hpp"
+#include "Resampler.hpp"
 
 #include <vector>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
 #include <span>
 #include <stdexcept>
-#include <memory>
-#include <cstring>
+#include <string>
+#include <tuple>
+
+namespace {
+// Ogg granule positions always count 48 kHz samples
+constexpr int kGranuleRate = 48000;
+// Longest Opus frame, 60 ms at 48 kHz, per channel
+constexpr size_t kMaxFrameSize = 2880;
+// Largest packet libopus produces for one frame
+constexpr size_t kMaxPacketSize = 1275 * 3;
+// Idle encoders kept per format, rate and channel count
+constexpr size_t kMaxIdleEncoders = 32;
 
-std::vector<uint8_t> encodeOgg(const std::vector<short>& data, size_t sr, size_t nchannels, size_t bitrate)
+bool opusRate(size_t sr)
 {
-    StreamingOggOpusEncoder encoder(sr, nchannels, bitrate);
-    std::vector<uint8_t> oggBuffer = encoder.encode(data);
-    auto extra = encoder.finish();
-    oggBuffer.insert(oggBuffer.end(), extra.begin(), extra.end());
-    return oggBuffer;
+    return sr == 8000 || sr == 12000 || sr == 16000 || sr == 24000 || sr == 48000;
 }
 
-StreamingOggOpusEncoder::StreamingOggOpusEncoder(size_t sr, size_t nchannels, size_t bitrate)
-    :sr(sr), nchannels(nchannels)
+void putLe16(std::vector<uint8_t>& out, uint16_t v)
 {
-    auto write_func = [](void* user_data, const unsigned char* ptr, opus_int32 size) -> int {
-        StreamingOggOpusEncoder* self = (StreamingOggOpusEncoder*)user_data;
-        auto buffer = &self->oggBuffer;
-        auto old_size = buffer->size();
-        buffer->resize(old_size + size);
-        memcpy(buffer->data() + old_size, ptr, size);
-        return 0;
-    };
-    auto close_func = [](void* user_data) -> int {
-        return 0;
-    };
+    out.push_back(uint8_t(v));
+    out.push_back(uint8_t(v >> 8));
+}
 
-    OpusEncCallbacks callbacks {
-        .write = write_func,
-        .close = close_func,
-    };
+void putLe32(std::vector<uint8_t>& out, uint32_t v)
+{
+    for (int b = 0; b < 4; b++) out.push_back(uint8_t(v >> (8 * b)));
+}
 
-    comments = std::shared_ptr<OggOpusComments>(ope_comments_create(), &ope_comments_destroy);
-    ope_comments_add(comments.get(), "ENCODER", "libopusenc");
+// Different for every stream the process starts
+int nextSerialNo()
+{
+    static std::atomic<uint32_t> next{std::random_device{}()};
+    return int(next.fetch_add(1));
+}
 
-    int err = 0;
-    encoder = std::shared_ptr<OggOpusEnc>(
-            ope_encoder_create_callbacks(&callbacks, this, comments.get(), sr, nchannels, 0, &err),
-            &ope_encoder_destroy);
-    if(err != OPE_OK)
-        throw std::runtime_error("Failed to create encoder");
-    if(ope_encoder_ctl(encoder.get(), OPUS_SET_BITRATE(bitrate)) != OPE_OK)
-        std::cerr << "Failed to set bitrate to " << bitrate << std::endl;
-}
-
-std::vector<uint8_t> StreamingOggOpusEncoder::encode(const std::vector<short>& data)
-{
-    oggBuffer.clear();
-    
-    // Ensure we don't process empty data
-    if (data.empty()) {
-        return {};
-    }
-    
-    audioBuffer.insert(audioBuffer.end(), data.begin(), data.end());
-    const size_t frame_size = 960;
-    const size_t samples_needed = frame_size * nchannels;
-    
-    if(audioBuffer.size() < samples_needed)
-        return {};
-        
-    size_t i = 0;
-    size_t end = (audioBuffer.size() / frame_size) * frame_size;
-    
-    // Process complete frames only
-    for(i = 0; i < end; i += frame_size) {
-        // Ensure we don't read beyond buffer
-        if (i + frame_size > audioBuffer.size()) {
-            break;
+struct EncoderPool {
+    std::mutex mtx;
+    std::map<std::tuple<bool, size_t, size_t>, std::vector<std::unique_ptr<OpusFrameEncoder>>> idle;
+};
+
+EncoderPool& encoderPool()
+{
+    static EncoderPool pool;
+    return pool;
+}
+}
+
+int opusFrameDuration(double frameMs)
+{
+    if (frameMs == 2.5) return OPUS_FRAMESIZE_2_5_MS;
+    if (frameMs == 5) return OPUS_FRAMESIZE_5_MS;
+    if (frameMs == 10) return OPUS_FRAMESIZE_10_MS;
+    if (frameMs == 20) return OPUS_FRAMESIZE_20_MS;
+    if (frameMs == 40) return OPUS_FRAMESIZE_40_MS;
+    if (frameMs == 60) return OPUS_FRAMESIZE_60_MS;
+    throw std::runtime_error("Opus frame duration must be 2.5, 5, 10, 20, 40 or 60 ms");
+}
+
+std::shared_ptr<AudioEncoder> makeOpusEncoder(bool raw, size_t sr, size_t nchannels, const OpusOptions& options)
+{
+    auto key = std::make_tuple(raw, sr, nchannels);
+    std::unique_ptr<OpusFrameEncoder> encoder;
+    {
+        auto& pool = encoderPool();
+        std::lock_guard<std::mutex> lk(pool.mtx);
+        auto& idle = pool.idle[key];
+        if (!idle.empty()) {
+            encoder = std::move(idle.back());
+            idle.pop_back();
         }
-        
-        int err = ope_encoder_write(encoder.get(), audioBuffer.data() + i, frame_size);
-        if(err != 0)
-            throw std::runtime_error("opusenc failed to encode");
     }
-    
-    // Remove processed samples, keep remainder for next call
-    if (i > 0) {
-        audioBuffer.erase(audioBuffer.begin(), audioBuffer.begin() + i);
+    if (encoder) {
+        encoder->reset(options);
+    } else if (raw) {
+        encoder = std::make_unique<RawOpusEncoder>(sr, nchannels, options);
+    } else {
+        encoder = std::make_unique<StreamingOggOpusEncoder>(sr, nchannels, options);
     }
 
-    return oggBuffer;
+    return std::shared_ptr<AudioEncoder>(encoder.release(), [key](AudioEncoder* released) {
+        std::unique_ptr<OpusFrameEncoder> owned(static_cast<OpusFrameEncoder*>(released));
+        auto& pool = encoderPool();
+        std::lock_guard<std::mutex> lk(pool.mtx);
+        auto& idle = pool.idle[key];
+        if (idle.size() < kMaxIdleEncoders) idle.push_back(std::move(owned));
+    });
 }
 
-std::vector<uint8_t> StreamingOggOpusEncoder::finish()
+std::vector<uint8_t> encodeOgg(std::span<const float> data, size_t sr, size_t nchannels, const OpusOptions& options)
 {
-    oggBuffer.clear();
-    ope_encoder_drain(encoder.get());
+    auto encoder = makeOpusEncoder(false, sr, nchannels, options);
+    std::vector<uint8_t> oggBuffer;
+    encoder->encode(data, oggBuffer);
+    encoder->finish(oggBuffer);
     return oggBuffer;
 }
 
+// ----------------------------------------------------------------------------
+
+OpusFrameEncoder::OpusFrameEncoder(size_t sr, size_t nchannels, bool allowResample)
+    :sr_(sr), nchannels_(nchannels), codecRate_(opusRate(sr) ? int(sr) : kGranuleRate)
+{
+    if(!opusRate(sr) && !allowResample)
+        throw std::runtime_error("Opus sample rate must be 8, 12, 16, 24 or 48 kHz");
+    int err = 0;
+    encoder_ = opus_encoder_create(codecRate_, int(nchannels), OPUS_APPLICATION_AUDIO, &err);
+    if(err != OPUS_OK)
+        throw std::runtime_error(std::string("Failed to create Opus encoder: ") + opus_strerror(err));
+    opus_int32 complexity = 0;
+    if(opus_encoder_ctl(encoder_, OPUS_GET_COMPLEXITY(&complexity)) == OPUS_OK)
+        defaultComplexity_ = complexity;
+    carry_.resize(kMaxFrameSize * nchannels);
+    packet_.resize(kMaxPacketSize);
+}
+
+OpusFrameEncoder::~OpusFrameEncoder()
+{
+    opus_encoder_destroy(encoder_);
+}
+
+void OpusFrameEncoder::reset(const OpusOptions& options)
+{
+    opusFrameDuration(options.frameMs); // validates
+    frameSize_ = size_t(codecRate_ * options.frameMs / 1000);
+    opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    if(opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(options.bitrate)) != OPUS_OK)
+        std::cerr << "Failed to set bitrate to " << options.bitrate << std::endl;
+    int complexity = options.complexity >= 0 ? options.complexity : defaultComplexity_;
+    if(opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK)
+        throw std::runtime_error("Invalid Opus complexity");
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(encoder_, OPUS_GET_LOOKAHEAD(&lookahead));
+    lookahead_ = lookahead;
+
+    // The resampler has no reset; only off-grid rates pay for a new one
+    if(int(sr_) != codecRate_)
+        resampler_ = std::make_unique<Resampler>(int(sr_), codecRate_);
+    carried_ = 0;
+    inputSamples_ = 0;
+    encodedSamples_ = 0;
+}
+
+void OpusFrameEncoder::encode(std::span<const float> data, std::vector<uint8_t>& out)
+{
+    if(resampler_) {
+        resampler_->process(data, resampled_);
+        data = resampled_;
+    }
+    feed(data, out);
+    endChunk(out);
+}
+
+void OpusFrameEncoder::finish(std::vector<uint8_t>& out)
+{
+    if(resampler_) {
+        resampler_->flush(resampled_);
+        feed(resampled_, out);
+    }
+    // Decoders lag the input by the lookahead, so encode silence until the
+    // last real sample has come out
+    const uint64_t end = inputSamples_ + uint64_t(lookahead_);
+    const size_t frame = frameSize_ * nchannels_;
+    while(encodedSamples_ < end) {
+        std::fill(carry_.begin() + carried_, carry_.begin() + frame, 0.0f);
+        carried_ = 0;
+        encodeFrame(carry_.data(), encodedSamples_ + frameSize_ >= end, out);
+    }
+    endChunk(out);
+}
+
+void OpusFrameEncoder::feed(std::span<const float> data, std::vector<uint8_t>& out)
+{
+    inputSamples_ += data.size() / nchannels_;
+    const size_t frame = frameSize_ * nchannels_;
+    size_t i = 0;
+    // Complete the carried frame first
+    if(carried_ > 0) {
+        i = std::min(frame - carried_, data.size());
+        std::copy(data.begin(), data.begin() + i, carry_.begin() + carried_);
+        carried_ += i;
+        if(carried_ < frame)
+            return;
+        encodeFrame(carry_.data(), false, out);
+        carried_ = 0;
+    }
+    for(; i + frame <= data.size(); i += frame)
+        encodeFrame(data.data() + i, false, out);
+    std::copy(data.begin() + i, data.end(), carry_.begin());
+    carried_ = data.size() - i;
+}
+
+void OpusFrameEncoder::encodeFrame(const float* pcm, bool last, std::vector<uint8_t>& out)
+{
+    opus_int32 n = opus_encode_float(encoder_, pcm, int(frameSize_), packet_.data(), opus_int32(packet_.size()));
+    if(n < 0)
+        throw std::runtime_error(std::string("opus_encode_float failed: ") + opus_strerror(n));
+    encodedSamples_ += frameSize_;
+    packet(packet_.data(), size_t(n), last, out);
+}
+
+// ----------------------------------------------------------------------------
+
+StreamingOggOpusEncoder::StreamingOggOpusEncoder(size_t sr, size_t nchannels, const OpusOptions& options)
+    :OpusFrameEncoder(sr, nchannels, true)
+{
+    if(ogg_stream_init(&stream_, nextSerialNo()) != 0)
+        throw std::runtime_error("Failed to create Ogg stream");
+    reset(options);
+}
+
+StreamingOggOpusEncoder::~StreamingOggOpusEncoder()
+{
+    ogg_stream_clear(&stream_);
+}
+
+void StreamingOggOpusEncoder::reset(const OpusOptions& options)
+{
+    OpusFrameEncoder::reset(options);
+    // Keeps the stream's buffers
+    ogg_stream_reset_serialno(&stream_, nextSerialNo());
+    lowLatency_ = options.lowLatency;
+    headersWritten_ = false;
+    packetNo_ = 0;
+}
+
+void StreamingOggOpusEncoder::writeHeaders(std::vector<uint8_t>& out)
+{
+    if(headersWritten_)
+        return;
+    headersWritten_ = true;
+
+    // Identification header: version 1, pre-skip in 48 kHz samples, the
+    // rate audio came in at, no gain, mono/stereo mapping
+    header_.clear();
+    header_.insert(header_.end(), {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, uint8_t(nchannels_)});
+    putLe16(header_, uint16_t(lookahead_ * (kGranuleRate / codecRate_)));
+    putLe32(header_, uint32_t(sr_));
+    putLe16(header_, 0);
+    header_.push_back(0);
+    ogg_packet op {};
+    op.packet = header_.data();
+    op.bytes = long(header_.size());
+    op.b_o_s = 1;
+    op.packetno = packetNo_++;
+    ogg_stream_packetin(&stream_, &op);
+    writePages(true, out);
+
+    // Comment header: vendor string and no comments
+    const char* vendor = opus_get_version_string();
+    header_.clear();
+    header_.insert(header_.end(), {'O', 'p', 'u', 's', 'T', 'a', 'g', 's'});
+    putLe32(header_, uint32_t(strlen(vendor)));
+    header_.insert(header_.end(), vendor, vendor + strlen(vendor));
+    putLe32(header_, 0);
+    op = {};
+    op.packet = header_.data();
+    op.bytes = long(header_.size());
+    op.packetno = packetNo_++;
+    ogg_stream_packetin(&stream_, &op);
+    writePages(true, out);
+}
+
+void StreamingOggOpusEncoder::packet(const uint8_t* data, size_t n, bool last, std::vector<uint8_t>& out)
+{
+    writeHeaders(out);
+    const int64_t scale = kGranuleRate / codecRate_;
+    ogg_packet op {};
+    op.packet = const_cast<unsigned char*>(data);
+    op.bytes = long(n);
+    op.e_o_s = last;
+    // The last page's position trims the padding that finish() added
+    op.granulepos = int64_t(last ? inputSamples_ + uint64_t(lookahead_) : encodedSamples_) * scale;
+    op.packetno = packetNo_++;
+    ogg_stream_packetin(&stream_, &op);
+    if(last)
+        writePages(true, out);
+    else if(!lowLatency_)
+        writePages(false, out);
+}
+
+void StreamingOggOpusEncoder::endChunk(std::vector<uint8_t>& out)
+{
+    if(!lowLatency_)
+        return;
+    writeHeaders(out);
+    writePages(true, out);
+}
+
+void StreamingOggOpusEncoder::writePages(bool flush, std::vector<uint8_t>& out)
+{
+    ogg_page page;
+    while(flush ? ogg_stream_flush(&stream_, &page) : ogg_stream_pageout(&stream_, &page)) {
+        out.insert(out.end(), page.header, page.header + page.header_len);
+        out.insert(out.end(), page.body, page.body + page.body_len);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+RawOpusEncoder::RawOpusEncoder(size_t sr, size_t nchannels, const OpusOptions& options)
+    :OpusFrameEncoder(sr, nchannels, false)
+{
+    reset(options);
+}
+
+void RawOpusEncoder::packet(const uint8_t* data, size_t n, bool, std::vector<uint8_t>& out)
+{
+    uint8_t length[4];
+    for(int b = 0; b < 4; b++) length[b] = uint8_t(uint32_t(n) >> (8 * b));
+    out.insert(out.end(), length, length + 4);
+    out.insert(out.end(), data, data + n);
+}
@@ -3,23 +3,117 @@
 #include <vector>
 #include <cstdint>
 #include <memory>
-#include <unistd.h>
-#include <opus/opusenc.h>
+#include <span>
+#include <ogg/ogg.h>
+#include <opus/opus.h>
 
-std::vector<uint8_t> encodeOgg(const std::vector<short>& data, size_t sr, size_t nchannels, size_t bitrate = 96000);
+#include "AudioEncoder.hpp"
 
-struct StreamingOggOpusEncoder {
-    StreamingOggOpusEncoder(size_t sr, size_t nchannels, size_t bitrate = 96000);
+class Resampler;
 
-    std::vector<uint8_t> encode(const std::vector<short>& data);
-    std::vector<uint8_t> finish();
+// Per-request Opus settings
+struct OpusOptions {
+    size_t bitrate = 96000;
+    // 0-10: higher sounds better and costs more CPU; -1 keeps libopus' default
+    int complexity = -1;
+    // 2.5, 5, 10, 20, 40 or 60. Shorter frames cut latency and compress worse.
+    double frameMs = 20;
+    // Close an Ogg page at the end of every encode() call, so each chunk's
+    // audio goes out with it. Otherwise pages are cut at about 4 kB to carry
+    // less overhead.
+    bool lowLatency = false;
+};
+
+// OPUS_FRAMESIZE_* for a frame duration; throws for durations Opus lacks
+int opusFrameDuration(double frameMs);
+
+// Ogg Opus, or bare packets with `raw`. Encoders come from a process-wide
+// pool and go back to it when released; a leased one is reset to `options`,
+// so steady-state requests create no libopus state and reuse its buffers.
+std::shared_ptr<AudioEncoder> makeOpusEncoder(bool raw, size_t sr, size_t nchannels, const OpusOptions& options = {});
+
+std::vector<uint8_t> encodeOgg(std::span<const float> data, size_t sr, size_t nchannels,
+                               const OpusOptions& options = {});
+
+// Cuts audio into Opus frames and encodes them. Whole frames are encoded
+// straight from the caller's span; only a partial frame is carried over to
+// the next call, in a buffer sized once for the longest frame. Rates libopus
+// lacks are resampled to 48 kHz first where the subclass allows it.
+class OpusFrameEncoder : public AudioEncoder {
+public:
+    ~OpusFrameEncoder() override;
+
+    void encode(std::span<const float> data, std::vector<uint8_t>& out) override;
+    // Pads with silence until the encoder's lookahead is out too
+    void finish(std::vector<uint8_t>& out) override;
+
+    // Start a new stream with `options`, keeping the libopus state's memory
+    virtual void reset(const OpusOptions& options);
+
+    // Samples per channel at codecRate() that decoders drop from the start
+    int lookahead() const { return lookahead_; }
+    int codecRate() const { return codecRate_; }
+
+protected:
+    OpusFrameEncoder(size_t sr, size_t nchannels, bool allowResample);
+
+    // One encoded frame; `last` is set on the final one of the stream
+    virtual void packet(const uint8_t* data, size_t n, bool last, std::vector<uint8_t>& out) = 0;
+    // After each encode() call
+    virtual void endChunk(std::vector<uint8_t>& out) {}
 
-    std::vector<short> audioBuffer;
-    std::shared_ptr<OggOpusEnc> encoder;
-    OpusEncCallbacks callbacks;
-    size_t sr;
-    size_t nchannels;
-    std::vector<uint8_t> oggBuffer;
-    std::shared_ptr<OggOpusComments> comments;
+    size_t sr_;
+    size_t nchannels_;
+    int codecRate_;
+    int lookahead_ = 0;
+    size_t frameSize_ = 0;          // samples per channel
+    uint64_t inputSamples_ = 0;     // per channel at codecRate_, this stream
+    uint64_t encodedSamples_ = 0;   // including padding
+
+private:
+    void feed(std::span<const float> data, std::vector<uint8_t>& out);
+    void encodeFrame(const float* pcm, bool last, std::vector<uint8_t>& out);
+
+    OpusEncoder* encoder_ = nullptr;
+    int defaultComplexity_ = 10;
+    std::unique_ptr<Resampler> resampler_;
+    std::vector<float> resampled_;
+    std::vector<float> carry_;
+    size_t carried_ = 0;
+    std::vector<uint8_t> packet_;
+};
+
+// Ogg Opus (RFC 7845) muxed with libogg
+class StreamingOggOpusEncoder : public OpusFrameEncoder {
+public:
+    StreamingOggOpusEncoder(size_t sr, size_t nchannels, const OpusOptions& options = {});
+    ~StreamingOggOpusEncoder() override;
+
+    void reset(const OpusOptions& options) override;
+
+protected:
+    void packet(const uint8_t* data, size_t n, bool last, std::vector<uint8_t>& out) override;
+    void endChunk(std::vector<uint8_t>& out) override;
+
+private:
+    void writeHeaders(std::vector<uint8_t>& out);
+    void writePages(bool flush, std::vector<uint8_t>& out);
+
+    ogg_stream_state stream_;
+    bool lowLatency_ = false;
+    bool headersWritten_ = false;
+    int64_t packetNo_ = 0;
+    std::vector<uint8_t> header_;
 };
 
+// Bare Opus packets without Ogg, each prefixed with its u32 little-endian
+// length, for clients that do their own framing. There are no header
+// packets: rate and channel count come with the response metadata, and the
+// first lookahead() samples of decoded audio are encoder delay.
+class RawOpusEncoder : public OpusFrameEncoder {
+public:
+    RawOpusEncoder(size_t sr, size_t nchannels, const OpusOptions& options = {});
+
+protected:
+    void packet(const uint8_t* data, size_t n, bool last, std::vector<uint8_t>& out) override;
+};
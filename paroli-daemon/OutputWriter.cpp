@@ -0,0 +1,101 @@
+#include "OutputWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+// Chunks per writev, two iovecs each, well under IOV_MAX
+constexpr size_t kMaxBatch = 256;
+}
+
+OutputWriter::OutputWriter(int fd, bool owned, size_t capacity) : fd_(fd), owned_(owned), ring_(capacity) {
+    if (fd_ < 0) throw runtime_error("Invalid output descriptor");
+    thread_ = thread([this]() { run(); });
+}
+
+OutputWriter::~OutputWriter() {
+    {
+        lock_guard<mutex> lk(producerMutex_);
+        ring_.close();
+    }
+    thread_.join();
+    if (owned_) ::close(fd_);
+}
+
+void OutputWriter::checkFailed() {
+    if (failed_.load(memory_order_acquire)) throw runtime_error(error_);
+}
+
+void OutputWriter::write(const uint8_t* prefix, size_t prefixLen, const uint8_t* data, size_t n) {
+    lock_guard<mutex> lk(producerMutex_);
+    checkFailed();
+    auto& chunk = ring_.claim();
+    chunk.prefixLen = min(prefixLen, chunk.prefix.size());
+    if (chunk.prefixLen) memcpy(chunk.prefix.data(), prefix, chunk.prefixLen);
+    chunk.data.assign(reinterpret_cast<const char*>(data), n);
+    ring_.publish();
+}
+
+void OutputWriter::write(string data) {
+    lock_guard<mutex> lk(producerMutex_);
+    checkFailed();
+    auto& chunk = ring_.claim();
+    chunk.prefixLen = 0;
+    chunk.data.swap(data);
+    ring_.publish();
+}
+
+void OutputWriter::run() {
+    while (size_t n = ring_.wait()) {
+        n = min(n, kMaxBatch);
+        // After a failure, keep draining so producers never block on a
+        // writer that is gone; they throw instead
+        if (!failed_.load(memory_order_relaxed)) {
+            try {
+                writeBatch(n);
+            } catch (const exception& e) {
+                error_ = e.what();
+                failed_.store(true, memory_order_release);
+            }
+        }
+        ring_.release(n);
+    }
+}
+
+void OutputWriter::writeBatch(size_t n) {
+    iovec iov[2 * kMaxBatch];
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        auto& chunk = ring_[i];
+        if (chunk.prefixLen) iov[count++] = {chunk.prefix.data(), chunk.prefixLen};
+        if (!chunk.data.empty()) iov[count++] = {chunk.data.data(), chunk.data.size()};
+    }
+
+    iovec* next = iov;
+    while (count > 0) {
+        ssize_t w = ::writev(fd_, next, int(count));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("Output write failed: ") + strerror(errno));
+        }
+        // Skip what went out; a short write leaves the rest for another call
+        size_t left = size_t(w);
+        while (count > 0 && left >= next->iov_len) {
+            left -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = static_cast<char*>(next->iov_base) + left;
+            next->iov_len -= left;
+        }
+    }
+}
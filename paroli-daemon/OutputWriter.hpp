@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "SpscRing.hpp"
+
+// Writes response bytes to a file descriptor (stdout, an output file) from a
+// thread of its own, so an output task never waits on a slow reader unless
+// the ring between them is full. The writer takes everything queued at once
+// and sends it with a single writev: a chunk's length header and payload, and
+// any chunks that piled up meanwhile, go out in one system call instead of a
+// write and flush each.
+class OutputWriter {
+public:
+    // Closes `fd` on destruction only if `owned`
+    explicit OutputWriter(int fd, bool owned = false, size_t capacity = 64);
+    // Writes out everything still queued
+    ~OutputWriter();
+
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    // Queue `prefix` (at most 16 bytes) followed by a copy of `data`,
+    // blocking while the ring is full. Throws once a write has failed.
+    void write(const uint8_t* prefix, size_t prefixLen, const uint8_t* data, size_t n);
+    // Queue bytes that are already assembled, without copying them
+    void write(std::string data);
+
+private:
+    struct Chunk {
+        std::array<uint8_t, 16> prefix;
+        size_t prefixLen = 0;
+        std::string data; // keeps its capacity from chunk to chunk
+    };
+
+    void run();
+    void writeBatch(size_t n);
+    void checkFailed();
+
+    int fd_;
+    bool owned_;
+    // Requests sharing one writer take turns as the ring's producer
+    std::mutex producerMutex_;
+    SpscRing<Chunk> ring_;
+    std::atomic<bool> failed_{false};
+    std::string error_; // set before failed_
+    std::thread thread_;
+};
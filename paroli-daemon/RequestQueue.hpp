@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// Estimated cost of synthesizing `text`, in units of one UTF-8 codepoint.
+// espeak produces roughly one phoneme per character, so this tracks the
+// phoneme count without phonemizing on the submitting thread. A fixed
+// per-request overhead covers encoder setup and the sentence silences.
+inline double estimateCost(const std::string& text) {
+    size_t codepoints = std::count_if(text.begin(), text.end(), [](char c) { return (c & 0xC0) != 0x80; });
+    return static_cast<double>(codepoints) + 8.0;
+}
+
+// Bounded work queue in front of the synthesis workers with admission
+// control. Every request carries a cost estimate; the queue converts queued
+// cost into expected wait using the seconds per cost unit observed on recent
+// requests (effectively the current real-time factor), and turns work away
+// up front rather than letting latency grow without bound.
+template <typename Item>
+class RequestQueue {
+public:
+    enum class Policy {
+        Fifo,
+        ShortestJobFirst, // cheapest first; requests older than maxAge go first
+    };
+
+    struct Config {
+        size_t capacity = 256;
+        int workers = 1;
+        double latencyBudget = 0; // seconds of projected queue wait; 0 disables
+        Policy policy = Policy::Fifo;
+    };
+
+    struct Job {
+        Item item;
+        double cost = 0;
+        int priority = 0; // lower classes are always served first
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    explicit RequestQueue(const Config& cfg) : cfg_(cfg) {}
+
+    // Admit, delay or reject a request:
+    //  - rejected (throws) if its projected wait exceeds the latency budget,
+    //    or if the queue is full and the caller cannot wait;
+    //  - delayed (blocks) while the queue is full, if `canWait`;
+    //  - admitted otherwise.
+    void push(Item item, double cost, bool canWait, int priority = 0) {
+        std::unique_lock<std::mutex> lk(mtx_);
+        if (cfg_.latencyBudget > 0) {
+            double wait = projectedWaitLocked(cost, priority);
+            if (wait > cfg_.latencyBudget) {
+                rejected_++;
+                throw std::runtime_error("Overloaded: projected wait " + std::to_string(long(wait * 1000.0)) +
+                                         " ms exceeds budget " + std::to_string(long(cfg_.latencyBudget * 1000.0)) +
+                                         " ms");
+            }
+        }
+        if (jobs_.size() >= cfg_.capacity) {
+            if (!canWait) {
+                rejected_++;
+                throw std::runtime_error("Overloaded: request queue is full");
+            }
+            delayed_++;
+            notFull_.wait(lk, [&]() { return closed_ || jobs_.size() < cfg_.capacity; });
+        }
+        if (closed_) throw std::runtime_error("Shutting down");
+        jobs_.push_back(Job{std::move(item), cost, priority, std::chrono::steady_clock::now()});
+        lk.unlock();
+        notEmpty_.notify_one();
+    }
+
+    // Next job by policy; blocks while empty. Returns nullopt once the queue
+    // has been closed and drained.
+    std::optional<Job> pop() {
+        std::unique_lock<std::mutex> lk(mtx_);
+        notEmpty_.wait(lk, [&]() { return closed_ || !jobs_.empty(); });
+        if (jobs_.empty()) return std::nullopt;
+
+        // Oldest job of the most urgent class present, or under SJF its
+        // cheapest one unless the oldest has waited too long
+        int priority = std::min_element(jobs_.begin(), jobs_.end(), [](const Job& a, const Job& b) {
+                           return a.priority < b.priority;
+                       })->priority;
+        auto inClass = [&](const Job& j) { return j.priority == priority; };
+        auto it = std::find_if(jobs_.begin(), jobs_.end(), inClass);
+        if (cfg_.policy == Policy::ShortestJobFirst &&
+            std::chrono::steady_clock::now() - it->queuedAt < maxAge()) {
+            for (auto j = it; j != jobs_.end(); ++j) {
+                if (inClass(*j) && j->cost < it->cost) it = j;
+            }
+        }
+        Job job = std::move(*it);
+        jobs_.erase(it);
+        runningCost_ += job.cost;
+        lk.unlock();
+        notFull_.notify_one();
+        return job;
+    }
+
+    // A popped job finished after `seconds` of work; recalibrates the cost
+    // model. Pass seconds < 0 for jobs that did no synthesis (e.g. cancelled).
+    void done(double cost, double seconds) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        runningCost_ = std::max(0.0, runningCost_ - cost);
+        if (seconds >= 0 && cost > 0) {
+            secondsPerCost_ = (1.0 - kAlpha) * secondsPerCost_ + kAlpha * (seconds / cost);
+        }
+    }
+
+    // Refuse new jobs and wake everyone; queued jobs are still handed out
+    void close() {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            closed_ = true;
+        }
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+    size_t depth() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return jobs_.size();
+    }
+
+    double projectedWait(double cost, int priority = 0) const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return projectedWaitLocked(cost, priority);
+    }
+
+    size_t rejected() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return rejected_;
+    }
+
+    size_t delayed() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return delayed_;
+    }
+
+private:
+    // Smoothing of the seconds-per-cost estimate
+    static constexpr double kAlpha = 0.2;
+
+    // Expected time until a new job of `cost` and `priority` starts:
+    // everything running plus everything that would be served before it,
+    // spread over the workers. Queued jobs of less urgent classes never are.
+    double projectedWaitLocked(double cost, int priority) const {
+        double ahead = runningCost_;
+        for (auto& job : jobs_) {
+            if (job.priority > priority) continue;
+            if (job.priority == priority && cfg_.policy == Policy::ShortestJobFirst && job.cost > cost) continue;
+            ahead += job.cost;
+        }
+        return ahead * secondsPerCost_ / std::max(1, cfg_.workers);
+    }
+
+    std::chrono::steady_clock::duration maxAge() const {
+        using namespace std::chrono;
+        return cfg_.latencyBudget > 0 ? duration_cast<steady_clock::duration>(duration<double>(cfg_.latencyBudget))
+                                      : duration_cast<steady_clock::duration>(seconds(5));
+    }
+
+    Config cfg_;
+    mutable std::mutex mtx_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<Job> jobs_;
+    double runningCost_ = 0;
+    // Starting guess (about 20 ms per character on a small CPU) until the
+    // first requests complete
+    double secondsPerCost_ = 0.02;
+    size_t rejected_ = 0;
+    size_t delayed_ = 0;
+    bool closed_ = false;
+};
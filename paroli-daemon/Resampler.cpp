@@ -0,0 +1,258 @@
+#include "Resampler.hpp"
+
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
+
+#include <soxr.h>
+
+using namespace std;
+
+namespace {
+// Reduced ratios needing more phases than this go to soxr; the bank would
+// outgrow the cache for no gain on the rates we serve
+constexpr size_t kMaxPhases = 1024;
+
+struct QualityParams {
+    size_t taps;     // per phase when upsampling; more when downsampling
+    double beta;     // Kaiser window
+    double rolloff;  // passband edge as a fraction of the lower Nyquist
+    unsigned long soxrRecipe;
+};
+
+QualityParams qualityParams(ResampleQuality quality) {
+    switch (quality) {
+    case ResampleQuality::Low: return {16, 5.0, 0.85, SOXR_LQ};
+    case ResampleQuality::Medium: return {32, 7.0, 0.91, SOXR_MQ};
+    case ResampleQuality::High: return {64, 9.5, 0.95, SOXR_HQ};
+    }
+    return {32, 7.0, 0.91, SOXR_MQ};
+}
+
+// Windowed-sinc low-pass split into `up` phases of `taps` coefficients. Row
+// p filters the input for output samples falling p/up of the way past an
+// input sample.
+struct FilterBank {
+    size_t up = 1;
+    size_t down = 1;
+    size_t taps = 0;
+    vector<float> coeffs;
+};
+
+double besselI0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+shared_ptr<const FilterBank> designBank(int inRate, int outRate, ResampleQuality quality) {
+    auto g = gcd(inRate, outRate);
+    auto bank = make_shared<FilterBank>();
+    bank->up = size_t(outRate / g);
+    bank->down = size_t(inRate / g);
+    if (bank->up > kMaxPhases) return nullptr;
+
+    auto params = qualityParams(quality);
+    const double ratio = min(1.0, double(bank->up) / double(bank->down));
+    // Same transition width in output terms when downsampling, rounded up
+    // to the kernels' 8-lane blocks
+    bank->taps = (size_t(ceil(double(params.taps) / ratio)) + 7) / 8 * 8;
+    const double cutoff = params.rolloff * ratio;
+    const double half = double(bank->taps / 2);
+    const double i0Beta = besselI0(params.beta);
+
+    bank->coeffs.resize(bank->up * bank->taps);
+    for (size_t p = 0; p < bank->up; p++) {
+        float* row = bank->coeffs.data() + p * bank->taps;
+        double sum = 0;
+        for (size_t k = 0; k < bank->taps; k++) {
+            double d = (half - 1 - double(k)) + double(p) / double(bank->up);
+            double x = d / half;
+            double window = abs(x) < 1 ? besselI0(params.beta * sqrt(1 - x * x)) / i0Beta : 0;
+            double arg = M_PI * cutoff * d;
+            double sinc = d == 0 ? 1 : sin(arg) / arg;
+            row[k] = float(cutoff * sinc * window);
+            sum += row[k];
+        }
+        // Unit gain at DC on every phase, so no ripple at the phase rate
+        for (size_t k = 0; k < bank->taps; k++) row[k] = float(row[k] / sum);
+    }
+    return bank;
+}
+
+// Banks are built on first use of a rate pair and kept for the process
+shared_ptr<const FilterBank> sharedBank(int inRate, int outRate, ResampleQuality quality) {
+    static mutex mtx;
+    static map<tuple<int, int, ResampleQuality>, shared_ptr<const FilterBank>> banks;
+    lock_guard<mutex> lk(mtx);
+    auto key = make_tuple(inRate, outRate, quality);
+    auto it = banks.find(key);
+    if (it == banks.end()) it = banks.emplace(key, designBank(inRate, outRate, quality)).first;
+    return it->second;
+}
+
+// Eight independent accumulators, so the loop vectorizes without reordering
+// a single sum
+inline float dot(const float* x, const float* h, size_t taps) {
+    float acc[8] = {};
+    for (size_t k = 0; k < taps; k += 8) {
+        for (size_t j = 0; j < 8; j++) acc[j] += x[k + j] * h[k + j];
+    }
+    return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+}
+
+// Taps == 0 takes the count at run time
+template <size_t Taps>
+void filter(const FilterBank& bank, const vector<float>& in, size_t& pos, size_t& phase, vector<float>& out) {
+    const size_t taps = Taps ? Taps : bank.taps;
+    const float* coeffs = bank.coeffs.data();
+    while (pos + taps <= in.size()) {
+        out.push_back(dot(in.data() + pos, coeffs + phase * taps, taps));
+        phase += bank.down;
+        pos += phase / bank.up;
+        phase %= bank.up;
+    }
+}
+}
+
+optional<ResampleQuality> parseResampleQuality(const string& name) {
+    if (name == "low") return ResampleQuality::Low;
+    if (name == "medium") return ResampleQuality::Medium;
+    if (name == "high") return ResampleQuality::High;
+    return nullopt;
+}
+
+struct Resampler::Impl {
+    // Built-in filter: input history starting at the first tap of the next
+    // output, and where that output falls between input samples
+    shared_ptr<const FilterBank> bank;
+    vector<float> history;
+    size_t pos = 0;
+    size_t phase = 0;
+    uint64_t inputSamples = 0;
+    uint64_t outputSamples = 0;
+
+    soxr_t soxr = nullptr;
+    double ratio = 1;
+    int inRate = 0;
+    int outRate = 0;
+
+    ~Impl() {
+        if (soxr) soxr_delete(soxr);
+    }
+
+    void runBank(vector<float>& out) {
+        switch (bank->taps) {
+        case 16: filter<16>(*bank, history, pos, phase, out); break;
+        case 24: filter<24>(*bank, history, pos, phase, out); break;
+        case 32: filter<32>(*bank, history, pos, phase, out); break;
+        case 48: filter<48>(*bank, history, pos, phase, out); break;
+        case 64: filter<64>(*bank, history, pos, phase, out); break;
+        case 96: filter<96>(*bank, history, pos, phase, out); break;
+        default: filter<0>(*bank, history, pos, phase, out); break;
+        }
+        history.erase(history.begin(), history.begin() + pos);
+        pos = 0;
+    }
+
+    void runSoxr(const float* in, size_t left, vector<float>& out) {
+        while (true) {
+            size_t base = out.size();
+            out.resize(base + size_t(double(left) * ratio) + 256);
+            size_t idone = 0, odone = 0;
+            soxr_error_t error = soxr_process(soxr, in, left, &idone, out.data() + base, out.size() - base, &odone);
+            if (error != NULL) throw runtime_error("soxr_process failed");
+            out.resize(base + odone);
+            // Flushing: keep going until soxr has nothing left
+            if (in == nullptr) {
+                if (odone == 0) return;
+                continue;
+            }
+            in += idone;
+            left -= idone;
+            if (left == 0) return;
+        }
+    }
+};
+
+Resampler::Resampler(int inRate, int outRate, ResampleQuality quality, bool allowBuiltIn)
+    : impl_(make_unique<Impl>()) {
+    if (inRate <= 0 || outRate <= 0) throw runtime_error("Invalid resampling rates");
+    if (allowBuiltIn) impl_->bank = sharedBank(inRate, outRate, quality);
+    if (impl_->bank) {
+        // Zeros before the first sample, so the first output is centered on it
+        impl_->history.assign(impl_->bank->taps / 2 - 1, 0.0f);
+        return;
+    }
+
+    soxr_io_spec_t io_spec = soxr_io_spec(SOXR_FLOAT32_I, SOXR_FLOAT32_I);
+    soxr_quality_spec_t q_spec = soxr_quality_spec(qualityParams(quality).soxrRecipe, 0);
+    soxr_error_t error;
+    impl_->soxr = soxr_create(inRate, outRate, 1, &error, &io_spec, &q_spec, NULL);
+    if (error != NULL) throw runtime_error("soxr_create failed");
+    impl_->ratio = double(outRate) / double(inRate);
+    impl_->inRate = inRate;
+    impl_->outRate = outRate;
+}
+
+Resampler::~Resampler() = default;
+
+bool Resampler::builtIn() const {
+    return impl_->bank != nullptr;
+}
+
+void Resampler::process(span<const float> in, vector<float>& out) {
+    out.clear();
+    if (!impl_->bank) {
+        impl_->runSoxr(in.data(), in.size(), out);
+        impl_->inputSamples += in.size();
+        impl_->outputSamples += out.size();
+        return;
+    }
+    impl_->history.insert(impl_->history.end(), in.begin(), in.end());
+    impl_->inputSamples += in.size();
+    impl_->runBank(out);
+    impl_->outputSamples += out.size();
+}
+
+void Resampler::flush(vector<float>& out) {
+    out.clear();
+    if (!impl_->bank) {
+        impl_->runSoxr(nullptr, 0, out);
+        // soxr rounds its length its own way; match the built-in filter's,
+        // which callers may have predicted
+        uint64_t expected = outputLength(impl_->inputSamples, impl_->inRate, impl_->outRate);
+        uint64_t remaining = expected > impl_->outputSamples ? expected - impl_->outputSamples : 0;
+        out.resize(remaining, 0.0f);
+        impl_->outputSamples += out.size();
+        return;
+    }
+    auto& bank = *impl_->bank;
+    impl_->history.insert(impl_->history.end(), bank.taps / 2, 0.0f);
+    impl_->runBank(out);
+    // Zero padding yields outputs past the end of the input; drop those
+    uint64_t expected = (impl_->inputSamples * bank.up + bank.down - 1) / bank.down;
+    uint64_t remaining = expected > impl_->outputSamples ? expected - impl_->outputSamples : 0;
+    out.resize(remaining, 0.0f);
+    impl_->outputSamples += out.size();
+}
+
+uint64_t Resampler::outputLength(uint64_t inputSamples, int inRate, int outRate) {
+    return (inputSamples * uint64_t(outRate) + uint64_t(inRate) - 1) / uint64_t(inRate);
+}
+
+vector<float> Resampler::resample(span<const float> in, int inRate, int outRate, ResampleQuality quality) {
+    Resampler resampler(inRate, outRate, quality);
+    vector<float> out, tail;
+    resampler.process(in, out);
+    resampler.flush(tail);
+    out.insert(out.end(), tail.begin(), tail.end());
+    return out;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Trade-off between stopband quality and delay/CPU. For the built-in filter
+// this picks the taps per phase (latency is half of them, in input samples);
+// for soxr, its LQ/MQ/HQ recipes.
+enum class ResampleQuality { Low, Medium, High };
+
+std::optional<ResampleQuality> parseResampleQuality(const std::string& name);
+
+// Streaming mono float resampler. Rate pairs whose reduced ratio is small,
+// which covers every voice rate to 8, 16, 24 and 48 kHz, run through a
+// polyphase filter bank built once per pair and shared by all instances.
+// Anything else falls back to soxr. State carries across process() calls, so
+// chunk edges are filtered like the middle of the signal.
+class Resampler {
+public:
+    Resampler(int inRate, int outRate, ResampleQuality quality = ResampleQuality::Medium, bool allowBuiltIn = true);
+    ~Resampler();
+
+    Resampler(const Resampler&) = delete;
+    Resampler& operator=(const Resampler&) = delete;
+
+    // Replace `out` with the output `in` completes. A few samples are held
+    // back until more input, or flush(), arrives.
+    void process(std::span<const float> in, std::vector<float>& out);
+
+    // Replace `out` with the held-back tail; the total output then matches
+    // the input length times the rate ratio
+    void flush(std::vector<float>& out);
+
+    // Samples out of `inputSamples` in, once flushed
+    static uint64_t outputLength(uint64_t inputSamples, int inRate, int outRate);
+
+    // Whether the built-in filter is used rather than soxr
+    bool builtIn() const;
+
+    // Whole buffer in one go
+    static std::vector<float> resample(std::span<const float> in, int inRate, int outRate,
+                                       ResampleQuality quality = ResampleQuality::Medium);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
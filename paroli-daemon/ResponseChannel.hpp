@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+
+// What a response is going to contain, known before the first audio chunk
+struct ResponseInfo {
+    std::string format; // opus|opus_raw|wav|pcm|pcm_f32|json
+    int sampleRate = 0;
+    // Exact length at sampleRate when it was predicted before synthesis, so
+    // clients can size their buffers up front
+    std::optional<uint64_t> samples;
+
+    double durationMs() const { return samples && sampleRate > 0 ? *samples * 1000.0 / sampleRate : 0; }
+};
+
+// Destination for the output of one daemon request. Each front end (stdio,
+// sockets) provides its own implementation and decides how chunks, errors and
+// the end of a response are encoded on the wire.
+class ResponseChannel {
+public:
+    virtual ~ResponseChannel() = default;
+
+    // Called once before any audio() of a successful request
+    virtual void begin(const ResponseInfo& info) {}
+
+    // One piece of encoded audio. In streaming mode every call is one chunk.
+    virtual void audio(const uint8_t* data, size_t n) = 0;
+
+    // The request failed; no further output follows.
+    virtual void error(const std::string& msg) = 0;
+
+    // The request completed successfully; no further output follows.
+    virtual void end() {}
+
+    // True once the peer is gone and output is being discarded.
+    virtual bool closed() const { return false; }
+
+    // Block the calling thread while the peer is too far behind on output,
+    // up to `timeout`; false if it still is. Called on the request's own
+    // thread before it queues more output, so that audio() itself, which
+    // runs on the stage pool, never waits for a client.
+    virtual bool waitWritable(std::chrono::steady_clock::duration timeout) { return true; }
+
+    // Call `fn` (on any thread) when the peer goes away while this response
+    // is still alive, immediately if it is already gone. Front ends without a
+    // peer that can disappear ignore it.
+    virtual void onDisconnect(std::function<void()> fn) {}
+
+    // Id of the request this channel answers, for front ends that multiplex
+    // several responses on one stream (--framed)
+    virtual void setRequestId(uint32_t id) {}
+
+    // Connection the request arrived on, unique for the daemon's lifetime.
+    // Clients choose request ids, so ids are only meaningful per client; 0
+    // is the stdin client.
+    virtual uint64_t client() const { return 0; }
+
+    // True if this front end always wants chunked output, whatever the
+    // daemon's --stream setting
+    virtual bool streaming() const { return false; }
+};
+
+inline void putLe32(uint8_t* dst, uint32_t v) {
+    dst[0] = static_cast<uint8_t>(v & 0xFF);
+    dst[1] = static_cast<uint8_t>((v >> 8) & 0xFF);
+    dst[2] = static_cast<uint8_t>((v >> 16) & 0xFF);
+    dst[3] = static_cast<uint8_t>((v >> 24) & 0xFF);
+}
@@ -0,0 +1,676 @@
+#include "SocketServer.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include "Framing.hpp"
+#include "HttpProtocol.hpp"
+
+using namespace std;
+
+namespace {
+// Hold back a request's next chunk while this much is queued for its client
+constexpr size_t kHighWatermark = 4 * 1024 * 1024;
+// Requests a framed client may have in flight at once
+constexpr size_t kMaxFramedInFlight = 64;
+// How long stop() waits for in-flight responses to drain
+constexpr auto kShutdownGrace = chrono::seconds(5);
+
+runtime_error sysError(const string& what) {
+    return runtime_error(what + ": " + strerror(errno));
+}
+
+// Response encoding for unix:/tcp: listeners. Every response is a sequence of
+// chunks, each prefixed with its 4-byte little-endian length, terminated by a
+// zero-length chunk. An error is a single chunk whose length has the top bit
+// set, carrying a JSON object with an "error" field, and also ends the
+// response.
+class LineChannel : public ResponseChannel {
+public:
+    explicit LineChannel(shared_ptr<Connection> conn) : conn_(std::move(conn)) {}
+
+    // A response that was dropped without end() still releases the connection
+    ~LineChannel() override {
+        if (!done_) end();
+    }
+
+    void audio(const uint8_t* data, size_t n) override {
+        if (done_ || n == 0) return;
+        uint8_t hdr[4];
+        putLe32(hdr, static_cast<uint32_t>(n));
+        conn_->write({{reinterpret_cast<const char*>(hdr), sizeof(hdr)},
+                      {reinterpret_cast<const char*>(data), n}});
+    }
+
+    void error(const string& msg) override {
+        if (done_) return;
+        nlohmann::json e;
+        e["error"] = msg;
+        auto body = e.dump();
+        uint8_t hdr[4];
+        putLe32(hdr, 0x80000000u | static_cast<uint32_t>(body.size()));
+        conn_->write({{reinterpret_cast<const char*>(hdr), sizeof(hdr)}, body});
+        done_ = true;
+        conn_->finish();
+    }
+
+    void end() override {
+        if (done_) return;
+        uint8_t hdr[4];
+        putLe32(hdr, 0);
+        conn_->write({{reinterpret_cast<const char*>(hdr), sizeof(hdr)}});
+        done_ = true;
+        conn_->finish();
+    }
+
+    bool closed() const override { return conn_->isClosed(); }
+    bool waitWritable(chrono::steady_clock::duration timeout) override { return conn_->waitWritable(timeout); }
+    void onDisconnect(function<void()> fn) override { watch_.set(conn_, std::move(fn)); }
+    uint64_t client() const override { return conn_->serial; }
+
+private:
+    shared_ptr<Connection> conn_;
+    DisconnectWatch watch_;
+    bool done_ = false;
+};
+
+// Same responses in the multiplexed frame encoding of Framing.hpp. Frames
+// are tagged, so out-of-band requests can report errors here too; they just
+// do not count as in flight.
+class FramedLineChannel : public FramedChannel {
+public:
+    FramedLineChannel(shared_ptr<Connection> conn, bool outOfBand)
+        : FramedChannel([c = conn.get()](string frame) { c->write({frame}); }), conn_(std::move(conn)),
+          outOfBand_(outOfBand) {}
+
+    ~FramedLineChannel() override {
+        if (!done_ && !outOfBand_) end();
+    }
+
+    void error(const string& msg) override {
+        if (done_) return;
+        FramedChannel::error(msg);
+        if (!outOfBand_) conn_->finish();
+    }
+
+    void end() override {
+        if (done_) return;
+        FramedChannel::end();
+        if (!outOfBand_) conn_->finish();
+    }
+
+    bool closed() const override { return conn_->isClosed(); }
+    bool waitWritable(chrono::steady_clock::duration timeout) override { return conn_->waitWritable(timeout); }
+    void onDisconnect(function<void()> fn) override { watch_.set(conn_, std::move(fn)); }
+    uint64_t client() const override { return conn_->serial; }
+
+private:
+    shared_ptr<Connection> conn_;
+    DisconnectWatch watch_;
+    bool outOfBand_;
+};
+
+// One JSON request per line, or a binary request record (Framing.hpp)
+struct LineProtocol : Protocol {
+    explicit LineProtocol(bool framed) : framed(framed) {}
+
+    bool framed;
+
+    bool parse(const shared_ptr<Connection>& conn) override {
+        size_t start = 0;
+        while (start < conn->inBuf.size()) {
+            if (uint8_t(conn->inBuf[start]) == kBinaryRequestMarker) {
+                auto size = binaryRequestSize(conn->inBuf.data() + start, conn->inBuf.size() - start);
+                if (!size) break;
+                if (*size > kBinaryRequestHeaderSize + kMaxLineBytes) return false;
+                if (conn->inBuf.size() - start < *size) break;
+                queue(conn, conn->inBuf.substr(start, *size));
+                start += *size;
+                continue;
+            }
+            size_t pos = conn->inBuf.find('\n', start);
+            if (pos == string::npos) break;
+            queue(conn, conn->inBuf.substr(start, pos - start));
+            start = pos + 1;
+        }
+        conn->inBuf.erase(0, start);
+        return conn->inBuf.size() <= kBinaryRequestHeaderSize + kMaxLineBytes;
+    }
+
+    // Like getline, accept a final line without a trailing newline
+    void finishInput(const shared_ptr<Connection>& conn) override {
+        queue(conn, std::move(conn->inBuf));
+        conn->inBuf.clear();
+    }
+
+    void queue(const shared_ptr<Connection>& conn, string line) {
+        bool binary = !line.empty() && uint8_t(line[0]) == kBinaryRequestMarker;
+        if (!binary && !line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) return;
+        conn->pending.push_back(PendingRequest{std::move(line), [conn, framed = framed](bool outOfBand) -> shared_ptr<ResponseChannel> {
+            if (framed) return make_shared<FramedLineChannel>(conn, outOfBand);
+            if (outOfBand) return make_shared<OutOfBandChannel>(conn->serial);
+            return make_shared<LineChannel>(conn);
+        }});
+    }
+};
+}
+
+// ----------------------------------------------------------------------------
+
+void Connection::write(initializer_list<string_view> parts) {
+    {
+        lock_guard<mutex> lk(mtx);
+        if (closed || sealed) return;
+        for (auto part : parts) outBuf.append(part);
+    }
+    server->wake(shared_from_this());
+}
+
+bool Connection::waitWritable(chrono::steady_clock::duration timeout) {
+    unique_lock<mutex> lk(mtx);
+    return drained.wait_for(lk, timeout,
+                            [&]() { return closed || sealed || outBuf.size() - outOff < kHighWatermark; });
+}
+
+void Connection::writeNow(initializer_list<string_view> parts) {
+    lock_guard<mutex> lk(mtx);
+    if (closed || sealed) return;
+    for (auto part : parts) outBuf.append(part);
+}
+
+void Connection::finish() {
+    {
+        lock_guard<mutex> lk(mtx);
+        finished++;
+    }
+    server->wake(shared_from_this());
+}
+
+void Connection::fail() {
+    {
+        lock_guard<mutex> lk(mtx);
+        finished++;
+        abort = true;
+    }
+    server->wake(shared_from_this());
+}
+
+void Connection::seal() {
+    unordered_map<uint64_t, function<void()>> hooks;
+    {
+        lock_guard<mutex> lk(mtx);
+        if (closed || sealed) return;
+        sealed = true;
+        hooks.swap(disconnectHooks);
+    }
+    drained.notify_all();
+    for (auto& [id, hook] : hooks) hook();
+}
+
+bool Connection::isClosed() {
+    lock_guard<mutex> lk(mtx);
+    return closed || sealed;
+}
+
+uint64_t Connection::addDisconnectHook(function<void()> fn) {
+    {
+        lock_guard<mutex> lk(mtx);
+        if (!closed && !sealed) {
+            uint64_t id = ++nextHookId;
+            disconnectHooks.emplace(id, std::move(fn));
+            return id;
+        }
+    }
+    fn();
+    return 0;
+}
+
+void Connection::removeDisconnectHook(uint64_t id) {
+    lock_guard<mutex> lk(mtx);
+    disconnectHooks.erase(id);
+}
+
+void OutOfBandChannel::error(const string& msg) {
+    spdlog::warn("Out-of-band request failed: {}", msg);
+}
+
+void DisconnectWatch::set(const shared_ptr<Connection>& conn, function<void()> fn) {
+    reset();
+    conn_ = conn;
+    id_ = conn->addDisconnectHook(std::move(fn));
+}
+
+void DisconnectWatch::reset() {
+    if (conn_ && id_ != 0) conn_->removeDisconnectHook(id_);
+    conn_.reset();
+    id_ = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+SocketServer::SocketServer(RequestHandler onRequest) : onRequest_(std::move(onRequest)) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) throw sysError("epoll_create1");
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) throw sysError("eventfd");
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd_;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev);
+}
+
+SocketServer::~SocketServer() {
+    for (auto& [fd, conn] : conns_) ::close(fd);
+    for (auto& [fd, kind] : listeners_) ::close(fd);
+    if (wakeFd_ >= 0) ::close(wakeFd_);
+    if (epollFd_ >= 0) ::close(epollFd_);
+    for (auto& path : unixPaths_) ::unlink(path.c_str());
+}
+
+void SocketServer::listen(const string& spec) {
+    int listenFd = -1;
+    ListenerKind kind = ListenerKind::Lines;
+
+    if (spec.rfind("unix:", 0) == 0) {
+        string path = spec.substr(5);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            throw runtime_error("Invalid unix socket path: " + path);
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        // Remove a stale socket left by a previous run, but never a regular file
+        struct stat st{};
+        if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            ::unlink(path.c_str());
+        }
+
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) throw sysError("socket");
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            ::close(listenFd);
+            throw sysError("bind " + path);
+        }
+        unixPaths_.push_back(path);
+    } else if (spec.rfind("tcp:", 0) == 0 || spec.rfind("http:", 0) == 0) {
+        kind = spec.rfind("http:", 0) == 0 ? ListenerKind::Http : ListenerKind::Lines;
+        string hostPort = spec.substr(spec.find(':') + 1);
+        auto colon = hostPort.rfind(':');
+        if (colon == string::npos) throw runtime_error("Expected HOST:PORT in " + spec);
+        string host = hostPort.substr(0, colon);
+        string port = hostPort.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* res = nullptr;
+        const char* node = (host.empty() || host == "*") ? nullptr : host.c_str();
+        int rc = getaddrinfo(node, port.c_str(), &hints, &res);
+        if (rc != 0) throw runtime_error("getaddrinfo " + hostPort + ": " + gai_strerror(rc));
+
+        for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+            int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                listenFd = fd;
+                break;
+            }
+            ::close(fd);
+        }
+        freeaddrinfo(res);
+        if (listenFd < 0) throw sysError("bind " + hostPort);
+    } else {
+        throw runtime_error("Unknown listen address (expected unix:PATH, tcp:HOST:PORT or http:HOST:PORT): " + spec);
+    }
+
+    if (::listen(listenFd, SOMAXCONN) < 0) {
+        ::close(listenFd);
+        throw sysError("listen");
+    }
+    listeners_[listenFd] = kind;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd, &ev);
+    spdlog::info("Listening on {}", spec);
+}
+
+void SocketServer::stop() {
+    stopping_.store(true);
+    uint64_t one = 1;
+    [[maybe_unused]] auto n = ::write(wakeFd_, &one, sizeof(one));
+}
+
+void SocketServer::wake(const shared_ptr<Connection>& conn) {
+    {
+        lock_guard<mutex> lk(wakeMutex_);
+        woken_.push_back(conn);
+    }
+    uint64_t one = 1;
+    [[maybe_unused]] auto n = ::write(wakeFd_, &one, sizeof(one));
+}
+
+void SocketServer::run() {
+    constexpr int kMaxEvents = 64;
+    epoll_event events[kMaxEvents];
+    optional<chrono::steady_clock::time_point> deadline;
+
+    while (true) {
+        if (stopping_.load()) {
+            if (!deadline) {
+                // Stop accepting and drop queued requests; let in-flight ones finish
+                for (auto& [fd, kind] : listeners_) {
+                    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+                    ::close(fd);
+                }
+                listeners_.clear();
+                for (auto& [fd, conn] : conns_) conn->pending.clear();
+                deadline = chrono::steady_clock::now() + kShutdownGrace;
+            }
+            if (idle() || chrono::steady_clock::now() >= *deadline) break;
+        }
+
+        int n = epoll_wait(epollFd_, events, kMaxEvents, deadline ? 100 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw sysError("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            uint32_t ev = events[i].events;
+            if (fd == wakeFd_) {
+                drainWakeups();
+                continue;
+            }
+            if (auto l = listeners_.find(fd); l != listeners_.end()) {
+                acceptClients(fd, l->second);
+                continue;
+            }
+
+            auto it = conns_.find(fd);
+            if (it == conns_.end()) continue;
+            auto conn = it->second;
+            if (ev & EPOLLERR) {
+                closeConnection(conn);
+                continue;
+            }
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) handleReadable(conn);
+            // Hung up in both directions: nothing more to read, and nobody to
+            // answer. EPOLLHUP is reported whatever the mask, so leaving the
+            // connection registered would spin until its requests finish.
+            if (conn->fd >= 0 && (ev & EPOLLHUP) && conn->readClosed) {
+                closeConnection(conn);
+                continue;
+            }
+            if (conn->fd >= 0 && (ev & EPOLLOUT)) flush(conn);
+            if (conn->fd >= 0) maybeFinish(conn);
+        }
+    }
+
+    vector<shared_ptr<Connection>> remaining;
+    for (auto& [fd, conn] : conns_) remaining.push_back(conn);
+    for (auto& conn : remaining) closeConnection(conn);
+}
+
+void SocketServer::acceptClients(int listenFd, ListenerKind kind) {
+    while (true) {
+        int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                spdlog::warn("accept failed: {}", strerror(errno));
+            }
+            return;
+        }
+
+        // Chunks are small and latency sensitive; harmless on unix sockets
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto conn = make_shared<Connection>();
+        conn->fd = fd;
+        conn->serial = ++nextSerial_;
+        conn->server = this;
+        if (kind == ListenerKind::Http) {
+            conn->protocol = makeHttpProtocol();
+        } else {
+            conn->protocol = make_unique<LineProtocol>(framed_);
+            if (framed_) conn->maxInFlight = kMaxFramedInFlight;
+        }
+        conns_[fd] = conn;
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+        spdlog::debug("Client connected (fd {}, {} open)", fd, conns_.size());
+    }
+}
+
+void SocketServer::handleReadable(const shared_ptr<Connection>& conn) {
+    if (conn->readClosed) return;
+
+    char buf[16384];
+    while (true) {
+        ssize_t r = ::recv(conn->fd, buf, sizeof(buf), 0);
+        if (r > 0) {
+            conn->inBuf.append(buf, r);
+            continue;
+        }
+        if (r == 0) {
+            conn->readClosed = true;
+            // A hang-up, unless the client may half-close and has nothing
+            // running yet: its synthesis is cancelled at once instead of
+            // when a later write fails, or never for a buffered response
+            if (!conn->protocol->halfClose() || conn->inFlight > 0) {
+                closeConnection(conn);
+                return;
+            }
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        closeConnection(conn);
+        return;
+    }
+
+    if (stopping_.load()) {
+        conn->inBuf.clear();
+    } else if (!conn->protocol->parse(conn)) {
+        // Flush whatever the protocol queued (e.g. an error reply), then close
+        conn->readClosed = true;
+        conn->closeWhenDone = true;
+        conn->inBuf.clear();
+    }
+
+    if (conn->readClosed) {
+        if (!stopping_.load()) conn->protocol->finishInput(conn);
+        updateEvents(conn);
+    }
+
+    dispatchNext(conn);
+    if (conn->fd >= 0) flush(conn);
+}
+
+void SocketServer::dispatchNext(const shared_ptr<Connection>& conn) {
+    dispatchOutOfBand(conn);
+    while (conn->fd >= 0 && conn->inFlight < conn->maxInFlight) {
+        if (conn->pending.empty() && !conn->inBuf.empty() && !stopping_.load()) {
+            // Protocols that hold back pipelined requests pick them up here
+            if (!conn->protocol->parse(conn)) {
+                conn->closeWhenDone = true;
+                conn->inBuf.clear();
+            }
+            dispatchOutOfBand(conn);
+        }
+        if (conn->pending.empty()) return;
+
+        conn->inFlight++;
+        auto req = std::move(conn->pending.front());
+        conn->pending.pop_front();
+        onRequest_(req.body, req.open(false));
+    }
+}
+
+void SocketServer::dispatchOutOfBand(const shared_ptr<Connection>& conn) {
+    if (!outOfBand_) return;
+    for (auto it = conn->pending.begin(); it != conn->pending.end();) {
+        if (!it->outOfBand) it->outOfBand = outOfBand_(it->body);
+        if (!*it->outOfBand) {
+            ++it;
+            continue;
+        }
+        auto req = std::move(*it);
+        it = conn->pending.erase(it);
+        onRequest_(req.body, req.open(true));
+    }
+}
+
+void SocketServer::drainWakeups() {
+    uint64_t count;
+    while (::read(wakeFd_, &count, sizeof(count)) > 0) {
+    }
+
+    vector<shared_ptr<Connection>> woken;
+    {
+        lock_guard<mutex> lk(wakeMutex_);
+        woken.swap(woken_);
+    }
+
+    for (auto& conn : woken) {
+        if (conn->fd < 0) continue;
+        flush(conn);
+        if (conn->fd < 0) continue;
+
+        size_t finished = 0;
+        bool abort = false;
+        {
+            lock_guard<mutex> lk(conn->mtx);
+            finished = conn->finished;
+            abort = conn->abort;
+            conn->finished = 0;
+        }
+        if (finished > 0) {
+            conn->inFlight -= min(finished, conn->inFlight);
+            if (abort) {
+                conn->pending.clear();
+                conn->closeWhenDone = true;
+            } else {
+                dispatchNext(conn);
+                if (conn->fd >= 0) flush(conn);
+            }
+        }
+        if (conn->fd >= 0) maybeFinish(conn);
+    }
+}
+
+void SocketServer::flush(const shared_ptr<Connection>& conn) {
+    bool pendingOut = false;
+    {
+        unique_lock<mutex> lk(conn->mtx);
+        while (conn->outOff < conn->outBuf.size()) {
+            ssize_t w = ::send(conn->fd, conn->outBuf.data() + conn->outOff,
+                               conn->outBuf.size() - conn->outOff, MSG_NOSIGNAL);
+            if (w > 0) {
+                conn->outOff += w;
+                continue;
+            }
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            lk.unlock();
+            closeConnection(conn);
+            return;
+        }
+
+        if (conn->outOff == conn->outBuf.size()) {
+            conn->outBuf.clear();
+            conn->outOff = 0;
+        } else if (conn->outOff > conn->outBuf.size() / 2) {
+            conn->outBuf.erase(0, conn->outOff);
+            conn->outOff = 0;
+        }
+        pendingOut = conn->outOff < conn->outBuf.size();
+    }
+    conn->drained.notify_all();
+
+    if (pendingOut != conn->writeArmed) {
+        conn->writeArmed = pendingOut;
+        updateEvents(conn);
+    }
+}
+
+void SocketServer::updateEvents(const shared_ptr<Connection>& conn) {
+    epoll_event ev{};
+    ev.events = (conn->readClosed ? 0 : (EPOLLIN | EPOLLRDHUP)) | (conn->writeArmed ? EPOLLOUT : 0);
+    ev.data.fd = conn->fd;
+    epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void SocketServer::maybeFinish(const shared_ptr<Connection>& conn) {
+    // A client that half-closed after sending its requests (or whose protocol
+    // asked for it) is disconnected once every response has been written
+    if (!(conn->readClosed || conn->closeWhenDone) || conn->inFlight > 0 || !conn->pending.empty()) return;
+    {
+        lock_guard<mutex> lk(conn->mtx);
+        if (conn->outOff < conn->outBuf.size()) return;
+    }
+    closeConnection(conn);
+}
+
+void SocketServer::closeConnection(const shared_ptr<Connection>& conn) {
+    if (conn->fd < 0) return;
+    int fd = conn->fd;
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    conns_.erase(fd);
+    conn->fd = -1;
+    unordered_map<uint64_t, function<void()>> hooks;
+    {
+        lock_guard<mutex> lk(conn->mtx);
+        conn->closed = true;
+        conn->outBuf.clear();
+        conn->outOff = 0;
+        hooks.swap(conn->disconnectHooks);
+    }
+    conn->pending.clear();
+    conn->drained.notify_all();
+    // Lets in-flight requests of this client stop early (e.g. cancel synthesis)
+    for (auto& [id, hook] : hooks) hook();
+    spdlog::debug("Client disconnected (fd {}, {} open)", fd, conns_.size());
+}
+
+bool SocketServer::idle() const {
+    for (auto& [fd, conn] : conns_) {
+        if (conn->inFlight > 0) return false;
+        lock_guard<mutex> lk(conn->mtx);
+        if (conn->outOff < conn->outBuf.size()) return false;
+    }
+    return true;
+}
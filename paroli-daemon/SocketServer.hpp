@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ResponseChannel.hpp"
+
+class SocketServer;
+struct Protocol;
+
+// One request parsed off a connection, waiting for its turn. `open` makes
+// the response channel; out-of-band requests get one that never ends the
+// connection's current response.
+struct PendingRequest {
+    std::string body;
+    std::function<std::shared_ptr<ResponseChannel>(bool outOfBand)> open;
+    std::optional<bool> outOfBand; // classified on first look
+};
+
+// State of one client connection. Fields in the first block belong to the
+// I/O thread; the rest is shared with workers and guarded by `mtx`.
+struct Connection : std::enable_shared_from_this<Connection> {
+    int fd = -1;
+    uint64_t serial = 0; // unlike fd, never reused
+    SocketServer* server = nullptr;
+    std::unique_ptr<Protocol> protocol;
+
+    std::string inBuf;
+    std::deque<PendingRequest> pending;
+    size_t inFlight = 0;
+    size_t maxInFlight = 1; // more than one only for framed connections
+    bool readClosed = false;
+    bool closeWhenDone = false;
+    bool writeArmed = false;
+
+    std::mutex mtx;
+    std::condition_variable drained;
+    std::string outBuf;
+    size_t outOff = 0;
+    bool closed = false;
+    bool sealed = false; // no more output accepted, see seal()
+    size_t finished = 0;
+    bool abort = false;
+    std::unordered_map<uint64_t, std::function<void()>> disconnectHooks;
+    uint64_t nextHookId = 0;
+
+    // Queue bytes for the I/O thread as one unit. Never blocks: stage pool
+    // threads call it, so backpressure is applied by waitWritable() instead.
+    void write(std::initializer_list<std::string_view> parts);
+
+    // Same, for the I/O thread itself, which needs no wakeup
+    void writeNow(std::initializer_list<std::string_view> parts);
+
+    // Block the calling request thread while this client is too far behind,
+    // up to `timeout`. False if it still is when that runs out.
+    bool waitWritable(std::chrono::steady_clock::duration timeout);
+
+    // Mark one in-flight request as done so the next one can be dispatched
+    void finish();
+
+    // Drop the connection after the current request (e.g. a response that
+    // failed after its headers were sent)
+    void fail();
+
+    // Accept no output beyond what is already queued, e.g. once a WebSocket
+    // Close has been sent; the connection's requests are told the client is
+    // gone through its disconnect hooks. For the I/O thread.
+    void seal();
+
+    // True once the connection is closed or sealed
+    bool isClosed();
+
+    // Register a callback for when the connection closes; runs at once if it
+    // already has. Returns a handle for removeDisconnectHook.
+    uint64_t addDisconnectHook(std::function<void()> fn);
+    void removeDisconnectHook(uint64_t id);
+};
+
+// Channel for out-of-band requests on connections whose responses cannot be
+// interleaved: output is dropped and errors are only logged
+class OutOfBandChannel : public ResponseChannel {
+public:
+    explicit OutOfBandChannel(uint64_t client) : client_(client) {}
+
+    void audio(const uint8_t* data, size_t n) override {}
+    void error(const std::string& msg) override;
+    uint64_t client() const override { return client_; }
+
+private:
+    uint64_t client_;
+};
+
+// Disconnect hook owned by one response channel, removed with the channel
+class DisconnectWatch {
+public:
+    DisconnectWatch() = default;
+    DisconnectWatch(const DisconnectWatch&) = delete;
+    DisconnectWatch& operator=(const DisconnectWatch&) = delete;
+    ~DisconnectWatch() { reset(); }
+
+    void set(const std::shared_ptr<Connection>& conn, std::function<void()> fn);
+    void reset();
+
+private:
+    std::shared_ptr<Connection> conn_;
+    uint64_t id_ = 0;
+};
+
+// Wire protocol of a connection. Runs on the I/O thread only.
+struct Protocol {
+    virtual ~Protocol() = default;
+
+    // Consume `conn.inBuf`, appending complete requests to `conn.pending`.
+    // Returns false if the connection must be closed.
+    virtual bool parse(const std::shared_ptr<Connection>& conn) = 0;
+
+    // Input ended; flush whatever is left in `conn.inBuf`
+    virtual void finishInput(const std::shared_ptr<Connection>& conn) {}
+
+    // Whether a client may shut down its sending side and still wait for
+    // its responses. Without it, end of input means the client hung up.
+    virtual bool halfClose() const { return true; }
+};
+
+// epoll front end for paroli-daemon. A single I/O thread accepts clients on
+// any number of listeners, parses their requests and hands each one to
+// `onRequest` together with a channel for the response. Workers write into
+// that channel from their own threads; the bytes are buffered per connection
+// and flushed by the I/O thread, so a slow client only stalls its own request.
+// Requests from one connection are answered in order, unless the server is
+// framed, in which case line connections run several at once and tag every
+// frame with its request id (see Framing.hpp).
+//
+// Listener specs:
+//   unix:PATH, tcp:HOST:PORT   JSON lines, see LineProtocol in the .cpp
+//   http:HOST:PORT             HTTP/1.1 and WebSocket, see HttpProtocol.hpp
+class SocketServer {
+public:
+    using RequestHandler = std::function<void(const std::string& request, std::shared_ptr<ResponseChannel> channel)>;
+    using RequestFilter = std::function<bool(const std::string& request)>;
+
+    explicit SocketServer(RequestHandler onRequest);
+    ~SocketServer();
+
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator=(const SocketServer&) = delete;
+
+    void listen(const std::string& spec);
+
+    // Use the multiplexed frame encoding on unix:/tcp: listeners. Must be
+    // called before run().
+    void setFramed(bool framed) { framed_ = framed; }
+
+    // Requests for which `filter` returns true are handed over as soon as
+    // they are parsed, even while the connection's earlier requests are
+    // still running, and do not count as in flight (e.g. cancel, or text
+    // appended to a running request). They must not produce a response of
+    // their own. Must be called before run().
+    void setOutOfBand(RequestFilter filter) { outOfBand_ = std::move(filter); }
+
+    // Run the event loop until stop() is called and in-flight responses have
+    // been flushed (or a grace period expires).
+    void run();
+
+    // Async-signal-safe
+    void stop();
+
+private:
+    friend struct Connection;
+
+    enum class ListenerKind { Lines, Http };
+
+    void acceptClients(int listenFd, ListenerKind kind);
+    void handleReadable(const std::shared_ptr<Connection>& conn);
+    void dispatchNext(const std::shared_ptr<Connection>& conn);
+    void dispatchOutOfBand(const std::shared_ptr<Connection>& conn);
+    void flush(const std::shared_ptr<Connection>& conn);
+    void closeConnection(const std::shared_ptr<Connection>& conn);
+    void maybeFinish(const std::shared_ptr<Connection>& conn);
+    void updateEvents(const std::shared_ptr<Connection>& conn);
+    void drainWakeups();
+    bool idle() const;
+
+    // Called from worker threads
+    void wake(const std::shared_ptr<Connection>& conn);
+
+    RequestHandler onRequest_;
+    RequestFilter outOfBand_;
+    bool framed_ = false;
+    std::vector<std::string> unixPaths_;
+    std::unordered_map<int, ListenerKind> listeners_;
+    int epollFd_ = -1;
+    int wakeFd_ = -1;
+    std::atomic<bool> stopping_{false};
+
+    std::unordered_map<int, std::shared_ptr<Connection>> conns_;
+    uint64_t nextSerial_ = 0;
+
+    std::mutex wakeMutex_;
+    std::vector<std::shared_ptr<Connection>> woken_;
+};
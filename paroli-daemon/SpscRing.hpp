@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bounded ring of reusable slots between one producer and one consumer
+// thread. Both sides block (on the atomics, without a mutex) only when the
+// ring is full or empty, which is the backpressure between them. Slots keep
+// their contents when released, so buffers in them keep their capacity.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(capacity) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Producer: the slot to fill next, once there is room for it
+    T& claim() {
+        const uint64_t tail = tail_.load(std::memory_order_relaxed) & ~kClosed;
+        uint64_t head = head_.load(std::memory_order_acquire);
+        while (tail - head >= slots_.size()) {
+            head_.wait(head, std::memory_order_acquire);
+            head = head_.load(std::memory_order_acquire);
+        }
+        return slots_[tail % slots_.size()];
+    }
+
+    // Producer: hand the claimed slot to the consumer
+    void publish() {
+        tail_.fetch_add(1, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    // Producer: nothing more follows; the consumer drains what is left
+    void close() {
+        tail_.fetch_or(kClosed, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    // Consumer: number of filled slots, waiting for at least one; 0 once the
+    // ring is closed and empty
+    size_t wait() {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        uint64_t tail = tail_.load(std::memory_order_acquire);
+        while ((tail & ~kClosed) == head) {
+            if (tail & kClosed) return 0;
+            tail_.wait(tail, std::memory_order_acquire);
+            tail = tail_.load(std::memory_order_acquire);
+        }
+        return (tail & ~kClosed) - head;
+    }
+
+    // Consumer: number of filled slots right now, without waiting
+    size_t ready() const {
+        return (tail_.load(std::memory_order_acquire) & ~kClosed) - head_.load(std::memory_order_relaxed);
+    }
+
+    // Consumer: the i-th filled slot
+    T& operator[](size_t i) { return slots_[(head_.load(std::memory_order_relaxed) + i) % slots_.size()]; }
+
+    // Consumer: give the first `n` filled slots back to the producer
+    void release(size_t n) {
+        head_.fetch_add(n, std::memory_order_release);
+        head_.notify_one();
+    }
+
+private:
+    static constexpr uint64_t kClosed = uint64_t(1) << 63;
+
+    std::vector<T> slots_;
+    // Apart, so each side's counter stays in its own cache line
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+};
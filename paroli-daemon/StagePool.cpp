@@ -0,0 +1,197 @@
+#include "StagePool.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "AllocationCounter.hpp"
+
+using namespace std;
+
+namespace {
+const char* stageName(Stage stage) {
+    switch (stage) {
+    case Stage::Synthesize: return "synthesize";
+    case Stage::Handoff: return "handoff";
+    case Stage::Encode: return "encode";
+    case Stage::Output: return "output";
+    }
+    return "unknown";
+}
+
+// Index of the pool thread running on this thread, or -1
+thread_local int tWorkerIndex = -1;
+}
+
+StagePool::StagePool(int threads) : started_(chrono::steady_clock::now()) {
+    threads = max(1, threads);
+    for (int i = 0; i < threads; i++) workers_.push_back(make_unique<Worker>());
+    for (int i = 0; i < threads; i++) {
+        threads_.emplace_back([this, i]() {
+            tWorkerIndex = i;
+            run(i);
+        });
+    }
+}
+
+StagePool::~StagePool() {
+    {
+        lock_guard<mutex> lk(idleMutex_);
+        stopping_ = true;
+    }
+    idle_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+void StagePool::post(Stage stage, function<void()> fn) {
+    counters_[static_cast<size_t>(stage)].queued++;
+    enqueue(Task{stage, std::move(fn)});
+}
+
+void StagePool::enqueue(Task task) {
+    // Work posted by a pool thread stays local; everything else is spread
+    size_t target = tWorkerIndex >= 0 ? size_t(tWorkerIndex) : nextWorker_++ % workers_.size();
+    {
+        lock_guard<mutex> lk(workers_[target]->mtx);
+        workers_[target]->tasks.push_back(std::move(task));
+    }
+    {
+        lock_guard<mutex> lk(idleMutex_);
+        pending_++;
+    }
+    idle_.notify_one();
+}
+
+void StagePool::record(Stage stage, chrono::steady_clock::duration busy, uint64_t allocations) {
+    auto& c = counters_[static_cast<size_t>(stage)];
+    c.tasks++;
+    c.busyNanos += chrono::duration_cast<chrono::nanoseconds>(busy).count();
+    c.allocations += allocations;
+}
+
+bool StagePool::tryTake(size_t self, Task& task) {
+    {
+        auto& own = *workers_[self];
+        lock_guard<mutex> lk(own.mtx);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < workers_.size(); k++) {
+        auto& victim = *workers_[(self + k) % workers_.size()];
+        lock_guard<mutex> lk(victim.mtx);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void StagePool::run(size_t self) {
+    while (true) {
+        Task task;
+        if (!tryTake(self, task)) {
+            unique_lock<mutex> lk(idleMutex_);
+            idle_.wait(lk, [&]() { return stopping_ || pending_ > 0; });
+            if (stopping_ && pending_ == 0) return;
+            lk.unlock();
+            // Another thread may win the race for that task; just look again
+            if (!tryTake(self, task)) continue;
+        }
+        {
+            lock_guard<mutex> lk(idleMutex_);
+            pending_--;
+        }
+
+        auto& c = counters_[static_cast<size_t>(task.stage)];
+        c.queued--;
+        auto t0 = chrono::steady_clock::now();
+        auto allocs0 = allocations::thisThread();
+        try {
+            task.fn();
+        } catch (const exception& e) {
+            spdlog::error("{} task failed: {}", stageName(task.stage), e.what());
+        }
+        record(task.stage, chrono::steady_clock::now() - t0, allocations::thisThread() - allocs0);
+    }
+}
+
+nlohmann::json StagePool::stats(int synthesizeCapacity) const {
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - started_).count();
+    nlohmann::json j;
+    for (size_t i = 0; i < kStageCount; i++) {
+        auto stage = static_cast<Stage>(i);
+        auto& c = counters_[i];
+        double busy = c.busyNanos.load() / 1e9;
+        bool requestThread = stage == Stage::Synthesize || stage == Stage::Handoff;
+        double capacity = requestThread ? max(1, synthesizeCapacity) : double(threads_.size());
+        j[stageName(stage)] = {
+            {"tasks", c.tasks.load()},
+            {"queued", max<int64_t>(0, c.queued.load())},
+            {"busy_seconds", busy},
+            {"utilization", wall > 0 ? busy / (wall * capacity) : 0.0},
+        };
+        if (allocations::enabled()) {
+            auto tasks = c.tasks.load();
+            j[stageName(stage)]["allocations_per_task"] = tasks > 0 ? double(c.allocations.load()) / tasks : 0.0;
+        }
+    }
+    return j;
+}
+
+// ----------------------------------------------------------------------------
+
+void Strand::post(Stage stage, function<void()> fn) {
+    unique_lock<mutex> lk(mtx_);
+    cv_.wait(lk, [&]() { return tasks_.size() < capacity_; });
+    pool_.counters_[static_cast<size_t>(stage)].queued++;
+    tasks_.emplace_back(stage, std::move(fn));
+    if (running_) return;
+    running_ = true;
+    lk.unlock();
+    pool_.enqueue(StagePool::Task{stage, [self = shared_from_this()]() { self->runNext(); }});
+}
+
+void Strand::runNext() {
+    pair<Stage, function<void()>> task;
+    bool skip = false;
+    {
+        lock_guard<mutex> lk(mtx_);
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+        skip = error_ != nullptr;
+    }
+    cv_.notify_all();
+
+    if (!skip) {
+        try {
+            task.second();
+        } catch (...) {
+            lock_guard<mutex> lk(mtx_);
+            error_ = current_exception();
+        }
+    }
+
+    Stage next;
+    {
+        lock_guard<mutex> lk(mtx_);
+        if (tasks_.empty()) {
+            running_ = false;
+            cv_.notify_all();
+            return;
+        }
+        next = tasks_.front().first;
+    }
+    // One task per pool slot keeps requests interleaved fairly
+    pool_.enqueue(StagePool::Task{next, [self = shared_from_this()]() { self->runNext(); }});
+}
+
+void Strand::drain() {
+    unique_lock<mutex> lk(mtx_);
+    cv_.wait(lk, [&]() { return !running_ && tasks_.empty(); });
+    if (error_) rethrow_exception(exchange(error_, nullptr));
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+// Stages of one request, from text to bytes on the wire
+enum class Stage {
+    Synthesize, // phonemize, encoder and decoder; runs on the request thread
+    Handoff,    // queueing a chunk for the next stages; on the request thread
+    Encode,     // resampling and container/codec encoding
+    Output,     // handing bytes to the response channel
+};
+constexpr size_t kStageCount = 4;
+
+// Work-stealing thread pool for the CPU-light stages of every request. Each
+// thread owns a deque: it pushes and pops its own work at the back and, when
+// idle, steals from the front of the others, so encoding and output of many
+// requests overlap with each other and with synthesis instead of running in
+// turn on the thread that synthesized them.
+//
+// Per-stage task counts, busy time and queue depth are kept for stats().
+class StagePool {
+public:
+    explicit StagePool(int threads);
+    ~StagePool();
+
+    StagePool(const StagePool&) = delete;
+    StagePool& operator=(const StagePool&) = delete;
+
+    void post(Stage stage, std::function<void()> fn);
+
+    // Account for stage work done outside the pool (Synthesize, Handoff)
+    void record(Stage stage, std::chrono::steady_clock::duration busy, uint64_t allocations = 0);
+
+    // {"<stage>": {"tasks", "queued", "busy_seconds", "utilization"}, ...};
+    // utilization is busy time over wall time times `capacity` for
+    // Synthesize and Handoff, or the pool size for the other stages. Builds that count
+    // allocations add "allocations_per_task".
+    nlohmann::json stats(int synthesizeCapacity) const;
+
+private:
+    friend class Strand;
+
+    struct Task {
+        Stage stage;
+        std::function<void()> fn;
+    };
+
+    void enqueue(Task task);
+
+    struct Worker {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    struct StageCounters {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<int64_t> queued{0};
+        std::atomic<int64_t> busyNanos{0};
+        std::atomic<uint64_t> allocations{0};
+    };
+
+    void run(size_t self);
+    bool tryTake(size_t self, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::array<StageCounters, kStageCount> counters_;
+    std::chrono::steady_clock::time_point started_;
+
+    std::mutex idleMutex_;
+    std::condition_variable idle_;
+    size_t pending_ = 0; // guarded by idleMutex_
+    bool stopping_ = false;
+    std::atomic<size_t> nextWorker_{0};
+};
+
+// Runs the tasks of one request on a StagePool strictly in order, one at a
+// time, with at most `capacity` outstanding; post() blocks beyond that so a
+// request cannot run arbitrarily far ahead of its slowest stage. The first
+// exception thrown by a task skips the rest and is rethrown by drain().
+class Strand : public std::enable_shared_from_this<Strand> {
+public:
+    Strand(StagePool& pool, size_t capacity) : pool_(pool), capacity_(capacity) {}
+
+    void post(Stage stage, std::function<void()> fn);
+
+    // Wait for every posted task; rethrows the first failure
+    void drain();
+
+private:
+    void runNext();
+
+    StagePool& pool_;
+    size_t capacity_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::pair<Stage, std::function<void()>>> tasks_;
+    bool running_ = false;
+    std::exception_ptr error_;
+};
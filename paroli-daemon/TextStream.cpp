@@ -0,0 +1,124 @@
+#include "TextStream.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+
+using namespace std;
+
+namespace {
+// A clause (up to , ; :) is spoken on its own only if it is at least this
+// long; shorter ones wait for the rest of their sentence
+constexpr size_t kMinClauseBytes = 32;
+// Text without any boundary is cut at the last space once it gets this long
+constexpr size_t kMaxSegmentBytes = 400;
+// A stream that gets no text for this long is given up
+constexpr auto kIdleTimeout = chrono::seconds(30);
+
+bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Full-width sentence terminators (。！？) end a sentence without a space
+constexpr string_view kWideTerminators[] = {"\xE3\x80\x82", "\xEF\xBC\x81", "\xEF\xBC\x9F"};
+}
+
+void TextStream::append(const string& text) {
+    {
+        lock_guard<mutex> lk(mtx_);
+        if (ended_) throw runtime_error("Text stream already ended");
+        if (text.empty()) return;
+        buffer_ += text;
+        lastText_ = Clock::now();
+        if (!firstText_) firstText_ = lastText_;
+    }
+    cv_.notify_all();
+}
+
+void TextStream::end() {
+    {
+        lock_guard<mutex> lk(mtx_);
+        ended_ = true;
+    }
+    cv_.notify_all();
+}
+
+optional<TextStream::Clock::time_point> TextStream::firstText() const {
+    lock_guard<mutex> lk(mtx_);
+    return firstText_;
+}
+
+bool TextStream::idle() const {
+    lock_guard<mutex> lk(mtx_);
+    return Clock::now() - lastText_ >= kIdleTimeout;
+}
+
+void TextStream::wakeAll() {
+    {
+        lock_guard<mutex> lk(mtx_);
+    }
+    cv_.notify_all();
+}
+
+size_t TextStream::segmentLength() const {
+    size_t end = string::npos;
+    // The character after a terminator must have arrived, so "3." does not
+    // split "3.14" and "Dr." is only split once the space is in
+    for (size_t i = 0; i < buffer_.size() && end == string::npos; i++) {
+        char c = buffer_[i];
+        if (c == '\n') {
+            end = i + 1;
+        } else if (i + 1 < buffer_.size() && isSpace(buffer_[i + 1])) {
+            if (c == '.' || c == '!' || c == '?') end = i + 1;
+            if ((c == ',' || c == ';' || c == ':') && i + 1 >= kMinClauseBytes) end = i + 1;
+        }
+    }
+    for (auto t : kWideTerminators) {
+        if (auto pos = buffer_.find(t); pos != string::npos) end = min(end, pos + t.size());
+    }
+    if (end != string::npos) return end;
+
+    if (buffer_.size() >= kMaxSegmentBytes) {
+        auto pos = buffer_.find_last_of(" \t", kMaxSegmentBytes);
+        return pos == string::npos || pos == 0 ? kMaxSegmentBytes : pos;
+    }
+    return 0;
+}
+
+optional<string> TextStream::poll() {
+    lock_guard<mutex> lk(mtx_);
+    return takeLocked();
+}
+
+// The first complete segment, or after end() whatever is left
+optional<string> TextStream::takeLocked() {
+    while (true) {
+        size_t n = segmentLength();
+        if (n == 0 && ended_) n = buffer_.size();
+        if (n == 0) return nullopt;
+        string segment = buffer_.substr(0, n);
+        // A cut inside a multi-byte character would garble both halves
+        while (n < buffer_.size() && (buffer_[n] & 0xC0) == 0x80) segment += buffer_[n++];
+        buffer_.erase(0, n);
+        // Skip segments with nothing to say, e.g. a lone newline
+        if (segment.find_first_not_of(" \t\r\n") == string::npos) continue;
+        return segment;
+    }
+}
+
+optional<string> TextStream::next(CancelToken* cancel) {
+    // Registered before taking our lock: cancel() calls the hook with the
+    // token's lock held
+    auto interrupt = CancelToken::interruptWith(cancel, [this]() { wakeAll(); });
+
+    unique_lock<mutex> lk(mtx_);
+    while (true) {
+        if (cancel) cancel->throwIfCancelled();
+
+        if (auto segment = takeLocked()) return segment;
+        if (ended_) return nullopt;
+
+        if (Clock::now() - lastText_ >= kIdleTimeout) throw runtime_error("Text stream timed out waiting for text");
+        cv_.wait_until(lk, lastText_ + kIdleTimeout);
+    }
+}
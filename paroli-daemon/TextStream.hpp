@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "piper/inferer.hpp"
+
+// Text of one request that arrives in pieces, e.g. tokens from a language
+// model ({"append"} messages). The synthesizing thread takes it back out one
+// segment at a time as soon as a sentence, or a long enough clause, is
+// complete, so speech starts while the rest of the text is still being
+// written.
+class TextStream {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void append(const std::string& text);
+
+    // No more text; whatever is buffered becomes the last segment
+    void end();
+
+    // Next complete segment, blocking until there is one. Returns nullopt
+    // once the stream has ended and everything was handed out. Throws
+    // CancelledError if `cancel` fires, or runtime_error if no text arrives
+    // for too long.
+    std::optional<std::string> next(CancelToken* cancel);
+
+    // Next complete segment if there already is one, without waiting
+    std::optional<std::string> poll();
+
+    // When the first non-empty text arrived, for time-to-first-audio
+    std::optional<Clock::time_point> firstText() const;
+
+    // No text for as long as next() waits before timing out
+    bool idle() const;
+
+private:
+    // Length of the first complete segment in buffer_, 0 if none yet
+    size_t segmentLength() const;
+    std::optional<std::string> takeLocked();
+    void wakeAll();
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::string buffer_;
+    bool ended_ = false;
+    std::optional<Clock::time_point> firstText_;
+    Clock::time_point lastText_ = Clock::now();
+};
@@ -1,19 +1,25 @@
 #include <atomic>
 #include <bit>
+#include <cstring>
 #include <csignal>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <condition_variable>
 #include <optional>
-#include <queue>
+#include <set>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <nlohmann/json.hpp>
@@ -22,7 +28,18 @@
 
 #include "piper/piper.hpp"
 #include "paroli_daemon.hpp"
+#include "AllocationCounter.hpp"
+#include "AudioEncoder.hpp"
+#include "ChunkScheduler.hpp"
+#include "Framing.hpp"
 #include "OggOpusEncoder.hpp"
+#include "OutputWriter.hpp"
+#include "RequestQueue.hpp"
+#include "Resampler.hpp"
+#include "ResponseChannel.hpp"
+#include "SocketServer.hpp"
+#include "StagePool.hpp"
+#include "TextStream.hpp"
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
@@ -36,17 +53,61 @@ struct RunConfig {
     filesystem::path decoderPath;
     filesystem::path modelConfigPath;
     optional<filesystem::path> eSpeakDataPath;
+    optional<filesystem::path> tashkeelModelPath;
     string accelerator = "";
+    optional<size_t> maxPhrasePhonemes;
+    optional<vector<int64_t>> encoderShapeBuckets;
+    optional<vector<int64_t>> decoderShapeBuckets;
+    ResampleQuality resampleQuality = ResampleQuality::Medium;
+    bool builtInResampler = true;
     bool jsonl = false;
     bool stream = false;
+    bool framed = false;
     int maxConcurrency = 1;
+    int maxInflight = 0; // 0 = default, see main()
+    int stageThreads = 0; // 0 = default, see main()
+    size_t maxQueue = 256;
+    double latencyBudget = 0; // seconds; 0 = admit until the queue is full
+    bool shortestJobFirst = false;
     optional<filesystem::path> outputFile;
+    optional<filesystem::path> outputDir; // where requests may write "outputs" files
     bool playAudio = false;
     float volume = 1.0f;
+    string audioDevice = "default";
+    int playbackBufferMs = 200;
+    vector<string> listen; // unix:PATH, tcp:HOST:PORT or http:HOST:PORT
 };
 
 static unique_ptr<ParoliSynthesizer> gSynth;
 static atomic<bool> gShuttingDown{false};
+static atomic<SocketServer *> gServer{nullptr};
+
+// Background voice reload (SIGHUP or {"cmd":"reload"})
+static mutex gReloadMutex;
+static thread gReloadThread;
+static atomic<bool> gReloadBusy{false};
+
+// A request id as seen by the client that chose it (ResponseChannel::client)
+using RequestKey = pair<uint64_t, uint32_t>;
+
+// Queued and running requests, for {"cmd":"cancel"}. A client may reuse an
+// id, so one key can name several requests; other clients' ids never match.
+static mutex gActiveMutex;
+static multimap<RequestKey, shared_ptr<CancelToken>> gActive;
+
+// Text streams by client and request id, opened by {"text_stream":true} and
+// fed by {"append"} and {"end"} from the same client. Text may overtake the
+// request that opens its stream, so whichever arrives first creates the
+// entry; one that is never opened expires once it has had no text for the
+// stream idle timeout.
+struct TextStreamEntry {
+    shared_ptr<TextStream> stream;
+    bool opened = false;
+};
+static mutex gTextStreamsMutex;
+static map<RequestKey, TextStreamEntry> gTextStreams;
+// Streams that are open or have text waiting, at most
+constexpr size_t kMaxTextStreams = 1024;
 
 static void printError(const string &msg) {
     json e;
@@ -63,12 +124,34 @@ static void printUsage(const char *argv0) {
     cerr << "   -c, --config FILE         path to model config file\n";
     cerr << "   --espeak_data DIR         path to espeak-ng data directory\n";
     cerr << "   --accelerator STR         accelerator for ONNX (e.g., cuda|tensorrt)\n";
+    cerr << "   --tashkeel-model FILE     libtashkeel model for Arabic diacritization\n";
+    cerr << "   --max-phrase-length N     split phrases longer than N phonemes at clauses (0 = never)\n";
+    cerr << "   --encoder-buckets LIST    pad encoder inputs up to these phoneme id counts (default 64,128,256,512;\n";
+    cerr << "                             none = no padding)\n";
+    cerr << "   --decoder-buckets LIST    pad decoder windows up to these frame counts (default 55; none = no padding)\n";
+    cerr << "   --resample-quality Q      low, medium (default) or high; higher costs more CPU and delay\n";
+    cerr << "   --resampler ENGINE        builtin (default; soxr for unusual rate pairs) or soxr\n";
     cerr << "   --jsonl                   JSON-in/JSON-out only (no logs to stdout)\n";
     cerr << "   --max-concurrency N       number of concurrent jobs (default 1)\n";
+    cerr << "   --max-inflight N          requests interleaved on those jobs chunk by chunk (default 4x\n";
+    cerr << "                             max-concurrency with --listen or --framed, else max-concurrency)\n";
+    cerr << "   --stage-threads N         threads encoding and writing output for all requests\n";
+    cerr << "   --max-queue N             requests waiting for a worker before new ones are rejected (default 256)\n";
+    cerr << "   --latency-budget MS       reject requests whose projected queue wait exceeds MS\n";
+    cerr << "   --queue-policy POLICY     fifo (default) or sjf (shortest expected job first)\n";
     cerr << "   --stream                  enable length-prefixed chunked streaming\n";
+    cerr << "   --framed                  multiplexed output frames tagged with request ids\n";
     cerr << "   --output FILE             write output to file instead of stdout\n";
+    cerr << "   --output-dir DIR          directory for file destinations in a request's \"outputs\"\n";
     cerr << "   --play                    play audio directly to speakers (PCM format only)\n";
     cerr << "   --volume FLOAT            volume level for audio playback (0.0 to 1.0)\n";
+    cerr << "   --audio-device NAME       ALSA device for --play (default: default)\n";
+    cerr << "   --playback-buffer-ms MS   device buffer against underruns during --play (default 200)\n";
+    cerr << "   --listen ADDR             serve clients instead of stdin; ADDR is unix:PATH, tcp:HOST:PORT\n";
+    cerr << "                             or http:HOST:PORT (HTTP/WebSocket); may be repeated\n";
+    cerr << "\nSend SIGHUP or {\"cmd\":\"reload\"} to reload the voice without downtime.\n";
+    cerr << "Send {\"cmd\":\"cancel\",\"id\":N} to stop request N.\n";
+    cerr << "Send {\"id\":N,\"append\":TEXT} and {\"id\":N,\"end\":true} to feed a {\"text_stream\":true} request.\n";
 }
 
 static void parseArgs(int argc, char *argv[], RunConfig &cfg) {
@@ -85,16 +168,49 @@ static void parseArgs(int argc, char *argv[], RunConfig &cfg) {
             modelConfigPath = filesystem::path(argv[++i]);
         } else if ((arg == "--espeak_data" || arg == "--espeak-data") && i + 1 < argc) {
             cfg.eSpeakDataPath = filesystem::path(argv[++i]);
+        } else if ((arg == "--tashkeel_model" || arg == "--tashkeel-model") && i + 1 < argc) {
+            cfg.tashkeelModelPath = filesystem::path(argv[++i]);
         } else if (arg == "--accelerator" && i + 1 < argc) {
             cfg.accelerator = argv[++i];
+        } else if (arg == "--max-phrase-length" && i + 1 < argc) {
+            cfg.maxPhrasePhonemes = max(0, stoi(argv[++i]));
+        } else if (arg == "--encoder-buckets" && i + 1 < argc) {
+            cfg.encoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
+        } else if (arg == "--decoder-buckets" && i + 1 < argc) {
+            cfg.decoderShapeBuckets = piper::parseShapeBuckets(argv[++i]);
+        } else if (arg == "--resample-quality" && i + 1 < argc) {
+            auto quality = parseResampleQuality(argv[++i]);
+            if (!quality) throw runtime_error("Resample quality must be low, medium or high");
+            cfg.resampleQuality = *quality;
+        } else if (arg == "--resampler" && i + 1 < argc) {
+            string engine = argv[++i];
+            if (engine != "builtin" && engine != "soxr") throw runtime_error("Resampler must be builtin or soxr");
+            cfg.builtInResampler = engine == "builtin";
         } else if (arg == "--jsonl") {
             cfg.jsonl = true;
         } else if (arg == "--max-concurrency" && i + 1 < argc) {
             cfg.maxConcurrency = max(1, stoi(argv[++i]));
+        } else if (arg == "--max-inflight" && i + 1 < argc) {
+            cfg.maxInflight = max(1, stoi(argv[++i]));
+        } else if (arg == "--stage-threads" && i + 1 < argc) {
+            cfg.stageThreads = max(1, stoi(argv[++i]));
+        } else if (arg == "--max-queue" && i + 1 < argc) {
+            cfg.maxQueue = max(1, stoi(argv[++i]));
+        } else if (arg == "--latency-budget" && i + 1 < argc) {
+            cfg.latencyBudget = max(0.0, stod(argv[++i]) / 1000.0);
+        } else if (arg == "--queue-policy" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy != "fifo" && policy != "sjf") throw runtime_error("Queue policy must be fifo or sjf");
+            cfg.shortestJobFirst = policy == "sjf";
         } else if (arg == "--stream") {
             cfg.stream = true;
+        } else if (arg == "--framed") {
+            cfg.framed = true;
         } else if (arg == "--output" && i + 1 < argc) {
             cfg.outputFile = filesystem::path(argv[++i]);
+        } else if (arg == "--output-dir" && i + 1 < argc) {
+            cfg.outputDir = filesystem::path(argv[++i]);
+            if (!filesystem::is_directory(*cfg.outputDir)) throw runtime_error("Output directory doesn't exist");
         } else if (arg == "--play") {
             cfg.playAudio = true;
         } else if (arg == "--volume" && i + 1 < argc) {
@@ -102,6 +218,13 @@ static void parseArgs(int argc, char *argv[], RunConfig &cfg) {
             if (cfg.volume < 0.0f || cfg.volume > 1.0f) {
                 throw runtime_error("Volume must be between 0.0 and 1.0");
             }
+        } else if (arg == "--audio-device" && i + 1 < argc) {
+            cfg.audioDevice = argv[++i];
+        } else if (arg == "--playback-buffer-ms" && i + 1 < argc) {
+            cfg.playbackBufferMs = stoi(argv[++i]);
+            if (cfg.playbackBufferMs < 20) throw runtime_error("Playback buffer must be at least 20 ms");
+        } else if (arg == "--listen" && i + 1 < argc) {
+            cfg.listen.push_back(argv[++i]);
         } else if (arg == "--debug") {
             spdlog::set_level(spdlog::level::debug);
         } else if (arg == "-q" || arg == "--quiet") {
@@ -135,146 +258,729 @@ static void setupPiper(const RunConfig &cfg) {
     opts.modelConfigPath = cfg.modelConfigPath;
     opts.eSpeakDataPath = cfg.eSpeakDataPath;
     opts.accelerator = cfg.accelerator;
+    opts.maxPhrasePhonemes = cfg.maxPhrasePhonemes;
+    opts.encoderShapeBuckets = cfg.encoderShapeBuckets;
+    opts.decoderShapeBuckets = cfg.decoderShapeBuckets;
+    opts.tashkeelModelPath = cfg.tashkeelModelPath;
+    opts.resampleQuality = cfg.resampleQuality;
+    opts.builtInResampler = cfg.builtInResampler;
+    opts.audioDevice = cfg.audioDevice;
+    opts.playbackBufferMs = cfg.playbackBufferMs;
+    // One state per worker that may be diacritizing at the same time
+    opts.tashkeelStates = static_cast<size_t>(cfg.maxConcurrency);
     gSynth = std::make_unique<ParoliSynthesizer>(opts);
     gSynth->setVolume(cfg.volume);
 }
 
+// Load the new voice on a background thread; requests keep being served by
+// the current voice until the swap.
+static void requestReload(const ParoliSynthesizer::InitOptions &opts) {
+    bool expected = false;
+    if (!gReloadBusy.compare_exchange_strong(expected, true)) {
+        printError("Reload already in progress");
+        return;
+    }
+    lock_guard<mutex> lk(gReloadMutex);
+    if (gReloadThread.joinable()) gReloadThread.join();
+    gReloadThread = thread([opts]() {
+        try {
+            gSynth->reload(opts);
+        } catch (const exception &e) {
+            printError(string("Reload failed: ") + e.what());
+        }
+        gReloadBusy.store(false);
+    });
+}
+
+static shared_ptr<CancelToken> trackRequest(const RequestKey &key) {
+    auto token = make_shared<CancelToken>();
+    lock_guard<mutex> lk(gActiveMutex);
+    gActive.emplace(key, token);
+    return token;
+}
+
+static void untrackRequest(const RequestKey &key, const shared_ptr<CancelToken> &token) {
+    lock_guard<mutex> lk(gActiveMutex);
+    auto [first, last] = gActive.equal_range(key);
+    for (auto it = first; it != last; ++it) {
+        if (it->second == token) {
+            gActive.erase(it);
+            return;
+        }
+    }
+}
+
+static size_t cancelRequest(const RequestKey &key) {
+    lock_guard<mutex> lk(gActiveMutex);
+    auto [first, last] = gActive.equal_range(key);
+    size_t n = 0;
+    for (auto it = first; it != last; ++it, ++n) it->second->cancel();
+    return n;
+}
+
+static TextStreamEntry &textStreamEntry(const RequestKey &key) {
+    if (!gTextStreams.count(key) && gTextStreams.size() >= kMaxTextStreams) {
+        erase_if(gTextStreams, [](const auto &e) { return !e.second.opened && e.second.stream->idle(); });
+        if (gTextStreams.size() >= kMaxTextStreams) throw runtime_error("Too many open text streams");
+    }
+    auto &entry = gTextStreams[key];
+    if (!entry.stream) entry.stream = make_shared<TextStream>();
+    return entry;
+}
+
+static shared_ptr<TextStream> openTextStream(const RequestKey &key) {
+    lock_guard<mutex> lk(gTextStreamsMutex);
+    auto it = gTextStreams.find(key);
+    // Text that waited too long for its request is stale
+    if (it != gTextStreams.end() && !it->second.opened && it->second.stream->idle()) gTextStreams.erase(it);
+    auto &entry = textStreamEntry(key);
+    if (entry.opened) throw runtime_error("Text stream " + to_string(key.second) + " is already open");
+    entry.opened = true;
+    return entry.stream;
+}
+
+static shared_ptr<TextStream> feedTextStream(const RequestKey &key) {
+    lock_guard<mutex> lk(gTextStreamsMutex);
+    return textStreamEntry(key).stream;
+}
+
+static void closeTextStream(const RequestKey &key, const shared_ptr<TextStream> &stream) {
+    lock_guard<mutex> lk(gTextStreamsMutex);
+    auto it = gTextStreams.find(key);
+    if (it != gTextStreams.end() && it->second.stream == stream) gTextStreams.erase(it);
+}
+
+// Drop text sent ahead of a request that has not opened its stream yet;
+// returns whether there was any
+static bool dropPendingTextStream(const RequestKey &key) {
+    lock_guard<mutex> lk(gTextStreamsMutex);
+    auto it = gTextStreams.find(key);
+    if (it == gTextStreams.end() || it->second.opened) return false;
+    gTextStreams.erase(it);
+    return true;
+}
+
+// Messages that act on a running request rather than start one; socket
+// clients may send them while their earlier requests are still running
+static bool isOutOfBand(const string &line) {
+    if (line.empty() || line[0] != '{') return false;
+    auto j = json::parse(line, nullptr, false);
+    if (!j.is_object()) return false;
+    if (j.contains("append") || j.contains("end")) return true;
+    return j.contains("cmd") && j["cmd"].is_string() && j["cmd"].get<string>() == "cancel";
+}
+
+// Snapshot for {"cmd":"stats"}; set by main() while the daemon is serving
+static function<json()> gStats;
+
+// Returns a JSON reply for commands that have one. `client` sent the command.
+static optional<json> handleControl(const json &j, uint64_t client) {
+    auto cmd = j["cmd"].get<string>();
+    if (cmd == "reload") {
+        auto opts = gSynth->options();
+        if (j.contains("encoder")) opts.encoderPath = j["encoder"].get<string>();
+        if (j.contains("decoder")) opts.decoderPath = j["decoder"].get<string>();
+        if (j.contains("config")) opts.modelConfigPath = j["config"].get<string>();
+        requestReload(opts);
+    } else if (cmd == "cancel") {
+        if (!j.contains("id")) throw runtime_error("Missing id");
+        RequestKey key{client, j["id"].get<uint32_t>()};
+        // Text may be waiting for a request that has not arrived yet
+        bool dropped = dropPendingTextStream(key);
+        if (cancelRequest(key) == 0 && !dropped) throw runtime_error("No such request");
+    } else if (cmd == "stats") {
+        if (!gStats) throw runtime_error("Stats unavailable");
+        return gStats();
+    } else {
+        throw runtime_error("Unknown command: " + cmd);
+    }
+    return nullopt;
+}
+
+static bool isAudioFormat(const string &format) {
+    return format == "opus" || format == "opus_raw" || format == "wav" || format == "pcm" || format == "pcm_f32";
+}
+
+// bitrate, complexity and frame_ms of a request or one of its outputs
+static void parseOpusOptions(const json &j, OpusOptions &opus) {
+    if (j.contains("bitrate")) {
+        auto bitrate = j["bitrate"].get<int>();
+        if (bitrate < 6000 || bitrate > 510000) throw runtime_error("bitrate must be 6000-510000");
+        opus.bitrate = size_t(bitrate);
+    }
+    if (j.contains("complexity")) {
+        opus.complexity = j["complexity"].get<int>();
+        if (opus.complexity < 0 || opus.complexity > 10) throw runtime_error("complexity must be 0-10");
+    }
+    if (j.contains("frame_ms")) {
+        opus.frameMs = j["frame_ms"].get<double>();
+        opusFrameDuration(opus.frameMs); // throws on sizes Opus lacks
+    }
+}
+
+// One of several encodings of a request's audio, all made from the same
+// synthesis
+struct OutputSpec {
+    string format;
+    optional<int> sampleRate;
+    OpusOptions opus;
+    string destination = "response"; // or a file name under --output-dir
+    filesystem::path path;           // the file, resolved
+};
+
+static OutputSpec parseOutputSpec(const RunConfig &cfg, const json &j, const OpusOptions &defaults) {
+    OutputSpec o;
+    o.format = j.value<string>("format", "wav");
+    if (!isAudioFormat(o.format)) throw runtime_error("Unsupported format (opus|opus_raw|wav|pcm|pcm_f32)");
+    if (j.contains("sample_rate") && !j["sample_rate"].is_null()) {
+        o.sampleRate = j["sample_rate"].get<int>();
+        if (*o.sampleRate <= 0) throw runtime_error("sample_rate must be positive");
+    }
+    o.opus = defaults;
+    parseOpusOptions(j, o.opus);
+    o.destination = j.value<string>("destination", "response");
+    if (o.destination != "response") {
+        // Clients name files, the operator chooses where they may go
+        if (!cfg.outputDir) throw runtime_error("File outputs need --output-dir");
+        filesystem::path name(o.destination);
+        if (name.empty() || name.is_absolute() || !name.has_filename()) throw runtime_error("Invalid output file name");
+        for (auto &part : name) {
+            if (part == "..") throw runtime_error("Output files must stay inside --output-dir");
+        }
+        o.path = *cfg.outputDir / name;
+    }
+    return o;
+}
+
 struct Request {
-    string text;
-    string format; // opus|wav|pcm
+    piper::SynthesisInput input; // text, or phonemes or ids that skip phonemization
+    string format; // opus|opus_raw|wav|pcm|pcm_f32
     optional<int> sampleRate;
-    size_t id;
+    OpusOptions opus;
+    vector<OutputSpec> outputs; // instead of format and sampleRate
+    bool predictDuration = false;
+    bool stream = false;
+    uint32_t id = 0;
+    uint64_t client = 0; // with id, what cancel names
+    ChunkScheduler::Priority priority = ChunkScheduler::Priority::Bulk;
+    optional<chrono::steady_clock::time_point> deadline; // first audio due
+    shared_ptr<TextStream> textStream; // text arrives while synthesizing
 };
 
-static vector<uint8_t> toLittleEndian4(uint32_t v) {
-    vector<uint8_t> b(4);
-    b[0] = static_cast<uint8_t>(v & 0xFF);
-    b[1] = static_cast<uint8_t>((v >> 8) & 0xFF);
-    b[2] = static_cast<uint8_t>((v >> 16) & 0xFF);
-    b[3] = static_cast<uint8_t>((v >> 24) & 0xFF);
-    return b;
+// Cost in the units of estimateCost(text): a phoneme counts one, and an id
+// about half since padding ids are interspersed
+static double estimateCost(const piper::SynthesisInput &input) {
+    if (input.phonemeIds) {
+        size_t ids = 0;
+        for (auto &sentence : *input.phonemeIds) ids += sentence.size();
+        return ids / 2.0 + 8.0;
+    }
+    return estimateCost(input.phonemes ? *input.phonemes : input.text);
 }
 
-static void writeAll(ostream &os, const char *data, size_t n) {
-    os.write(data, n);
-    os.flush();
+// Output channel for the stdin/stdout front end. Streaming mode prefixes each
+// chunk with its 4-byte little-endian length; errors go to stderr. Bytes are
+// queued to the writer's thread, header and chunk together.
+class StreamChannel : public ResponseChannel {
+public:
+    StreamChannel(shared_ptr<OutputWriter> writer, bool stream) : writer_(std::move(writer)), stream_(stream) {}
+
+    void audio(const uint8_t *data, size_t n) override {
+        uint8_t hdr[4];
+        if (stream_) putLe32(hdr, static_cast<uint32_t>(n));
+        writer_->write(hdr, stream_ ? sizeof(hdr) : 0, data, n);
+    }
+
+    void error(const string &msg) override { printError(msg); }
+
+private:
+    shared_ptr<OutputWriter> writer_;
+    bool stream_;
+};
+
+static int openOutputFile(const filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw runtime_error("Failed to open output file");
+    return fd;
+}
+
+// `writer` serves every response on stdout, or on the output file when
+// framed; unframed responses to an output file each rewrite it through a
+// writer of their own
+static shared_ptr<ResponseChannel> makeStdioChannel(const RunConfig &cfg, const shared_ptr<OutputWriter> &writer) {
+    if (cfg.framed) {
+        return make_shared<FramedChannel>([writer](string frame) { writer->write(std::move(frame)); });
+    }
+    if (cfg.outputFile) {
+        return make_shared<StreamChannel>(make_shared<OutputWriter>(openOutputFile(*cfg.outputFile), true), cfg.stream);
+    }
+    return make_shared<StreamChannel>(writer, cfg.stream);
 }
 
-static vector<int16_t> resample(span<const int16_t> input, size_t orig_sr, size_t out_sr, int channels) {
-    return ParoliSynthesizer::resample(input, orig_sr, out_sr, channels);
+static void sendAudio(ResponseChannel &out, const void *data, size_t bytes) {
+    out.audio(reinterpret_cast<const uint8_t *>(data), bytes);
 }
 
-static bool synthesizeOne(const RunConfig &cfg, const Request &req, ostream &outStream) {
-    try {
-        if (req.format != "opus" && req.format != "wav" && req.format != "pcm") {
-            throw runtime_error("Unsupported format (opus|wav|pcm)");
+// One chunk through a response's resampler into `scratch`, or as it is when
+// the response is at the native rate (no resampler). Encode tasks of a
+// response run in order on its strand, so the resampler's state carries
+// from chunk to chunk and one scratch buffer serves all of them.
+static span<const float> toOutputRate(const shared_ptr<Resampler> &resampler, span<const float> audio,
+                                      vector<float> &scratch) {
+    if (!resampler) return audio;
+    resampler->process(audio, scratch);
+    return scratch;
+}
+
+static vector<float> flushOutputRate(const shared_ptr<Resampler> &resampler) {
+    vector<float> tail;
+    if (resampler) resampler->flush(tail);
+    return tail;
+}
+
+// Chunks a request may have waiting in its encode/output stages before
+// synthesis blocks
+constexpr size_t kStrandDepth = 8;
+// How long a request waits for a client that has stopped reading before it
+// gives up on it
+constexpr auto kClientStallTimeout = chrono::seconds(30);
+
+// Hold back the next chunk while the client is too far behind. The wait is
+// on the request's thread: output tasks on the stage pool must never block
+// on one client.
+static void awaitClient(ResponseChannel &out) {
+    if (!out.waitWritable(kClientStallTimeout)) throw runtime_error("Client stopped reading the response");
+}
+
+// Clip and convert synthesized audio to 16-bit or float32 PCM bytes in one
+// pass, appended to `bytes`
+static void appendPcm(span<const float> audio, vector<uint8_t> &bytes, bool f32 = false) {
+    const size_t at = bytes.size();
+    bytes.resize(at + audio.size() * (f32 ? sizeof(float) : sizeof(int16_t)));
+    if (f32) {
+        piper::audioToPcmF32(audio, reinterpret_cast<float *>(bytes.data() + at));
+    } else {
+        piper::audioToPcm16(audio, reinterpret_cast<int16_t *>(bytes.data() + at));
+    }
+}
+
+static vector<uint8_t> toBytes(span<const float> audio, bool f32 = false) {
+    vector<uint8_t> bytes;
+    appendPcm(audio, bytes, f32);
+    return bytes;
+}
+
+// Buffers for the chunks of one request on their way through its stages,
+// recycled from chunk to chunk. The strand bounds how many are out at once,
+// so after its first few chunks a request hands audio over without
+// allocating.
+class ChunkBuffers {
+public:
+    struct Chunk {
+        ChunkBuffers *owner;
+        int users = 0;         // stages still reading `audio`
+        vector<float> audio;   // as synthesized
+        vector<uint8_t> bytes; // encoded, for the output stage
+
+        // A user is done with the chunk; the last one recycles it
+        void release() { owner->give(this); }
+    };
+
+    // A chunk holding a copy of `audio`, for `users` readers
+    Chunk *take(span<const float> audio, int users = 1) {
+        Chunk *chunk;
+        {
+            lock_guard<mutex> lk(mtx_);
+            if (idle_.empty()) {
+                all_.push_back(make_unique<Chunk>(Chunk{this}));
+                idle_.push_back(all_.back().get());
+            }
+            chunk = idle_.back();
+            idle_.pop_back();
         }
+        chunk->users = users;
+        chunk->audio.assign(audio.begin(), audio.end());
+        chunk->bytes.clear();
+        return chunk;
+    }
 
-        // Setup output stream
-        unique_ptr<ostream> fileOut;
-        ostream *dst = &outStream;
-        if (cfg.outputFile) {
-            fileOut = make_unique<ofstream>(cfg.outputFile->string(), ios::binary);
-            if (!fileOut->good()) throw runtime_error("Failed to open output file");
-            dst = fileOut.get();
+private:
+    void give(Chunk *chunk) {
+        lock_guard<mutex> lk(mtx_);
+        if (--chunk->users == 0) idle_.push_back(chunk);
+    }
+
+    mutex mtx_;
+    vector<unique_ptr<Chunk>> all_;
+    vector<Chunk *> idle_;
+};
+
+// One output of a request with several: a resampler, encoder, sink and
+// strand of its own, so the branches of a request encode in parallel with
+// each other and with synthesis. A chunk's encode task leaves its bytes in
+// `bytes` for the output task right behind it on the strand.
+struct OutputBranch {
+    const OutputSpec *spec;
+    int sampleRate;
+    shared_ptr<Resampler> resampler; // none at the native rate
+    shared_ptr<AudioEncoder> encoder;
+    unique_ptr<AudioSink> sink;
+    shared_ptr<Strand> strand;
+    vector<float> resampled;
+    vector<uint8_t> bytes;
+    uint64_t written = 0;
+
+    // Samples at this branch's rate for `native` at the voice's; a WAV
+    // header then carries that length from the first byte
+    uint64_t predicted(size_t native, int nativeSr) {
+        uint64_t n = sampleRate == nativeSr ? native : Resampler::outputLength(native, nativeSr, sampleRate);
+        encoder->setLength(n);
+        return n;
+    }
+
+    void encode(span<const float> audio) {
+        bytes.clear();
+        if (resampler) {
+            resampler->process(audio, resampled);
+            audio = resampled;
         }
+        encoder->encode(audio, bytes);
+    }
 
-        // Handle PCM format (native sample rate)
-        if (req.format == "pcm") {
-            if (cfg.playAudio) {
-                if (!gSynth->speak(req.text)) {
-                    cerr << "Failed to speak: " << gSynth->getLastError() << endl;
-                }
-            } else if (cfg.stream) {
-                            gSynth->synthesizeStreamPcm(req.text, [&](std::span<const int16_t> view) {
-                if (!view.empty() && view.data() != nullptr) {
-                    uint32_t bytes = static_cast<uint32_t>(view.size() * sizeof(int16_t));
-                    auto hdr = toLittleEndian4(bytes);
-                    writeAll(*dst, reinterpret_cast<const char *>(hdr.data()), hdr.size());
-                    writeAll(*dst, reinterpret_cast<const char *>(view.data()), bytes);
+    void finish() {
+        bytes.clear();
+        if (resampler) {
+            resampler->flush(resampled);
+            encoder->encode(resampled, bytes);
+        }
+        encoder->finish(bytes);
+    }
+
+    void write() {
+        if (bytes.empty()) return;
+        sink->write(bytes.data(), bytes.size());
+        written += bytes.size();
+    }
+
+    // Give a WAV header the real length where the sink can rewrite it
+    void close() {
+        if (spec->format == "wav" && sink->seekable() && written >= 44) {
+            auto header = wavHeader(sampleRate, 1, uint32_t(min<uint64_t>(written - 44, UINT32_MAX - 36)));
+            sink->writeAt(0, header.data(), header.size());
+        }
+        sink->flush();
+    }
+};
+
+// Synthesis runs on the calling thread; encoding and output of each chunk are
+// handed to the shared stage pool and run in order on the request's strand,
+// overlapping with synthesis of the next chunk. Only this thread calls
+// begin(), end() and error() on `out`.
+static bool synthesizeOne(const RunConfig &cfg, const Request &req, ResponseChannel &out, SynthesisControl *control,
+                          StagePool &pool) {
+    auto strand = make_shared<Strand>(pool, kStrandDepth);
+    ChunkBuffers buffers;
+    chrono::steady_clock::duration handoff{};
+    uint64_t handoffAllocations = 0;
+    bool audioSent = false; // touched by output tasks only
+
+    // How the response turns a chunk of synthesized audio into bytes; set
+    // before the first chunk, and run in order on the strand
+    function<void(span<const float>, vector<uint8_t> &)> encodeAudio;
+    vector<float> resampled; // encodeAudio's scratch, see toOutputRate
+
+    auto send = [&](ChunkBuffers::Chunk *chunk) {
+        if (!chunk->bytes.empty()) {
+            if (!audioSent && req.textStream) {
+                // Time to first audio, counted from the first text the client sent
+                if (auto first = req.textStream->firstText()) {
+                    spdlog::info("Request {}: first audio {} ms after first text", req.id,
+                                 chrono::duration<double, milli>(chrono::steady_clock::now() - *first).count());
                 }
-            });
-            } else {
-                auto audio = gSynth->synthesizePcm(req.text);
-                writeAll(*dst, reinterpret_cast<const char *>(audio.data()), audio.size() * sizeof(int16_t));
             }
-            return true;
+            audioSent = true;
+            sendAudio(out, chunk->bytes.data(), chunk->bytes.size());
         }
+        chunk->release();
+    };
+    // Queue one chunk for the encode and output stages. Its tasks capture
+    // no more than two pointers, which std::function stores without
+    // allocating; the time and allocations spent here count as handoff.
+    auto handOver = [&](auto take, auto encode) {
+        auto t0 = chrono::steady_clock::now();
+        awaitClient(out);
+        auto t1 = chrono::steady_clock::now();
+        auto allocs0 = allocations::thisThread();
+        auto *chunk = take();
+        strand->post(Stage::Encode, [encode, chunk]() { encode(*chunk); });
+        strand->post(Stage::Output, [&send, chunk]() { send(chunk); });
+        auto allocs = allocations::thisThread() - allocs0;
+        pool.record(Stage::Handoff, chrono::steady_clock::now() - t1, allocs);
+        handoff += chrono::steady_clock::now() - t0;
+        handoffAllocations += allocs;
+    };
+    // A chunk of synthesized audio, through encodeAudio
+    auto pipeAudio = [&](span<const float> audio) {
+        handOver([&]() { return buffers.take(audio); }, [&encodeAudio](ChunkBuffers::Chunk &chunk) {
+            encodeAudio(chunk.audio, chunk.bytes);
+        });
+    };
+    // Anything else, e.g. a header or a resampler's tail: `encode` produces
+    // its bytes
+    auto pipe = [&](function<vector<uint8_t>()> encode) {
+        handOver([&]() { return buffers.take({}); },
+                 [encode = std::move(encode)](ChunkBuffers::Chunk &chunk) { chunk.bytes = encode(); });
+    };
+    // Synthesis time and allocations, minus those of handing chunks over
+    // and of waiting for the client
+    auto synthesize = [&](const function<void()> &fn) {
+        auto t0 = chrono::steady_clock::now();
+        auto allocs0 = allocations::thisThread();
+        handoff = {};
+        handoffAllocations = 0;
+        fn();
+        pool.record(Stage::Synthesize, chrono::steady_clock::now() - t0 - handoff,
+                    allocations::thisThread() - allocs0 - handoffAllocations);
+    };
+    // The request's input, or for a text stream each sentence or clause as
+    // soon as it is complete; all of it goes into one continuous output
+    auto forEachInput = [&](const function<void(const piper::SynthesisInput &)> &fn) {
+        if (!req.textStream) {
+            fn(req.input);
+            return;
+        }
+        while (auto segment = req.textStream->next(control ? control->cancel : nullptr)) fn(*segment);
+    };
 
-        // Handle WAV/OPUS formats
-        const int nativeSr = gSynth->nativeSampleRate();
-        const int outSr = req.sampleRate.value_or(req.format == "opus" ? 24000 : nativeSr);
-
-        if (cfg.stream) {
-            vector<int16_t> chunk;
-            unique_ptr<StreamingOggOpusEncoder> opusEnc;
-            if (req.format == "opus") opusEnc = make_unique<StreamingOggOpusEncoder>(outSr, 1);
-            
-            auto processChunk = [&]() {
-                if (chunk.empty()) return;
-                
-                vector<int16_t> pcm = chunk;
-                if (outSr != nativeSr) {
-                    pcm = resample(std::span<const short>(chunk.data(), chunk.size()), nativeSr, outSr, 1);
+    try {
+        // Several outputs: the decoder's chunks fan out to every branch, so
+        // the text is synthesized once however many encodings are wanted
+        if (!req.outputs.empty()) {
+            const int nativeSr = gSynth->nativeSampleRate();
+            vector<shared_ptr<OutputBranch>> branches;
+            shared_ptr<OutputBranch> response;
+            vector<uint8_t> buffered; // the response, unless streamed
+            try {
+                for (auto &spec : req.outputs) {
+                    auto b = make_shared<OutputBranch>();
+                    b->spec = &spec;
+                    bool opus = spec.format == "opus" || spec.format == "opus_raw";
+                    b->sampleRate = spec.sampleRate.value_or(opus ? 24000 : nativeSr);
+                    if (b->sampleRate != nativeSr) b->resampler = gSynth->makeResampler(nativeSr, b->sampleRate);
+                    b->encoder = makeEncoder(spec.format, b->sampleRate, spec.opus);
+                    if (!spec.path.empty()) {
+                        b->sink = make_unique<FileSink>(spec.path);
+                    } else {
+                        if (req.stream) {
+                            b->sink = make_unique<CallbackSink>([&out](const uint8_t *data, size_t n) { out.audio(data, n); });
+                        } else {
+                            b->sink = make_unique<MemorySink>(buffered);
+                        }
+                        response = b;
+                    }
+                    b->strand = make_shared<Strand>(pool, kStrandDepth);
+                    branches.push_back(std::move(b));
                 }
-                
-                if (req.format == "wav") {
-                    uint32_t bytes = static_cast<uint32_t>(pcm.size() * sizeof(int16_t));
-                    auto hdr = toLittleEndian4(bytes);
-                    writeAll(*dst, reinterpret_cast<const char *>(hdr.data()), hdr.size());
-                    writeAll(*dst, reinterpret_cast<const char *>(pcm.data()), bytes);
-                } else if (req.format == "opus") {
-                    auto ogg = opusEnc->encode(pcm);
-                    if (!ogg.empty()) {
-                        uint32_t bytes = static_cast<uint32_t>(ogg.size());
-                        auto hdr = toLittleEndian4(bytes);
-                        writeAll(*dst, reinterpret_cast<const char *>(hdr.data()), hdr.size());
-                        writeAll(*dst, reinterpret_cast<const char *>(ogg.data()), ogg.size());
+                // A streamed response begins at once, or with its length as
+                // soon as that is predicted, before the first chunk
+                piper::DurationCallback onDuration;
+                if (req.predictDuration && !req.textStream) {
+                    onDuration = [&](size_t samples) {
+                        for (auto &b : branches) {
+                            uint64_t n = b->predicted(samples, nativeSr);
+                            if (b == response && req.stream) out.begin({b->spec->format, b->sampleRate, n});
+                        }
+                    };
+                } else if (response && req.stream) {
+                    out.begin({response->spec->format, response->sampleRate});
+                }
+
+                forEachInput([&](const piper::SynthesisInput &input) {
+                    synthesize([&]() {
+                        gSynth->synthesizeStreamPcm(input, [&](const piper::AudioChunk &chunk) {
+                            if (chunk.samples.empty()) return;
+                            auto t0 = chrono::steady_clock::now();
+                            if (response && req.stream) awaitClient(out);
+                            auto t1 = chrono::steady_clock::now();
+                            auto allocs0 = allocations::thisThread();
+                            // One copy of the chunk, shared by every branch
+                            auto *audio = buffers.take(chunk.samples, int(branches.size()));
+                            for (auto &b : branches) {
+                                b->strand->post(Stage::Encode, [b = b.get(), audio]() {
+                                    b->encode(audio->audio);
+                                    audio->release();
+                                });
+                                b->strand->post(Stage::Output, [b = b.get()]() { b->write(); });
+                            }
+                            auto allocs = allocations::thisThread() - allocs0;
+                            pool.record(Stage::Handoff, chrono::steady_clock::now() - t1, allocs);
+                            handoff += chrono::steady_clock::now() - t0;
+                            handoffAllocations += allocs;
+                        }, control, onDuration);
+                    });
+                });
+                for (auto &b : branches) {
+                    b->strand->post(Stage::Encode, [b]() { b->finish(); });
+                    b->strand->post(Stage::Output, [b]() {
+                        b->write();
+                        b->close();
+                    });
+                }
+                for (auto &b : branches) b->strand->drain();
+            } catch (...) {
+                // No output task may touch `out` after the error, and no
+                // half-written file is left behind
+                for (auto &b : branches) {
+                    try {
+                        b->strand->drain();
+                    } catch (...) {
+                    }
+                    if (!b->spec->path.empty()) {
+                        b->sink.reset();
+                        error_code ec;
+                        filesystem::remove(b->spec->path, ec);
                     }
                 }
-                
-                // Clear chunk after processing to prevent reuse
-                chunk.clear();
-            };
+                throw;
+            }
 
-            gSynth->synthesizeStreamPcm(req.text, [&](std::span<const int16_t> view){
-                chunk.assign(view.begin(), view.end());
-                processChunk();
-            });
-            
-            if (req.format == "opus") {
-                auto tail = opusEnc->finish();
-                if (!tail.empty()) {
-                    uint32_t bytes = static_cast<uint32_t>(tail.size());
-                    auto hdr = toLittleEndian4(bytes);
-                    writeAll(*dst, reinterpret_cast<const char *>(hdr.data()), hdr.size());
-                    writeAll(*dst, reinterpret_cast<const char *>(tail.data()), tail.size());
+            if (response && !req.stream) {
+                out.begin({response->spec->format, response->sampleRate});
+                if (!buffered.empty()) sendAudio(out, buffered.data(), buffered.size());
+            } else if (!response) {
+                // Everything went to files: the reply says what was written
+                json files = json::array();
+                for (auto &b : branches) {
+                    files.push_back({{"destination", b->spec->destination},
+                                     {"format", b->spec->format},
+                                     {"sample_rate", b->sampleRate},
+                                     {"bytes", b->written}});
                 }
+                auto body = json{{"outputs", files}}.dump();
+                out.begin({"json", 0});
+                sendAudio(out, body.data(), body.size());
             }
+            out.end();
             return true;
         }
+        if (!isAudioFormat(req.format)) throw runtime_error("Unsupported format (opus|opus_raw|wav|pcm|pcm_f32)");
+        const bool opus = req.format == "opus" || req.format == "opus_raw";
+        const bool rawOpus = req.format == "opus_raw";
+
+        const int nativeSr = gSynth->nativeSampleRate();
+
+        // Responses begin before their first audio: at once, or when
+        // predicting, as soon as textToAudio knows the length, which is
+        // before any chunk. `onBegin` then sees that length. Predicting holds
+        // back the first audio and keeps the whole input's encoder output in
+        // memory, so only requests that ask for it do, and non-streamed WAV,
+        // whose header has no other way to carry exact sizes; a text
+        // stream's length is unknown until it ends.
+        const bool predict = !req.textStream && (req.predictDuration || (!req.stream && req.format == "wav"));
+        piper::DurationCallback onDuration;
+        auto beginResponse = [&](int sampleRate, function<void(optional<uint64_t>)> onBegin) {
+            if (!predict) {
+                out.begin({req.format, sampleRate});
+                if (onBegin) onBegin(nullopt);
+                return;
+            }
+            onDuration = [&out, &req, nativeSr, sampleRate, onBegin = std::move(onBegin)](size_t samples) {
+                uint64_t n = sampleRate == nativeSr ? samples : Resampler::outputLength(samples, nativeSr, sampleRate);
+                out.begin({req.format, sampleRate, n});
+                if (onBegin) onBegin(n);
+            };
+        };
 
-        // Non-streaming WAV/OPUS
-        if (req.format == "wav") {
-            auto wav = gSynth->synthesizeWav(req.text);
-            writeAll(*dst, reinterpret_cast<const char*>(wav.data()), wav.size());
-        } else if (req.format == "opus") {
-            auto audio = gSynth->synthesizePcm(req.text);
-            vector<int16_t> pcm = audio;
-            if (outSr != nativeSr) {
-                pcm = resample(std::span<const short>(audio.data(), audio.size()), nativeSr, outSr, 1);
+        // Handle PCM formats (native sample rate)
+        if (req.format == "pcm" || req.format == "pcm_f32") {
+            const bool f32 = req.format == "pcm_f32";
+            if (cfg.playAudio) {
+                forEachInput([&](const piper::SynthesisInput &input) {
+                    if (!gSynth->speak(input)) {
+                        cerr << "Failed to speak: " << gSynth->getLastError() << endl;
+                    }
+                });
+            } else {
+                // Chunk by chunk whether streamed or not; an unstreamed
+                // response is just not framed per chunk
+                beginResponse(nativeSr, nullptr);
+                encodeAudio = [f32](span<const float> audio, vector<uint8_t> &bytes) { appendPcm(audio, bytes, f32); };
+                forEachInput([&](const piper::SynthesisInput &input) {
+                    synthesize([&]() {
+                        gSynth->synthesizeStreamPcm(input, [&](const piper::AudioChunk &chunk) {
+                            if (!chunk.samples.empty()) pipeAudio(chunk.samples);
+                        }, control, onDuration);
+                    });
+                });
             }
-            auto ogg = encodeOgg(pcm, outSr, 1);
-            writeAll(*dst, reinterpret_cast<const char *>(ogg.data()), ogg.size());
+            strand->drain();
+            out.end();
+            return true;
+        }
+
+        // Handle WAV/OPUS formats
+        const int outSr = req.sampleRate.value_or(opus ? 24000 : nativeSr);
+
+        if (opus) {
+            beginResponse(outSr, nullptr);
+        } else {
+            // Exact sizes from the first byte when predicted, else sizes
+            // marked unknown
+            beginResponse(outSr, [&](optional<uint64_t> samples) {
+                auto header = wavHeader(outSr, 1, samples ? uint32_t(min<uint64_t>(*samples * sizeof(int16_t), UINT32_MAX - 36))
+                                                          : UINT32_MAX);
+                pipe([header]() { return vector<uint8_t>(header.begin(), header.end()); });
+            });
+        }
+        shared_ptr<Resampler> resampler;
+        if (outSr != nativeSr) resampler = gSynth->makeResampler(nativeSr, outSr);
+        shared_ptr<AudioEncoder> enc;
+        if (opus) {
+            enc = makeOpusEncoder(rawOpus, outSr, 1, req.opus);
+            encodeAudio = [enc, resampler, &resampled](span<const float> audio, vector<uint8_t> &bytes) {
+                enc->encode(toOutputRate(resampler, audio, resampled), bytes);
+            };
+        } else {
+            encodeAudio = [resampler, &resampled](span<const float> audio, vector<uint8_t> &bytes) {
+                appendPcm(toOutputRate(resampler, audio, resampled), bytes);
+            };
+        }
+        forEachInput([&](const piper::SynthesisInput &input) {
+            synthesize([&]() {
+                gSynth->synthesizeStreamPcm(input, [&](const piper::AudioChunk &chunk) {
+                    if (!chunk.samples.empty()) pipeAudio(chunk.samples);
+                }, control, onDuration);
+            });
+        });
+        if (opus) {
+            pipe([enc, resampler]() {
+                vector<uint8_t> bytes;
+                enc->encode(flushOutputRate(resampler), bytes);
+                enc->finish(bytes);
+                return bytes;
+            });
+        } else if (resampler) {
+            pipe([resampler]() { return toBytes(flushOutputRate(resampler)); });
         }
+        strand->drain();
+        out.end();
         return true;
     } catch (const exception &e) {
-        printError(e.what());
+        // No output task may touch `out` after the error
+        try {
+            strand->drain();
+        } catch (...) {
+        }
+        out.error(e.what());
         return false;
     }
 }
 
-struct WorkItem { Request req; };
+struct WorkItem {
+    Request req;
+    shared_ptr<ResponseChannel> out;
+    shared_ptr<CancelToken> cancel;
+};
 
 int main(int argc, char *argv[]) {
     spdlog::set_default_logger(spdlog::stderr_color_st("paroli"));
@@ -288,67 +994,299 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    atomic<size_t> nextId{0};
-    mutex qMutex;
-    condition_variable qCv;
-    queue<WorkItem> q;
+    // Each in-flight request has its own thread; the scheduler lets
+    // maxConcurrency of them compute at once, switching at chunk boundaries
+    if (cfg.maxInflight == 0) {
+        cfg.maxInflight = (!cfg.listen.empty() || cfg.framed) ? 4 * cfg.maxConcurrency : cfg.maxConcurrency;
+    }
+    cfg.maxInflight = max(cfg.maxInflight, cfg.maxConcurrency);
+    ChunkScheduler scheduler(cfg.maxConcurrency);
+
+    if (cfg.maxInflight > 1 && cfg.listen.empty() && !cfg.framed) {
+        spdlog::warn("--max-inflight > 1 without --framed: output of concurrent requests may interleave");
+    }
+
+    atomic<uint32_t> nextId{0};
+    RequestQueue<WorkItem>::Config queueCfg;
+    queueCfg.capacity = cfg.maxQueue;
+    queueCfg.workers = cfg.maxConcurrency;
+    queueCfg.latencyBudget = cfg.latencyBudget;
+    queueCfg.policy = cfg.shortestJobFirst ? RequestQueue<WorkItem>::Policy::ShortestJobFirst
+                                           : RequestQueue<WorkItem>::Policy::Fifo;
+    RequestQueue<WorkItem> queue(queueCfg);
 
     // Signal handling for graceful shutdown
-    auto handler = +[](int) { gShuttingDown.store(true); };
+    auto handler = +[](int) {
+        gShuttingDown.store(true);
+        if (auto *server = gServer.load()) server->stop();
+    };
     signal(SIGINT, handler);
     signal(SIGTERM, handler);
 
+    // SIGHUP is blocked in every thread and consumed by a dedicated waiter,
+    // so it must be masked before any other thread is started
+    sigset_t hupSet;
+    sigemptyset(&hupSet);
+    sigaddset(&hupSet, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hupSet, nullptr);
+    thread hupThread([hupSet]() {
+        int sig = 0;
+        while (sigwait(&hupSet, &sig) == 0 && !gShuttingDown.load()) {
+            spdlog::info("SIGHUP received, reloading voice");
+            requestReload(gSynth->options());
+        }
+    });
+
+    if (cfg.stageThreads == 0) cfg.stageThreads = max(2, cfg.maxConcurrency);
+    StagePool pool(cfg.stageThreads);
+    gStats = [&]() {
+        json j;
+        j["stages"] = pool.stats(cfg.maxConcurrency);
+        j["queue"] = {{"depth", queue.depth()}, {"rejected", queue.rejected()}, {"delayed", queue.delayed()}};
+        j["scheduler"] = {{"late_units", scheduler.lateUnits()}};
+        return j;
+    };
+
     // Worker threads
     vector<thread> workers;
-    workers.reserve(cfg.maxConcurrency);
-    for (int i = 0; i < cfg.maxConcurrency; i++) {
+    workers.reserve(cfg.maxInflight);
+    for (int i = 0; i < cfg.maxInflight; i++) {
         workers.emplace_back([&]() {
-            while (true) {
-                WorkItem item;
-                {
-                    unique_lock<mutex> lk(qMutex);
-                    qCv.wait(lk, [&]() { return gShuttingDown.load() || !q.empty(); });
-                    if (gShuttingDown.load() && q.empty()) return;
-                    if (q.empty()) continue;
-                    item = q.front();
-                    q.pop();
+            while (auto job = queue.pop()) {
+                auto &item = job->item;
+                // Only completed syntheses recalibrate the cost model
+                double seconds = -1;
+                if (item.cancel->cancelled()) {
+                    item.out->error("Cancelled");
+                } else if (!item.out->closed()) {
+                    auto t0 = chrono::steady_clock::now();
+                    auto ticket = scheduler.ticket(item.req.priority, item.req.deadline, gSynth->nativeSampleRate(),
+                                                   item.cancel.get());
+                    SynthesisControl control{item.cancel.get(), ticket.get()};
+                    if (synthesizeOne(cfg, item.req, *item.out, &control, pool)) {
+                        seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+                    }
+                }
+                // Waiting for streamed text is not synthesis work
+                queue.done(job->cost, item.cancel->cancelled() || item.req.textStream ? -1 : seconds);
+                untrackRequest({item.req.client, item.req.id}, item.cancel);
+                if (item.req.textStream) closeTextStream({item.req.client, item.req.id}, item.req.textStream);
+                if (item.cancel->cancelled()) {
+                    spdlog::info("Request {} cancelled{}, worker free after {} ms", item.req.id,
+                                 item.out->closed() ? " by disconnect" : "",
+                                 chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                                 item.cancel->cancelledAt()).count());
                 }
-                synthesizeOne(cfg, item.req, cout);
             }
         });
     }
 
-    // Read requests from stdin (one JSON per line)
-    string line;
-    while (!gShuttingDown.load() && getline(cin, line)) {
-        if (line.empty()) continue;
+    // Parse one request (a JSON line or a binary record) and queue it; shared
+    // by the stdin and socket front ends. Only callers that may block
+    // (`canWait`) are held back when the queue is full; others are rejected.
+    auto submit = [&](const string &line, shared_ptr<ResponseChannel> out, bool canWait) {
         try {
-            auto j = json::parse(line);
             Request r;
-            if (!j.contains("text")) throw runtime_error("Missing text");
-            r.text = j["text"].get<string>();
-            r.format = j.value<string>("format", "wav");
-            if (j.contains("sample_rate") && !j["sample_rate"].is_null()) r.sampleRate = j["sample_rate"].get<int>();
-            r.id = nextId.fetch_add(1);
-
-            if (gShuttingDown.load()) break;
-            {
-                unique_lock<mutex> lk(qMutex);
-                q.push(WorkItem{r});
+            r.client = out->client();
+            optional<ChunkScheduler::Priority> priority;
+            optional<bool> lowLatency;
+            bool textStream = false;
+            if (!line.empty() && static_cast<uint8_t>(line[0]) == kBinaryRequestMarker) {
+                auto b = decodeBinaryRequest(line);
+                r.id = b.id;
+                out->setRequestId(r.id);
+                r.input.text = std::move(b.text);
+                r.format = std::move(b.format);
+                r.sampleRate = b.sampleRate;
+            } else {
+                auto j = json::parse(line);
+                // Text for a running text stream; answered only on error
+                if (j.contains("append") || j.contains("end")) {
+                    if (!j.contains("id")) throw runtime_error("Missing id");
+                    auto stream = feedTextStream({r.client, j["id"].get<uint32_t>()});
+                    if (j.contains("append")) stream->append(j["append"].get<string>());
+                    if (j.value("end", false)) stream->end();
+                    return;
+                }
+                // Control commands are answered under request id 0; their
+                // "id" field names the request they act on
+                if (j.contains("cmd")) {
+                    if (auto reply = handleControl(j, out->client())) {
+                        auto body = reply->dump();
+                        out->begin({"json", 0});
+                        out->audio(reinterpret_cast<const uint8_t *>(body.data()), body.size());
+                    }
+                    out->end();
+                    return;
+                }
+                r.id = j.contains("id") ? j["id"].get<uint32_t>() : nextId.fetch_add(1);
+                out->setRequestId(r.id);
+                textStream = j.value("text_stream", false);
+                if (textStream) {
+                    // Any "text" is the beginning of the stream
+                    if (!j.contains("id")) throw runtime_error("Text streams need an id");
+                    r.input.text = j.value<string>("text", "");
+                } else if (j.contains("phoneme_ids")) {
+                    // One list of ids per sentence, or a single flat list
+                    auto &ids = j["phoneme_ids"];
+                    if (!ids.is_array() || ids.empty()) throw runtime_error("phoneme_ids must be a non-empty array");
+                    if (ids[0].is_array()) {
+                        r.input.phonemeIds = ids.get<vector<vector<piper::PhonemeId>>>();
+                    } else {
+                        r.input.phonemeIds = vector<vector<piper::PhonemeId>>{ids.get<vector<piper::PhonemeId>>()};
+                    }
+                } else if (j.contains("phonemes")) {
+                    r.input.phonemes = j["phonemes"].get<string>();
+                } else {
+                    if (!j.contains("text")) throw runtime_error("Missing text");
+                    r.input.text = j["text"].get<string>();
+                }
+                r.format = j.value<string>("format", "wav");
+                if (j.contains("sample_rate") && !j["sample_rate"].is_null()) r.sampleRate = j["sample_rate"].get<int>();
+                parseOpusOptions(j, r.opus);
+                if (j.contains("outputs")) {
+                    auto &outputs = j["outputs"];
+                    if (!outputs.is_array() || outputs.empty()) throw runtime_error("outputs must be a non-empty array");
+                    set<string> files;
+                    bool response = false;
+                    for (auto &o : outputs) {
+                        auto spec = parseOutputSpec(cfg, o, r.opus);
+                        if (spec.path.empty()) {
+                            if (response) throw runtime_error("Only one output can be the response");
+                            response = true;
+                        } else if (!files.insert(spec.path.lexically_normal().string()).second) {
+                            throw runtime_error("Two outputs name the same file");
+                        }
+                        r.outputs.push_back(std::move(spec));
+                    }
+                }
+                if (j.contains("low_latency")) lowLatency = j["low_latency"].get<bool>();
+                if (j.contains("predict_duration")) r.predictDuration = j["predict_duration"].get<bool>();
+                if (j.contains("priority")) {
+                    auto name = j["priority"].get<string>();
+                    if (name != "interactive" && name != "bulk") {
+                        throw runtime_error("Priority must be interactive or bulk");
+                    }
+                    priority = name == "interactive" ? ChunkScheduler::Priority::Interactive
+                                                     : ChunkScheduler::Priority::Bulk;
+                }
+                if (j.contains("deadline_ms")) {
+                    r.deadline = chrono::steady_clock::now() + chrono::milliseconds(j["deadline_ms"].get<int64_t>());
+                }
+            }
+            // A text stream is spoken while it is written, so its audio is too
+            r.stream = cfg.stream || out->streaming() || textStream;
+            // Someone is listening to a stream as it is produced
+            r.priority = priority.value_or(r.stream ? ChunkScheduler::Priority::Interactive
+                                                    : ChunkScheduler::Priority::Bulk);
+            // ... so each chunk's Opus pages go out with it
+            r.opus.lowLatency = lowLatency.value_or(r.stream);
+            // Files are not read while they are written
+            for (auto &o : r.outputs) o.opus.lowLatency = o.path.empty() && r.opus.lowLatency;
+
+            if (gShuttingDown.load()) throw runtime_error("Shutting down");
+            if (textStream) {
+                r.textStream = openTextStream({r.client, r.id});
+                r.textStream->append(r.input.text);
             }
-            qCv.notify_one();
+            auto cancel = trackRequest({r.client, r.id});
+            // Barge-in: a client that hangs up stops its synthesis right away
+            out->onDisconnect([cancel]() { cancel->cancel(); });
+            double cost = estimateCost(r.input);
+            try {
+                queue.push(WorkItem{r, out, cancel}, cost, canWait, static_cast<int>(r.priority));
+            } catch (...) {
+                untrackRequest({r.client, r.id}, cancel);
+                if (r.textStream) closeTextStream({r.client, r.id}, r.textStream);
+                throw;
+            }
+        } catch (const exception &e) {
+            out->error(e.what());
+        }
+    };
+
+    if (!cfg.listen.empty()) {
+        // Socket mode: the I/O thread serves every client until shutdown
+        try {
+            // The I/O thread must never block, so a full queue rejects
+            SocketServer server([&](const string &line, shared_ptr<ResponseChannel> out) {
+                submit(line, std::move(out), false);
+            });
+            server.setFramed(cfg.framed);
+            server.setOutOfBand(isOutOfBand);
+            for (auto &spec : cfg.listen) server.listen(spec);
+            gServer = &server;
+            if (gShuttingDown.load()) server.stop();
+            server.run();
+            gShuttingDown.store(true);
+            queue.close();
+            for (auto &t : workers) t.join();
+            gServer = nullptr;
         } catch (const exception &e) {
             printError(e.what());
-            continue;
+            gShuttingDown.store(true);
         }
+    } else {
+        // Read requests from stdin (one JSON per line, or binary records).
+        // Output goes through one writer so frames and chunks never
+        // interleave.
+        shared_ptr<OutputWriter> writer;
+        try {
+            cout.flush();
+            writer = cfg.framed && cfg.outputFile ? make_shared<OutputWriter>(openOutputFile(*cfg.outputFile), true)
+                                                  : make_shared<OutputWriter>(STDOUT_FILENO);
+        } catch (const exception &e) {
+            printError(e.what());
+            gShuttingDown.store(true);
+        }
+
+        string line;
+        while (!gShuttingDown.load()) {
+            if (cin.peek() == kBinaryRequestMarker) {
+                line.resize(kBinaryRequestHeaderSize);
+                if (!cin.read(line.data(), line.size())) break;
+                // The length comes from the input; skip oversized records
+                // rather than allocate whatever they claim
+                size_t textLength = *binaryRequestSize(line.data(), line.size()) - kBinaryRequestHeaderSize;
+                if (textLength > kMaxLineBytes) {
+                    printError("Binary request too long");
+                    if (!cin.ignore(streamsize(textLength))) break;
+                    continue;
+                }
+                line.resize(kBinaryRequestHeaderSize + textLength);
+                if (!cin.read(line.data() + kBinaryRequestHeaderSize, textLength)) break;
+            } else if (!getline(cin, line)) {
+                break;
+            }
+            if (line.empty()) continue;
+            try {
+                submit(line, makeStdioChannel(cfg, writer), true);
+            } catch (const exception &e) {
+                printError(e.what());
+            }
+        }
+
+        // Workers must be done before the writer they write into goes away
+        gShuttingDown.store(true);
+        queue.close();
+        for (auto &t : workers) t.join();
+        writer.reset();
     }
 
     // Begin shutdown: reject new, finish in-flight
     gShuttingDown.store(true);
-    qCv.notify_all();
-    for (auto &t : workers) t.join();
+    queue.close();
+    for (auto &t : workers) {
+        if (t.joinable()) t.join();
+    }
+    gStats = nullptr;
+    spdlog::debug("Stage stats: {}", pool.stats(cfg.maxConcurrency).dump());
+    pthread_kill(hupThread.native_handle(), SIGHUP);
+    hupThread.join();
+    {
+        lock_guard<mutex> lk(gReloadMutex);
+        if (gReloadThread.joinable()) gReloadThread.join();
+    }
     gSynth.reset();
     return 0;
 }
-
-
@@ -1,12 +1,17 @@
 #include "paroli_daemon.hpp"
 
+#include <array>
+#include <chrono>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
-#include <soxr.h>
 #include <fstream>
-#include <alsa/asoundlib.h>
+#include <spdlog/spdlog.h>
 
+#include "AudioEncoder.hpp"
+#include "AudioPlayer.hpp"
 #include "OggOpusEncoder.hpp"
+#include "Resampler.hpp"
 
 using namespace std;
 
@@ -16,15 +21,13 @@ static std::filesystem::path getExePath() {
 }
 }
 
-ParoliSynthesizer::ParoliSynthesizer(const InitOptions& opts) {
+ParoliSynthesizer::ParoliSynthesizer(const InitOptions& opts) : opts_(opts) {
     try {
         // Load voice/models
-        std::optional<piper::SpeakerId> speakerId = std::nullopt;
-        loadVoice(cfg_, "", opts.encoderPath.string(), opts.decoderPath.string(),
-                  opts.modelConfigPath.string(), voice_, speakerId, opts.accelerator);
+        voice_ = createVoice(opts);
 
         // Configure espeak
-        if (voice_.phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
+        if (voice_->phonemizeConfig.phonemeType == piper::eSpeakPhonemes) {
             if (opts.eSpeakDataPath) {
                 cfg_.eSpeakDataPath = opts.eSpeakDataPath->string();
             } else {
@@ -35,6 +38,12 @@ ParoliSynthesizer::ParoliSynthesizer(const InitOptions& opts) {
             cfg_.useESpeak = false;
         }
 
+        if (opts.tashkeelModelPath) {
+            cfg_.useTashkeel = true;
+            cfg_.tashkeelModelPath = opts.tashkeelModelPath->string();
+            cfg_.tashkeelStates = opts.tashkeelStates;
+        }
+
         piper::initialize(cfg_);
         initialized_ = true;
         lastError_.clear();
@@ -51,181 +60,305 @@ ParoliSynthesizer::~ParoliSynthesizer() {
     piper::terminate(cfg_);
 }
 
-vector<uint8_t> ParoliSynthesizer::synthesizeWav(const std::string& text) {
-    piper::SynthesisResult result;
-    stringstream ss;
-    piper::textToWavFile(cfg_, voice_, text, ss, result);
-    auto s = ss.str();
-    return vector<uint8_t>(s.begin(), s.end());
+std::shared_ptr<piper::Voice> ParoliSynthesizer::voice() const {
+    std::lock_guard<std::mutex> lock(voiceMutex_);
+    return voice_;
+}
+
+std::shared_ptr<piper::Voice> ParoliSynthesizer::createVoice(const InitOptions& opts) {
+    // The deleter runs once the last request using this voice has finished
+    auto voice = std::shared_ptr<piper::Voice>(new piper::Voice(), [](piper::Voice* v) {
+        spdlog::debug("Releasing voice");
+        delete v;
+    });
+    std::optional<piper::SpeakerId> speakerId = std::nullopt;
+    if (opts.encoderShapeBuckets) cfg_.encoderShapeBuckets = *opts.encoderShapeBuckets;
+    if (opts.decoderShapeBuckets) cfg_.decoderShapeBuckets = *opts.decoderShapeBuckets;
+    piper::loadVoice(cfg_, "", opts.encoderPath.string(), opts.decoderPath.string(),
+                     opts.modelConfigPath.string(), *voice, speakerId, opts.accelerator);
+    if (opts.maxPhrasePhonemes) voice->synthesisConfig.maxPhrasePhonemes = *opts.maxPhrasePhonemes;
+    return voice;
+}
+
+ParoliSynthesizer::ScratchLease::ScratchLease(ParoliSynthesizer& owner) : owner_(owner) {
+    {
+        std::lock_guard<std::mutex> lock(owner_.scratchMutex_);
+        if (!owner_.idleScratch_.empty()) {
+            scratch_ = std::move(owner_.idleScratch_.back());
+            owner_.idleScratch_.pop_back();
+        }
+    }
+    // The pool grows to the number of syntheses that ever ran at once
+    if (!scratch_) scratch_ = std::make_unique<Scratch>();
+}
+
+ParoliSynthesizer::ScratchLease::~ScratchLease() {
+    std::lock_guard<std::mutex> lock(owner_.scratchMutex_);
+    owner_.idleScratch_.push_back(std::move(scratch_));
 }
 
-vector<int16_t> ParoliSynthesizer::synthesizePcm(const std::string& text) {
-    vector<int16_t> audio;
-    audio.clear(); // Ensure buffer starts clean
+void ParoliSynthesizer::warmUp(piper::Voice& voice) {
+    // Run one short utterance so ORT allocations happen before the voice
+    // serves real traffic
+    ScratchLease scratch(*this);
     piper::SynthesisResult result;
-    auto cb = [&]() {};
-    piper::textToAudio(cfg_, voice_, text, audio, result, cb);
-    
-    // If audio is empty, try using the streaming approach to collect all audio
-    if (audio.empty()) {
-        vector<int16_t> allAudio;
-        allAudio.clear(); // Ensure buffer starts clean
-        auto streamCb = [&]() {
-            if (!audio.empty()) {
-                allAudio.insert(allAudio.end(), audio.begin(), audio.end());
-                audio.clear(); // Clear temp buffer after copying
-            }
-        };
-        piper::textToAudio(cfg_, voice_, text, audio, result, streamCb);
-        return allAudio;
+    piper::textToAudio(cfg_, voice, "Hello.", result, nullptr, std::nullopt, std::nullopt, std::nullopt, std::nullopt, nullptr, &scratch->synthesis);
+}
+
+ParoliSynthesizer::InitOptions ParoliSynthesizer::options() const {
+    std::lock_guard<std::mutex> lock(voiceMutex_);
+    return opts_;
+}
+
+void ParoliSynthesizer::reload() {
+    reload(options());
+}
+
+void ParoliSynthesizer::reload(const InitOptions& opts) {
+    std::lock_guard<std::mutex> reloadLock(reloadMutex_);
+    auto t0 = std::chrono::steady_clock::now();
+
+    spdlog::info("Reloading voice from {}", opts.modelConfigPath.string());
+    auto next = createVoice(opts);
+    auto current = voice();
+    const bool nextUsesESpeak = next->phonemizeConfig.phonemeType == piper::eSpeakPhonemes;
+    if (nextUsesESpeak != cfg_.useESpeak) {
+        throw runtime_error("Reloaded voice must use the same phoneme type");
     }
-    
-    return audio;
+    if (next->synthesisConfig.sampleRate != current->synthesisConfig.sampleRate) {
+        throw runtime_error("Reloaded voice must use the same sample rate");
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    warmUp(*next);
+    auto t2 = std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(voiceMutex_);
+        voice_.swap(next);
+        opts_ = opts;
+    }
+    auto t3 = std::chrono::steady_clock::now();
+
+    // `next` now holds the previous voice; it is released here unless
+    // in-flight requests still reference it
+    spdlog::info("Swapped voice in {} ms (load {} s, warm-up {} s, previous voice in use by {} request(s))",
+                 std::chrono::duration<double, std::milli>(t3 - t2).count(),
+                 std::chrono::duration<double>(t1 - t0).count(),
+                 std::chrono::duration<double>(t2 - t1).count(),
+                 next.use_count() - 1);
 }
 
-void ParoliSynthesizer::synthesizeStreamPcm(const std::string& text,
-                                            const function<void(std::span<const int16_t>)>& onChunk) {
-    vector<int16_t> chunk;
+void ParoliSynthesizer::synthesizeResampled(const piper::SynthesisInput& input, int outSampleRate, Scratch& scratch,
+                                            const function<void(span<const float>)>& onAudio,
+                                            SynthesisControl* control, const piper::DurationCallback& onDuration) {
+    auto v = voice();
+    const int nativeSr = v->synthesisConfig.sampleRate;
     piper::SynthesisResult result;
-    auto cb = [&]() {
-        if (!chunk.empty()) {
-            onChunk(std::span<const int16_t>(chunk.data(), chunk.size()));
-            chunk.clear(); // Clear chunk after processing to prevent reuse of stale data
-        }
+    if (outSampleRate <= 0 || outSampleRate == nativeSr) {
+        auto cb = [&](const piper::AudioChunk& chunk) {
+            if (!chunk.samples.empty()) onAudio(chunk.samples);
+        };
+        piper::textToAudio(cfg_, *v, input, result, cb, std::nullopt, std::nullopt, std::nullopt, std::nullopt,
+                           control, &scratch.synthesis, onDuration);
+        return;
+    }
+
+    auto resampler = makeResampler(nativeSr, outSampleRate);
+    vector<float>& out = scratch.resampled;
+    auto cb = [&](const piper::AudioChunk& chunk) {
+        if (chunk.samples.empty()) return;
+        resampler->process(chunk.samples, out);
+        if (!out.empty()) onAudio(out);
     };
-    piper::textToAudio(cfg_, voice_, text, chunk, result, cb);
+    // The resampler's output length follows from its input's
+    piper::DurationCallback resampledDuration;
+    if (onDuration) {
+        resampledDuration = [&](size_t samples) {
+            onDuration(size_t(Resampler::outputLength(samples, nativeSr, outSampleRate)));
+        };
+    }
+    piper::textToAudio(cfg_, *v, input, result, cb, std::nullopt, std::nullopt, std::nullopt, std::nullopt, control,
+                       &scratch.synthesis, resampledDuration);
+    resampler->flush(out);
+    if (!out.empty()) onAudio(out);
+}
+
+void ParoliSynthesizer::synthesizePcm(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate,
+                                      SynthesisControl* control) {
+    ScratchLease scratch(*this);
+    vector<int16_t>& pcm = scratch->pcm;
+    synthesizeResampled(input, outSampleRate, *scratch, [&](span<const float> audio) {
+        pcm.resize(audio.size());
+        piper::audioToPcm16(audio, pcm.data());
+        sink.write(reinterpret_cast<const uint8_t*>(pcm.data()), pcm.size() * sizeof(int16_t));
+    }, control);
+    sink.flush();
+}
+
+void ParoliSynthesizer::synthesizePcmF32(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate,
+                                         SynthesisControl* control) {
+    ScratchLease scratch(*this);
+    vector<float>& pcm = scratch->pcmF32;
+    synthesizeResampled(input, outSampleRate, *scratch, [&](span<const float> audio) {
+        pcm.resize(audio.size());
+        piper::audioToPcmF32(audio, pcm.data());
+        sink.write(reinterpret_cast<const uint8_t*>(pcm.data()), pcm.size() * sizeof(float));
+    }, control);
+    sink.flush();
+}
+
+void ParoliSynthesizer::synthesizeWav(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate,
+                                      SynthesisControl* control, bool predict) {
+    const int sr = outSampleRate > 0 ? outSampleRate : nativeSampleRate();
+    // A seekable sink gets the real length patched in at the end, without
+    // holding back the first audio for the prediction
+    piper::DurationCallback writeHeader;
+    if (sink.seekable() || !predict) {
+        auto header = wavHeader(sr, 1, UINT32_MAX);
+        sink.write(header.data(), header.size());
+    } else {
+        writeHeader = [&](size_t samples) {
+            auto header = wavHeader(sr, 1, uint32_t(min<size_t>(samples * sizeof(int16_t), UINT32_MAX - 36)));
+            sink.write(header.data(), header.size());
+        };
+    }
+    size_t dataBytes = 0;
+    ScratchLease scratch(*this);
+    vector<int16_t>& pcm = scratch->pcm;
+    synthesizeResampled(input, sr, *scratch, [&](span<const float> audio) {
+        pcm.resize(audio.size());
+        piper::audioToPcm16(audio, pcm.data());
+        sink.write(reinterpret_cast<const uint8_t*>(pcm.data()), pcm.size() * sizeof(int16_t));
+        dataBytes += pcm.size() * sizeof(int16_t);
+    }, control, writeHeader);
+    if (sink.seekable()) {
+        auto header = wavHeader(sr, 1, uint32_t(min<size_t>(dataBytes, UINT32_MAX - 36)));
+        sink.writeAt(0, header.data(), header.size());
+    }
+    sink.flush();
+}
+
+void ParoliSynthesizer::synthesizeOpus(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate,
+                                       SynthesisControl* control, const OpusOptions& opus) {
+    auto enc = makeOpusEncoder(false, outSampleRate, 1, opus);
+    ScratchLease scratch(*this);
+    vector<uint8_t>& ogg = scratch->encoded;
+    // Opus takes the float samples as they are; it does its own clipping
+    synthesizeResampled(input, outSampleRate, *scratch, [&](span<const float> audio) {
+        ogg.clear();
+        enc->encode(audio, ogg);
+        if (!ogg.empty()) sink.write(ogg.data(), ogg.size());
+    }, control);
+    ogg.clear();
+    enc->finish(ogg);
+    if (!ogg.empty()) sink.write(ogg.data(), ogg.size());
+    sink.flush();
+}
+
+vector<uint8_t> ParoliSynthesizer::synthesizeWav(const piper::SynthesisInput& input, SynthesisControl* control) {
+    vector<uint8_t> wav;
+    MemorySink sink(wav);
+    synthesizeWav(input, sink, -1, control);
+    return wav;
 }
 
-static vector<int16_t> soxrResample(span<const int16_t> input, size_t orig_sr, size_t out_sr, int channels) {
-    soxr_io_spec_t io_spec = soxr_io_spec(SOXR_INT16_I, SOXR_INT16_I);
-    soxr_quality_spec_t q_spec = soxr_quality_spec(SOXR_MQ, 0);
-    soxr_error_t error;
-    soxr_t soxr = soxr_create(orig_sr, out_sr, channels, &error, &io_spec, &q_spec, NULL);
-    if (error != NULL) throw runtime_error("soxr_create failed");
-    vector<int16_t> output(input.size() * out_sr / orig_sr);
-    size_t idone = 0, odone = 0;
-    error = soxr_process(soxr, input.data(), input.size(), &idone, output.data(), output.size(), &odone);
-    if (error != NULL) { soxr_delete(soxr); throw runtime_error("soxr_process failed"); }
-    output.resize(odone);
-    soxr_delete(soxr);
-    return output;
+vector<int16_t> ParoliSynthesizer::synthesizePcm(const piper::SynthesisInput& input, SynthesisControl* control) {
+    ScratchLease scratch(*this);
+    vector<int16_t> pcm; // returned, so not pooled
+    synthesizeResampled(input, -1, *scratch, [&](span<const float> audio) {
+        size_t offset = pcm.size();
+        pcm.resize(offset + audio.size());
+        piper::audioToPcm16(audio, pcm.data() + offset);
+    }, control);
+    return pcm;
 }
 
-vector<uint8_t> ParoliSynthesizer::synthesizeOpus(const std::string& text, int outSampleRate) {
-    auto audio = synthesizePcm(text);
-    auto pcm = (outSampleRate == nativeSampleRate())
-                   ? audio
-                   : soxrResample(std::span<const int16_t>(audio.data(), audio.size()), nativeSampleRate(), outSampleRate, 1);
-    auto ogg = encodeOgg(pcm, outSampleRate, 1);
+vector<uint8_t> ParoliSynthesizer::synthesizeOpus(const piper::SynthesisInput& input, int outSampleRate, SynthesisControl* control,
+                                                  const OpusOptions& opus) {
+    vector<uint8_t> ogg;
+    MemorySink sink(ogg);
+    synthesizeOpus(input, sink, outSampleRate, control, opus);
     return ogg;
 }
 
-void ParoliSynthesizer::synthesizeStreamOpus(const std::string& text,
-                                             const function<void(const uint8_t*, size_t)>& onChunk,
-                                             int outSampleRate) {
-    StreamingOggOpusEncoder enc(outSampleRate, 1);
-    vector<int16_t> chunk;
+void ParoliSynthesizer::synthesizeStreamPcm(const piper::SynthesisInput& input,
+                                            const piper::AudioCallback& onChunk,
+                                            SynthesisControl* control,
+                                            const piper::DurationCallback& onDuration) {
+    auto v = voice();
+    ScratchLease scratch(*this);
     piper::SynthesisResult result;
-    auto cb = [&]() {
-        if (chunk.empty()) return;
-        auto pcm = (outSampleRate == nativeSampleRate())
-                       ? chunk
-                       : soxrResample(std::span<const int16_t>(chunk.data(), chunk.size()), nativeSampleRate(), outSampleRate, 1);
-        auto ogg = enc.encode(pcm);
-        if (!ogg.empty()) onChunk(ogg.data(), ogg.size());
-    };
-    piper::textToAudio(cfg_, voice_, text, chunk, result, cb);
-    auto tail = enc.finish();
-    if (!tail.empty()) onChunk(tail.data(), tail.size());
+    piper::textToAudio(cfg_, *v, input, result, onChunk, std::nullopt, std::nullopt, std::nullopt, std::nullopt, control,
+                       &scratch->synthesis, onDuration);
 }
 
-std::vector<int16_t> ParoliSynthesizer::resample(std::span<const int16_t> input, size_t orig_sr, size_t out_sr, int channels) {
-    return soxrResample(input, orig_sr, out_sr, channels);
+void ParoliSynthesizer::synthesizeStreamOpus(const piper::SynthesisInput& input,
+                                             const function<void(const uint8_t*, size_t)>& onChunk,
+                                             int outSampleRate,
+                                             SynthesisControl* control,
+                                             const OpusOptions& opus) {
+    CallbackSink sink(onChunk);
+    synthesizeOpus(input, sink, outSampleRate, control, opus);
+}
+
+std::vector<float> ParoliSynthesizer::resample(std::span<const float> input, size_t orig_sr, size_t out_sr, int channels) {
+    if (channels != 1) throw runtime_error("Only mono audio can be resampled");
+    return Resampler::resample(input, int(orig_sr), int(out_sr));
+}
+
+std::unique_ptr<Resampler> ParoliSynthesizer::makeResampler(int inRate, int outRate) const {
+    ResampleQuality quality;
+    bool builtIn;
+    {
+        std::lock_guard<std::mutex> lock(voiceMutex_);
+        quality = opts_.resampleQuality;
+        builtIn = opts_.builtInResampler;
+    }
+    return std::make_unique<Resampler>(inRate, outRate, quality, builtIn);
 }
 
 
 
 // Direct speak method with volume control
-bool ParoliSynthesizer::speak(const std::string& text) {
+bool ParoliSynthesizer::speak(const piper::SynthesisInput& input) {
     if (!isModelLoaded()) {
         return false;
     }
-    
+
     try {
-        auto audio = synthesizePcm(text);
-        if (audio.empty()) {
-            return false;
-        }
-        
-        // Apply volume with overflow protection
-        if (volume_ != 1.0f) {
-            for (auto& sample : audio) {
-                int32_t scaled = static_cast<int32_t>(sample * volume_);
-                // Clamp to int16_t range to prevent overflow
-                sample = static_cast<int16_t>(std::clamp(scaled, 
-                    static_cast<int32_t>(std::numeric_limits<int16_t>::min()),
-                    static_cast<int32_t>(std::numeric_limits<int16_t>::max())));
+        std::lock_guard<std::mutex> lock(playbackMutex_);
+        const int rate = nativeSampleRate();
+        if (!player_ || player_->sampleRate() != rate || player_->failed()) {
+            // A reload may change the rate; the old device plays out first
+            player_.reset();
+            std::string device;
+            int bufferMs;
+            {
+                std::lock_guard<std::mutex> lk(voiceMutex_);
+                device = opts_.audioDevice;
+                bufferMs = opts_.playbackBufferMs;
             }
+            player_ = std::make_unique<AudioPlayer>(device, rate, bufferMs);
         }
-        
-        // Play audio using ALSA
-        snd_pcm_t *handle;
-        int err;
-        
-        if ((err = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-            lastError_ = "Cannot open audio device: " + std::string(snd_strerror(err));
-            return false;
-        }
-        
-        // Set hardware parameters
-        snd_pcm_hw_params_t *params;
-        snd_pcm_hw_params_alloca(&params);
-        snd_pcm_hw_params_any(handle, params);
-        snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-        snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-        snd_pcm_hw_params_set_channels(handle, params, 1);
-        
-        // Set sample rate more safely
-        unsigned int rate = nativeSampleRate();
-        if ((err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0)) < 0) {
-            lastError_ = "Cannot set sample rate: " + std::string(snd_strerror(err));
-            snd_pcm_close(handle);
-            return false;
-        }
-        
-        // Set buffer size to prevent underruns
-        snd_pcm_uframes_t buffer_size = audio.size();
-        if ((err = snd_pcm_hw_params_set_buffer_size_near(handle, params, &buffer_size)) < 0) {
-            lastError_ = "Cannot set buffer size: " + std::string(snd_strerror(err));
-            snd_pcm_close(handle);
-            return false;
-        }
-        
-        if ((err = snd_pcm_hw_params(handle, params)) < 0) {
-            lastError_ = "Cannot set parameters: " + std::string(snd_strerror(err));
-            snd_pcm_close(handle);
-            return false;
-        }
-        
-        // Prepare the PCM device
-        if ((err = snd_pcm_prepare(handle)) < 0) {
-            lastError_ = "Cannot prepare audio device: " + std::string(snd_strerror(err));
-            snd_pcm_close(handle);
-            return false;
+
+        // Volume is applied in the same pass that converts to 16 bits, and
+        // each chunk starts playing as soon as it is synthesized
+        bool spoke = false;
+        try {
+            ScratchLease scratch(*this);
+            synthesizeResampled(input, -1, *scratch, [&](span<const float> chunk) {
+                player_->write(chunk, volume_);
+                spoke = true;
+            }, nullptr);
+        } catch (...) {
+            player_->endUtterance();
+            throw;
         }
-        
-        // Write audio data
-        snd_pcm_sframes_t frames = snd_pcm_writei(handle, audio.data(), audio.size());
-        if (frames < 0) {
-            lastError_ = "Write error: " + std::string(snd_strerror(frames));
-            snd_pcm_close(handle);
+        player_->endUtterance();
+        if (!spoke) {
             return false;
         }
-        
-        // Wait for playback to complete
-        snd_pcm_drain(handle);
-        snd_pcm_close(handle);
-        
+
         lastError_.clear();
         return true;
     } catch (const std::exception& e) {
@@ -234,34 +367,25 @@ bool ParoliSynthesizer::speak(const std::string& text) {
     }
 }
 
-// Speak to file method
 bool ParoliSynthesizer::speakToFile(const std::string& text, const std::string& filename, const std::string& format) {
     if (!isModelLoaded()) {
         return false;
     }
     
     try {
-        std::ofstream file(filename, std::ios::binary);
-        if (!file.is_open()) {
-            lastError_ = "Cannot open file: " + filename;
+        if (format != "wav" && format != "pcm" && format != "opus") {
+            lastError_ = "Unsupported format: " + format;
             return false;
         }
-        
+
+        FileSink file(filename);
         if (format == "wav") {
-            auto wav = synthesizeWav(text);
-            file.write(reinterpret_cast<const char*>(wav.data()), wav.size());
+            synthesizeWav(text, file);
         } else if (format == "pcm") {
-            auto pcm = synthesizePcm(text);
-            file.write(reinterpret_cast<const char*>(pcm.data()), pcm.size() * sizeof(int16_t));
-        } else if (format == "opus") {
-            auto opus = synthesizeOpus(text);
-            file.write(reinterpret_cast<const char*>(opus.data()), opus.size());
+            synthesizePcm(text, file);
         } else {
-            lastError_ = "Unsupported format: " + format;
-            return false;
+            synthesizeOpus(text, file);
         }
-        
-        file.close();
         lastError_.clear();
         return true;
     } catch (const std::exception& e) {
@@ -277,14 +401,16 @@ std::vector<int16_t> ParoliSynthesizer::speakToBuffer(const std::string& text, i
     }
     
     try {
-        auto audio = synthesizePcm(text);
-        
-        // Resample if needed
-        if (sampleRate > 0 && sampleRate != nativeSampleRate()) {
-            audio = resample(std::span<const int16_t>(audio.data(), audio.size()), 
-                           nativeSampleRate(), sampleRate, 1);
+        vector<int16_t> audio;
+        {
+            ScratchLease scratch(*this);
+            synthesizeResampled(text, sampleRate, *scratch, [&](span<const float> chunk) {
+                size_t offset = audio.size();
+                audio.resize(offset + chunk.size());
+                piper::audioToPcm16(chunk, audio.data() + offset);
+            }, nullptr);
         }
-        
+
         lastError_.clear();
         return audio;
     } catch (const std::exception& e) {
@@ -2,6 +2,8 @@
 
 #include <filesystem>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <span>
 #include <string>
@@ -10,6 +12,12 @@
 
 #include "piper/piper.hpp"
 
+#include "AudioSink.hpp"
+#include "OggOpusEncoder.hpp"
+#include "Resampler.hpp"
+
+class AudioPlayer;
+
 class ParoliSynthesizer {
 public:
     struct InitOptions {
@@ -18,25 +26,82 @@ public:
         std::filesystem::path modelConfigPath;
         std::optional<std::filesystem::path> eSpeakDataPath;
         std::string accelerator = ""; // e.g., "cuda", "tensorrt"
+        // Overrides the voice's max_phrase_phonemes; 0 disables splitting
+        std::optional<size_t> maxPhrasePhonemes;
+        // Override piper's default ONNX input shape buckets; empty disables
+        // padding
+        std::optional<std::vector<int64_t>> encoderShapeBuckets;
+        std::optional<std::vector<int64_t>> decoderShapeBuckets;
+        // libtashkeel model for Arabic diacritization, and how many requests
+        // may diacritize at once
+        std::optional<std::filesystem::path> tashkeelModelPath;
+        size_t tashkeelStates = 1;
+        // Resampling to other output rates; without the built-in filter,
+        // every rate pair goes through soxr
+        ResampleQuality resampleQuality = ResampleQuality::Medium;
+        bool builtInResampler = true;
+        // ALSA device for speak(), and its buffer against underruns
+        std::string audioDevice = "default";
+        int playbackBufferMs = 200;
     };
 
     explicit ParoliSynthesizer(const InitOptions& opts);
     ~ParoliSynthesizer();
 
-    const piper::Voice& voice() const { return voice_; }
-    int nativeSampleRate() const { return voice_.synthesisConfig.sampleRate; }
+    // The voice currently used for new requests. Callers holding the returned
+    // pointer keep that voice alive across a reload.
+    std::shared_ptr<piper::Voice> voice() const;
+    int nativeSampleRate() const { return voice()->synthesisConfig.sampleRate; }
+    // A copy, since a reload may replace them meanwhile
+    InitOptions options() const;
+
+    // Load, warm up and atomically swap in a new voice. In-flight requests
+    // finish on the voice they started with. Throws on failure, in which case
+    // the current voice stays active.
+    void reload();
+    void reload(const InitOptions& opts);
+
+    // Synthesis entry points. `control` carries the request's cancel token
+    // and scheduler gate; see piper::textToAudio.
+    //
+    // The sink forms write each chunk as soon as it is encoded, so memory
+    // stays bounded by the chunk size however long the input is. A sample
+    // rate <= 0 means the voice's own. WAV to a sink that cannot seek back
+    // has its sizes marked unknown, unless `predict` asks for the length to
+    // be predicted (see piper::textToAudio) so the header is exact from the
+    // first byte; that holds back the first audio.
+    void synthesizeWav(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate = -1,
+                       SynthesisControl* control = nullptr, bool predict = false);
+    void synthesizePcm(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate = -1,
+                       SynthesisControl* control = nullptr);
+    void synthesizeOpus(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate = 24000,
+                        SynthesisControl* control = nullptr, const OpusOptions& opus = {});
+    // Raw little-endian float32 samples in [-1, 1]
+    void synthesizePcmF32(const piper::SynthesisInput& input, AudioSink& sink, int outSampleRate = -1,
+                          SynthesisControl* control = nullptr);
 
-    std::vector<uint8_t> synthesizeWav(const std::string& text);
-    std::vector<int16_t> synthesizePcm(const std::string& text);
-    std::vector<uint8_t> synthesizeOpus(const std::string& text, int outSampleRate = 24000);
+    // Whole-utterance buffers, for callers that need them at once
+    std::vector<uint8_t> synthesizeWav(const piper::SynthesisInput& input, SynthesisControl* control = nullptr);
+    std::vector<int16_t> synthesizePcm(const piper::SynthesisInput& input, SynthesisControl* control = nullptr);
+    std::vector<uint8_t> synthesizeOpus(const piper::SynthesisInput& input, int outSampleRate = 24000,
+                                        SynthesisControl* control = nullptr, const OpusOptions& opus = {});
 
-    void synthesizeStreamPcm(const std::string& text,
-                             const std::function<void(std::span<const int16_t>)>& onChunk);
-    void synthesizeStreamOpus(const std::string& text,
+    // `onChunk` sees each chunk in place; see piper::AudioChunk. With
+    // `onDuration`, the length in native samples is predicted before the
+    // first chunk.
+    void synthesizeStreamPcm(const piper::SynthesisInput& input,
+                             const piper::AudioCallback& onChunk,
+                             SynthesisControl* control = nullptr,
+                             const piper::DurationCallback& onDuration = nullptr);
+    void synthesizeStreamOpus(const piper::SynthesisInput& input,
                               const std::function<void(const uint8_t*, size_t)>& onChunk,
-                              int outSampleRate = 24000);
+                              int outSampleRate = 24000,
+                              SynthesisControl* control = nullptr,
+                              const OpusOptions& opus = {});
 
-    static std::vector<int16_t> resample(std::span<const int16_t> input, size_t orig_sr, size_t out_sr, int channels);
+    static std::vector<float> resample(std::span<const float> input, size_t orig_sr, size_t out_sr, int channels);
+    // Streaming resampler configured by the init options
+    std::unique_ptr<Resampler> makeResampler(int inRate, int outRate) const;
 
     // Status and error handling
     bool isInitialized() const { return initialized_; }
@@ -51,16 +116,66 @@ public:
     bool isModelLoaded() const { return initialized_ && lastError_.empty(); }
 
     // Convenience methods for integration
-    bool speak(const std::string& text);
+    //
+    // speak() queues audio on a playback device that stays open, chunk by
+    // chunk as it is synthesized, and returns once the utterance is
+    // synthesized; playback continues meanwhile. Concurrent calls play in
+    // turn, whole utterances each.
+    bool speak(const piper::SynthesisInput& input);
     bool speakToFile(const std::string& text, const std::string& filename, const std::string& format = "wav");
     std::vector<int16_t> speakToBuffer(const std::string& text, int sampleRate = -1);
 
 private:
+    // Working memory of one synthesis, lent from a pool and returned with its
+    // capacity intact, so requests after the first few do not allocate it
+    struct Scratch {
+        piper::SynthesisBuffers synthesis;
+        std::vector<float> resampled;
+        std::vector<int16_t> pcm;
+        std::vector<float> pcmF32;
+        std::vector<uint8_t> encoded;
+    };
+
+    class ScratchLease {
+    public:
+        explicit ScratchLease(ParoliSynthesizer& owner);
+        ~ScratchLease();
+        ScratchLease(const ScratchLease&) = delete;
+        ScratchLease& operator=(const ScratchLease&) = delete;
+
+        Scratch* operator->() { return scratch_.get(); }
+        Scratch& operator*() { return *scratch_; }
+
+    private:
+        ParoliSynthesizer& owner_;
+        std::unique_ptr<Scratch> scratch_;
+    };
+
+    std::shared_ptr<piper::Voice> createVoice(const InitOptions& opts);
+
+    // Synthesize `input` at `outSampleRate`, passing each chunk to `onAudio`
+    // still in float; callers gain, clip and convert it in one pass.
+    // `onDuration` gets the predicted length at `outSampleRate`.
+    void synthesizeResampled(const piper::SynthesisInput& input, int outSampleRate, Scratch& scratch,
+                             const std::function<void(std::span<const float>)>& onAudio,
+                             SynthesisControl* control, const piper::DurationCallback& onDuration = nullptr);
+    void warmUp(piper::Voice& voice);
+
+    InitOptions opts_;
     piper::PiperConfig cfg_;
-    piper::Voice voice_;
+    mutable std::mutex voiceMutex_;
+    std::mutex reloadMutex_;
+    std::shared_ptr<piper::Voice> voice_;
     bool initialized_ = false;
     std::string lastError_;
     float volume_ = 1.0f;
+
+    std::mutex scratchMutex_;
+    std::vector<std::unique_ptr<Scratch>> idleScratch_;
+
+    // Opened by the first speak(); one utterance feeds it at a time
+    std::mutex playbackMutex_;
+    std::unique_ptr<AudioPlayer> player_;
 };
 
 
@@ -1,13 +1,108 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <optional>
 
 #include <xtensor/xarray.hpp>
 
+// Thrown out of synthesis that was stopped through a CancelToken
+struct CancelledError : std::runtime_error {
+  CancelledError() : std::runtime_error("Cancelled") {}
+};
+
+// Cancellation of one synthesis, shared between the synthesis and whoever may
+// want to stop it. cancel() can be called from any thread; synthesis stops at
+// the next chunk boundary, and an inference call that is running at the time
+// is aborted through the hook it registered with interruptWith().
+class CancelToken {
+public:
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (cancelled_.exchange(true))
+      return;
+    cancelledAt_ = std::chrono::steady_clock::now();
+    if (interrupt_)
+      interrupt_();
+  }
+
+  bool cancelled() const { return cancelled_.load(); }
+
+  // When cancel() was first called; only meaningful once cancelled()
+  std::chrono::steady_clock::time_point cancelledAt() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return cancelledAt_;
+  }
+
+  void throwIfCancelled() const {
+    if (cancelled())
+      throw CancelledError();
+  }
+
+  // Hook registered for the lifetime of a blocking call
+  class Scope {
+  public:
+    explicit Scope(CancelToken *token) : token_(token) {}
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() {
+      if (token_) {
+        std::lock_guard<std::mutex> lock(token_->mtx_);
+        token_->interrupt_ = nullptr;
+      }
+    }
+
+  private:
+    CancelToken *token_;
+  };
+
+  // Run `interrupt` if the token is (or gets) cancelled while the returned
+  // scope is alive. A null token is allowed and never fires.
+  static Scope interruptWith(CancelToken *token, std::function<void()> interrupt) {
+    if (token) {
+      std::lock_guard<std::mutex> lock(token->mtx_);
+      token->interrupt_ = std::move(interrupt);
+      if (token->cancelled_.load())
+        token->interrupt_();
+    }
+    return Scope(token);
+  }
+
+private:
+  mutable std::mutex mtx_;
+  std::atomic<bool> cancelled_{false};
+  std::chrono::steady_clock::time_point cancelledAt_;
+  std::function<void()> interrupt_;
+};
+
+// Admission of the units of work of one synthesis to the CPU, for schedulers
+// that interleave requests at chunk granularity. A unit is one encoder call or
+// one decoder window; enter() blocks until it may run, leave() reports how
+// many samples of audio it produced (0 for the encoder).
+struct UnitGate {
+  virtual ~UnitGate() = default;
+  virtual void enter() = 0;
+  virtual void leave(size_t samples) = 0;
+};
+
+// Per-synthesis hooks; every field is optional
+struct SynthesisControl {
+  CancelToken *cancel = nullptr;
+  UnitGate *gate = nullptr;
+};
+
 struct DecoderInferer {
   virtual ~DecoderInferer() = default;
-  virtual std::vector<int16_t> infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g) = 0;
+  // Decode one window into `audio` as float samples, nominally in [-1, 1]
+  // and not clipped. `audio` is resized to fit and keeps its capacity for
+  // the next call.
+  virtual void infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& audio, CancelToken* cancel = nullptr) = 0;
   virtual void load(std::string modelPath, std::string accelerator) = 0;
+  // Run every input shape the decoder will see once, ahead of real requests
+  virtual void warmUp() {}
 };
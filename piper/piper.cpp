@@ -1,9 +1,13 @@
+#include <algorithm>
 #include <array>
+#include <cctype>
 #include <chrono>
+#include <deque>
 #include <fstream>
 #include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <string_view>
 
 #include <espeak-ng/speak_lib.h>
 #include <onnxruntime_cxx_api.h>
@@ -153,7 +157,8 @@ void parseSynthesisConfig(json &configRoot, SynthesisConfig &synthesisConfig) {
   //         "phoneme_silence": {
   //           "<phoneme>": <seconds of silence>,
   //           ...
-  //         }
+  //         },
+  //         "max_phrase_phonemes": 200
   //     }
   // }
 
@@ -199,6 +204,11 @@ void parseSynthesisConfig(json &configRoot, SynthesisConfig &synthesisConfig) {
 
     } // if phoneme_silence
 
+    if (inferenceValue.contains("max_phrase_phonemes")) {
+      synthesisConfig.maxPhrasePhonemes =
+          inferenceValue["max_phrase_phonemes"].get<std::size_t>();
+    }
+
   } // if inference
 
 } /* parseSynthesisConfig */
@@ -248,15 +258,91 @@ void initialize(PiperConfig &config) {
 
     spdlog::debug("Loading libtashkeel model from {}",
                   config.tashkeelModelPath.value());
-    config.tashkeelState = std::make_unique<tashkeel::State>();
-    tashkeel::tashkeel_load(config.tashkeelModelPath.value(),
-                            *config.tashkeelState);
-    spdlog::debug("Initialized libtashkeel");
+    config.tashkeel = std::make_unique<TashkeelPool>(
+        config.tashkeelModelPath.value(), config.tashkeelStates,
+        config.tashkeelCacheSize);
+    spdlog::debug("Initialized libtashkeel ({} state(s))",
+                  std::max<std::size_t>(1, config.tashkeelStates));
   }
 
   spdlog::info("Initialized piper");
 }
 
+TashkeelPool::TashkeelPool(std::string modelPath, std::size_t maxStates,
+                           std::size_t cacheSize)
+    : modelPath_(std::move(modelPath)),
+      maxStates_(std::max<std::size_t>(1, maxStates)), cacheSize_(cacheSize) {
+  // Load one state up front so a bad model path fails at startup
+  release(acquire());
+}
+
+std::unique_ptr<tashkeel::State> TashkeelPool::acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  available_.wait(lock, [&]() { return !idle_.empty() || loaded_ < maxStates_; });
+  if (!idle_.empty()) {
+    auto state = std::move(idle_.back());
+    idle_.pop_back();
+    return state;
+  }
+
+  // Load a new state outside the lock; others keep using the idle ones
+  loaded_++;
+  lock.unlock();
+  try {
+    auto state = std::make_unique<tashkeel::State>();
+    tashkeel::tashkeel_load(modelPath_, *state);
+    return state;
+  } catch (...) {
+    lock.lock();
+    loaded_--;
+    lock.unlock();
+    available_.notify_one();
+    throw;
+  }
+}
+
+void TashkeelPool::release(std::unique_ptr<tashkeel::State> state) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(std::move(state));
+  }
+  available_.notify_one();
+}
+
+std::string TashkeelPool::run(const std::string &text) {
+  if (cacheSize_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = cacheIndex_.find(text);
+    if (it != cacheIndex_.end()) {
+      cache_.splice(cache_.begin(), cache_, it->second);
+      return it->second->second;
+    }
+  }
+
+  auto state = acquire();
+  std::string diacritized;
+  try {
+    diacritized = tashkeel::tashkeel_run(text, *state);
+  } catch (...) {
+    release(std::move(state));
+    throw;
+  }
+  release(std::move(state));
+
+  if (cacheSize_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cacheIndex_.count(text) == 0) {
+      cache_.emplace_front(text, diacritized);
+      cacheIndex_[text] = cache_.begin();
+      if (cache_.size() > cacheSize_) {
+        cacheIndex_.erase(cache_.back().first);
+        cache_.pop_back();
+      }
+    }
+  }
+  return diacritized;
+}
+
 void terminate(PiperConfig &config) {
   if (config.useESpeak) {
     // Clean up espeak-ng
@@ -293,6 +379,8 @@ void loadVoice(PiperConfig &config, std::string modelPath,
 
   spdlog::debug("Voice contains {} speaker(s)", voice.modelConfig.numSpeakers);
 
+  voice.encoder.shapeBuckets = config.encoderShapeBuckets;
+  voice.encoder.padId = voice.phonemizeConfig.idPad;
   voice.encoder.load(encoderPath, accelerator);
 
   auto extension = std::filesystem::path(decoderPath).extension();
@@ -303,11 +391,73 @@ void loadVoice(PiperConfig &config, std::string modelPath,
       throw std::runtime_error("RKNN is not enabled in this build");
 #endif
   }
-  else
-      voice.decoder = std::make_unique<OnnxDecoderInferer>();
+  else {
+      auto onnxDecoder = std::make_unique<OnnxDecoderInferer>();
+      onnxDecoder->shapeBuckets = config.decoderShapeBuckets;
+      voice.decoder = std::move(onnxDecoder);
+  }
   voice.decoder->load(decoderPath, accelerator);
+
+  // Run each shape bucket once so its memory plan exists before the first
+  // request needs it
+  auto warmUpStart = std::chrono::steady_clock::now();
+  voice.encoder.warmUp();
+  voice.decoder->warmUp();
+  spdlog::debug("Warmed up {} encoder and {} decoder shape bucket(s) in {} seconds",
+                voice.encoder.shapeBuckets.size(), config.decoderShapeBuckets.size(),
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - warmUpStart).count());
 } /* loadVoice */
 
+// Plain loops over contiguous floats with min/max clipping, which compilers
+// vectorize; keep branches out of them
+void audioToPcm16(std::span<const float> audio, int16_t *out, float gain) {
+  const float scale = gain * MAX_WAV_VALUE;
+  for (std::size_t i = 0; i < audio.size(); i++) {
+    float val = std::min(std::max(audio[i] * scale, -MAX_WAV_VALUE),
+                         MAX_WAV_VALUE);
+    out[i] = (int16_t)val;
+  }
+}
+
+void audioToPcmF32(std::span<const float> audio, float *out, float gain) {
+  for (std::size_t i = 0; i < audio.size(); i++) {
+    out[i] = std::min(std::max(audio[i] * gain, -1.0f), 1.0f);
+  }
+}
+
+int64_t shapeBucket(const std::vector<int64_t> &buckets, int64_t size) {
+  auto it = std::lower_bound(buckets.begin(), buckets.end(), size);
+  return it == buckets.end() ? size : *it;
+}
+
+std::vector<int64_t> parseShapeBuckets(const std::string &spec) {
+  std::vector<int64_t> buckets;
+  if (spec == "none")
+    return buckets;
+  std::stringstream specStream(spec);
+  std::string item;
+  while (std::getline(specStream, item, ',')) {
+    if (item.find_first_not_of(" \t") == std::string::npos)
+      continue;
+    int64_t bucket = 0;
+    std::size_t used = 0;
+    try {
+      bucket = std::stoll(item, &used);
+    } catch (const std::logic_error &) {
+      // invalid_argument or out_of_range
+      throw std::runtime_error("Invalid shape bucket list: " + spec);
+    }
+    if (item.find_first_not_of(" \t", used) != std::string::npos)
+      throw std::runtime_error("Invalid shape bucket list: " + spec);
+    if (bucket <= 0)
+      throw std::runtime_error("Shape buckets must be positive");
+    buckets.push_back(bucket);
+  }
+  std::sort(buckets.begin(), buckets.end());
+  buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+  return buckets;
+}
+
 void OnnxDecoderInferer::load(std::string path, std::string accelerator)
 {
     spdlog::debug("Loading decoder onnx model from {}", path);
@@ -328,60 +478,101 @@ void OnnxDecoderInferer::load(std::string path, std::string accelerator)
     }
     
     //options.DisableCpuMemArena();
-    //options.DisableMemPattern();
+    // Reused for every input shape seen before, i.e. every shape bucket
+    options.EnableMemPattern();
     onnx = Ort::Session(env, path.c_str(), options);
 }
 
-std::vector<int16_t> OnnxDecoderInferer::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g)
+void OnnxDecoderInferer::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& audio, CancelToken* cancel)
 {
   auto memoryInfo = Ort::MemoryInfo::CreateCpu(
       OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
 
-  std::vector<Ort::Value> inputTensors;
-  const std::array<std::string, 3> paramNames = {"z", "y_mask", "g"};
-  for(auto& name : paramNames) {
-    const xt::xarray<float>* ptr = nullptr;
-    if(name == "z")
-      ptr = &z;
-    else if(name == "y_mask")
-      ptr = &y_mask;
-    else if(name == "g") {
-        if(!g.has_value())
-            continue;
-        ptr = &g.value();
-    }
-    else
-      throw std::runtime_error("Invalid parameter name");
-    auto& arr = *ptr;
-    std::vector<int64_t> shape(arr.shape().begin(), arr.shape().end());
-    inputTensors.push_back(Ort::Value::CreateTensor<float>(
-        memoryInfo, (float*)arr.data(), arr.size(), shape.data(),
-        shape.size()));
-  }
-
-  std::vector<const char*> inputNames = {"z", "y_mask"};
-  if(g.has_value())
-    inputNames.push_back("g");
+  // Pad the window with masked-out frames up to its shape bucket; the audio
+  // they decode to is trimmed off below. The padded copies are per thread, so
+  // concurrent requests never share them, and stay allocated at bucket size
+  // for the thread's next window.
+  const size_t frames = z.shape()[2];
+  const size_t paddedFrames = shapeBucket(shapeBuckets, frames);
+  thread_local xt::xarray<float> paddedZ, paddedMask;
+  const xt::xarray<float> *zInput = &z;
+  const xt::xarray<float> *maskInput = &y_mask;
+  if (paddedFrames > frames) {
+    paddedZ.resize({z.shape()[0], z.shape()[1], paddedFrames});
+    xt::view(paddedZ, xt::all(), xt::all(), xt::range(0, frames)) = z;
+    xt::view(paddedZ, xt::all(), xt::all(), xt::range(frames, paddedFrames)) = 0.0f;
+    paddedMask.resize({y_mask.shape()[0], y_mask.shape()[1], paddedFrames});
+    xt::view(paddedMask, xt::all(), xt::all(), xt::range(0, frames)) = y_mask;
+    xt::view(paddedMask, xt::all(), xt::all(), xt::range(frames, paddedFrames)) = 0.0f;
+    zInput = &paddedZ;
+    maskInput = &paddedMask;
+  }
+
+  std::array<const xt::xarray<float>*, 3> inputs = {zInput, maskInput, g ? &*g : nullptr};
+  std::array<std::array<int64_t, 3>, 3> shapes;
+  std::array<Ort::Value, 3> inputTensors = {Ort::Value(nullptr), Ort::Value(nullptr), Ort::Value(nullptr)};
+  const size_t inputCount = g.has_value() ? 3 : 2;
+  for(size_t i = 0; i < inputCount; i++) {
+    auto& arr = *inputs[i];
+    if(arr.dimension() != 3)
+      throw std::runtime_error("Decoder inputs must have 3 dimensions");
+    std::copy(arr.shape().begin(), arr.shape().end(), shapes[i].begin());
+    inputTensors[i] = Ort::Value::CreateTensor<float>(
+        memoryInfo, (float*)arr.data(), arr.size(), shapes[i].data(),
+        shapes[i].size());
+  }
+
+  std::array<const char *, 3> inputNames = {"z", "y_mask", "g"};
   std::array<const char *, 1> outputNames = {"output"};
 
   auto startTime = std::chrono::steady_clock::now();
-  auto outputTensors = onnx.Run(
-      Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
-      inputTensors.size(), outputNames.data(), outputNames.size());
+  Ort::RunOptions runOptions;
+  Ort::Value outputTensor(nullptr);
+  {
+    auto scope = CancelToken::interruptWith(cancel, [&]() { runOptions.SetTerminate(); });
+    try {
+      onnx.Run(runOptions, inputNames.data(), inputTensors.data(), inputCount,
+               outputNames.data(), &outputTensor, outputNames.size());
+    } catch (const Ort::Exception &) {
+      if (cancel && cancel->cancelled())
+        throw CancelledError();
+      throw;
+    }
+  }
   auto endTime = std::chrono::steady_clock::now();
 
-  if ((outputTensors.size() != 1) || (!outputTensors.front().IsTensor())) {
+  if (!outputTensor.IsTensor()) {
     throw std::runtime_error("Invalid output tensors");
   }
-  std::vector<int16_t> output;
-  output.resize(outputTensors.front().GetTensorTypeAndShapeInfo().GetElementCount());
-  auto ortOutPtr = outputTensors.front().GetTensorData<float>();
-  for(size_t i = 0; i < output.size(); i++) {
-      float val = std::min(std::max(ortOutPtr[i], -1.0f), 1.0f);
-      output[i] = val * MAX_WAV_VALUE;
+  const size_t samples = outputTensor.GetTensorTypeAndShapeInfo().GetElementCount();
+  audio.resize(paddedFrames > 0 ? samples / paddedFrames * frames : samples);
+  auto ortOutPtr = outputTensor.GetTensorData<float>();
+  std::copy(ortOutPtr, ortOutPtr + audio.size(), audio.begin());
+  spdlog::debug("Decoder inference took {} seconds ({} frames, padded to {})",
+                std::chrono::duration<double>(endTime - startTime).count(), frames, paddedFrames);
+}
+
+void OnnxDecoderInferer::warmUp()
+{
+  // z is [1, channels, frames] and g [1, channels, 1]; only frames is dynamic
+  auto inputShape = [&](size_t i) {
+    auto shape = onnx.GetInputTypeInfo(i).GetTensorTypeAndShapeInfo().GetShape();
+    std::vector<size_t> dims;
+    for (auto dim : shape)
+      dims.push_back(dim > 0 ? dim : 1);
+    return dims;
+  };
+  std::optional<xt::xarray<float>> g;
+  if (onnx.GetInputCount() > 2)
+    g = xt::zeros<float>(inputShape(2));
+  auto zShape = inputShape(0);
+  std::vector<float> audio;
+  for (auto bucket : shapeBuckets) {
+    zShape[2] = bucket;
+    xt::xarray<float> z = xt::zeros<float>(zShape);
+    xt::xarray<float> y_mask = xt::ones<float>({size_t(1), size_t(1), size_t(bucket)});
+    infer(z, y_mask, g, audio);
   }
-  spdlog::debug("Decoder inference took {} seconds", std::chrono::duration<double>(endTime - startTime).count());
-  return output;
 }
 
 
@@ -407,7 +598,12 @@ void EncoderInferer::load(std::string path, std::string accelerator)
     
     // Makes encoder slower
     //options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
+    options.EnableMemPattern();
     onnx = Ort::Session(env, path.c_str(), options);
+
+    outputNames.clear();
+    for (size_t i = 0; i < onnx.GetOutputCount(); i++)
+      outputNames.push_back(onnx.GetOutputNameAllocated(i, allocator).get());
 }
 
 std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector<int64_t> &phonemeIds,
@@ -415,61 +611,88 @@ std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector
              std::optional<int64_t> sid,
              float noiseScale,
              float lengthScale,
-             float noiseW)
+             float noiseW,
+             CancelToken *cancel)
 {
   auto memoryInfo = Ort::MemoryInfo::CreateCpu(
       OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
 
-  // Allocate
-  std::vector<int64_t> phonemeIdLengths{(int64_t)phonemeIds.size()};
-  std::vector<float> scales{noiseScale,
-                            lengthScale,
-                            noiseW};
-
-  std::vector<Ort::Value> inputTensors;
-  std::vector<int64_t> phonemeIdsShape{1, (int64_t)phonemeIds.size()};
-  inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
-      memoryInfo, (int64_t*)phonemeIds.data(), phonemeIds.size(), phonemeIdsShape.data(),
-      phonemeIdsShape.size()));
+  // Pad up to the shape bucket. input_lengths keeps the real length, so the
+  // padding is masked out and gets no duration: z and y_mask come out the
+  // same size as without it and need no trimming. Like the decoder's, the
+  // padded copy is per thread and keeps its capacity.
+  const int64_t length = (int64_t)phonemeIds.size();
+  const int64_t paddedLength = shapeBucket(shapeBuckets, length);
+  thread_local std::vector<int64_t> paddedIds;
+  const std::vector<int64_t> *ids = &phonemeIds;
+  if (paddedLength > length) {
+    paddedIds.assign(phonemeIds.begin(), phonemeIds.end());
+    paddedIds.resize(paddedLength, padId);
+    ids = &paddedIds;
+  }
 
-  std::vector<int64_t> phomemeIdLengthsShape{(int64_t)phonemeIdLengths.size()};
-  inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
+  // Inputs live on the stack; only the tensors' own bookkeeping is allocated
+  std::array<int64_t, 1> phonemeIdLengths{length};
+  std::array<float, 3> scales{noiseScale,
+                              lengthScale,
+                              noiseW};
+
+  std::array<Ort::Value, 4> inputTensors = {Ort::Value(nullptr), Ort::Value(nullptr),
+                                            Ort::Value(nullptr), Ort::Value(nullptr)};
+  std::array<int64_t, 2> phonemeIdsShape{1, paddedLength};
+  inputTensors[0] = Ort::Value::CreateTensor<int64_t>(
+      memoryInfo, (int64_t*)ids->data(), ids->size(), phonemeIdsShape.data(),
+      phonemeIdsShape.size());
+
+  std::array<int64_t, 1> phomemeIdLengthsShape{(int64_t)phonemeIdLengths.size()};
+  inputTensors[1] = Ort::Value::CreateTensor<int64_t>(
       memoryInfo, phonemeIdLengths.data(), phonemeIdLengths.size(),
-      phomemeIdLengthsShape.data(), phomemeIdLengthsShape.size()));
+      phomemeIdLengthsShape.data(), phomemeIdLengthsShape.size());
 
-  std::vector<int64_t> scalesShape{(int64_t)scales.size()};
-  inputTensors.push_back(
+  std::array<int64_t, 1> scalesShape{(int64_t)scales.size()};
+  inputTensors[2] =
       Ort::Value::CreateTensor<float>(memoryInfo, scales.data(), scales.size(),
-                                      scalesShape.data(), scalesShape.size()));
+                                      scalesShape.data(), scalesShape.size());
 
   // Add speaker id.
   // NOTE: These must be kept outside the "if" below to avoid being deallocated.
-  std::vector<int64_t> speakerId{sid.value_or(0)};
-  std::vector<int64_t> speakerIdShape{(int64_t)speakerId.size()};
+  std::array<int64_t, 1> speakerId{sid.value_or(0)};
+  std::array<int64_t, 1> speakerIdShape{(int64_t)speakerId.size()};
 
+  size_t inputCount = 3;
   if (sid.has_value()) {
-    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
+    inputTensors[inputCount++] = Ort::Value::CreateTensor<int64_t>(
         memoryInfo, speakerId.data(), speakerId.size(), speakerIdShape.data(),
-        speakerIdShape.size()));
+        speakerIdShape.size());
   }
 
   // From export_onnx.py
   std::array<const char *, 4> inputNames = {"input", "input_lengths", "scales",
                                             "sid"};
 
-  std::vector<std::string> outputNames;
-  for (size_t i=0;i<onnx.GetOutputCount();i++)
-    outputNames.push_back(onnx.GetOutputNameAllocated(i, allocator).get());
   // TODO: Just use all outputs
-  std::vector<const char*> outputNamePtrs;
+  std::array<const char *, 8> outputNamePtrs{};
+  if (outputNames.size() > outputNamePtrs.size())
+    throw std::runtime_error("Encoder has too many outputs");
   for(size_t i=0;i<outputNames.size();i++)
-    outputNamePtrs.push_back(outputNames[i].c_str());
+    outputNamePtrs[i] = outputNames[i].c_str();
 
   // Infer
   auto startTime = std::chrono::steady_clock::now();
-  auto outputTensors = onnx.Run(
-      Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
-      inputTensors.size(), outputNamePtrs.data(), outputNamePtrs.size());
+  Ort::RunOptions runOptions;
+  std::vector<Ort::Value> outputTensors;
+  {
+    auto scope = CancelToken::interruptWith(cancel, [&]() { runOptions.SetTerminate(); });
+    try {
+      outputTensors = onnx.Run(
+          runOptions, inputNames.data(), inputTensors.data(),
+          inputCount, outputNamePtrs.data(), outputNames.size());
+    } catch (const Ort::Exception &) {
+      if (cancel && cancel->cancelled())
+        throw CancelledError();
+      throw;
+    }
+  }
   auto endTime = std::chrono::steady_clock::now();
 
   if(outputTensors.size() != outputNames.size())
@@ -491,24 +714,197 @@ std::map<std::string, xt::xarray<float>> EncoderInferer::infer(const std::vector
   for (std::size_t i = 0; i < outputTensors.size(); i++) {
     Ort::detail::OrtRelease(outputTensors[i].release());
   }
-  for (std::size_t i = 0; i < inputTensors.size(); i++) {
+  for (std::size_t i = 0; i < inputCount; i++) {
     Ort::detail::OrtRelease(inputTensors[i].release());
   }
 
-  spdlog::debug("Encoder inference took {} seconds", inferSeconds);
+  spdlog::debug("Encoder inference took {} seconds ({} ids, padded to {})",
+                inferSeconds, length, paddedLength);
   return output;
 }
 
+void EncoderInferer::warmUp()
+{
+  // A model with more than input, input_lengths and scales takes a speaker id
+  std::optional<int64_t> sid;
+  if (onnx.GetInputCount() > 3)
+    sid = 0;
+  for (auto bucket : shapeBuckets) {
+    std::vector<int64_t> ids(bucket, padId);
+    infer(ids, bucket, sid, 0.667f, 1.0f, 0.8f);
+  }
+}
+
 // ----------------------------------------------------------------------------
 
+// One schedulable unit of synthesis, held for the duration of an inference
+// call. Waiting for the gate is a preemption point, so cancellation is
+// checked again once the unit is let in.
+struct UnitScope {
+  UnitGate *gate;
+  size_t samples = 0;
+
+  UnitScope(UnitGate *gate, CancelToken *cancel) : gate(gate) {
+    if (gate)
+      gate->enter();
+    if (cancel && cancel->cancelled()) {
+      if (gate)
+        gate->leave(0);
+      throw CancelledError();
+    }
+  }
+  ~UnitScope() {
+    if (gate)
+      gate->leave(samples);
+  }
+};
+
+// Whether the '.' at text[i] ends a sentence rather than an abbreviation or
+// a list number. Doubtful cases are left uncut, so eSpeak sees the text
+// around them together and its own clause handling decides, as it would
+// without splitting.
+static bool endsSentence(const std::string &text, std::size_t i) {
+  std::size_t next = text.find_first_not_of(" \t\r\n", i + 1);
+  if (next != std::string::npos) {
+    unsigned char c = text[next];
+    // "e.g. this", "approx. 3"
+    if (std::islower(c) || std::isdigit(c))
+      return false;
+  }
+  std::size_t start = text.find_last_of(" \t\r\n", i);
+  start = start == std::string::npos ? 0 : start + 1;
+  std::string_view word(text.data() + start, i - start);
+  if (word.empty())
+    return true;
+  // "e.g.", "U.S."
+  if (word.find('.') != std::string_view::npos)
+    return false;
+  // "Dr.", "Mr.", "St.", and initials
+  if (word.size() <= 3 && std::isupper((unsigned char)word[0]) &&
+      std::all_of(word.begin(), word.end(),
+                  [](unsigned char c) { return std::isalpha(c); }))
+    return false;
+  // "3." at the start of a line
+  bool lineStart = start == 0 || text[start - 1] == '\n';
+  if (lineStart && std::all_of(word.begin(), word.end(), [](unsigned char c) {
+        return std::isdigit(c);
+      }))
+    return false;
+  return true;
+}
+
+// Split text after sentence-ending punctuation and at blank lines, so it can
+// be phonemized one sentence at a time. A '.' is only cut after when it
+// looks like the end of a sentence (see endsSentence).
+static std::vector<std::string> splitSentences(const std::string &text) {
+  std::vector<std::string> pieces;
+  std::size_t start = 0;
+  auto cut = [&](std::size_t end) {
+    // Whitespace alone would come out as an empty sentence plus its silence
+    if (text.find_first_not_of(" \t\r\n", start) < end) {
+      pieces.push_back(text.substr(start, end - start));
+    }
+    start = end;
+  };
+  for (std::size_t i = 0; i + 1 < text.size(); i++) {
+    char c = text[i];
+    char next = text[i + 1];
+    bool space = next == ' ' || next == '\t' || next == '\r' || next == '\n';
+    if (((c == '!' || c == '?') && space) ||
+        (c == '.' && space && endsSentence(text, i)) ||
+        (c == '\n' && next == '\n')) {
+      cut(i + 1);
+    }
+  }
+  cut(text.size());
+  return pieces;
+}
+
+// Split phrases longer than maxPhonemes, preferably after the last clause
+// punctuation that fits, else at the last word boundary, else anywhere. The
+// pieces are spoken without extra silence in between; the last one keeps the
+// phrase's own silence. `scratch` is swapped with `phrases`.
+static void splitLongPhrases(const std::vector<Phoneme> &phonemes,
+                             std::vector<SynthesisBuffers::Phrase> &phrases,
+                             std::vector<SynthesisBuffers::Phrase> &scratch,
+                             std::size_t maxPhonemes) {
+  if (maxPhonemes == 0) {
+    return;
+  }
+
+  scratch.clear();
+  for (const auto &phrase : phrases) {
+    std::size_t start = phrase.begin;
+    while (phrase.end - start > maxPhonemes) {
+      // Cut right after a clause, but not so early that the piece is tiny
+      std::size_t cut = 0;
+      std::size_t space = 0;
+      for (std::size_t j = start + maxPhonemes / 4; j < start + maxPhonemes;
+           j++) {
+        if (phonemes[j] == U',' || phonemes[j] == U';' || phonemes[j] == U':') {
+          cut = j + 1;
+        } else if (phonemes[j] == U' ') {
+          space = j + 1;
+        }
+      }
+      if (cut == 0) {
+        cut = space != 0 ? space : start + maxPhonemes;
+      }
+      scratch.push_back({start, cut, 0});
+      start = cut;
+    }
+    scratch.push_back({start, phrase.end, phrase.silenceSamples});
+  }
+
+  if (scratch.size() > phrases.size()) {
+    spdlog::debug("Split {} phrase(s) into {} of at most {} phonemes",
+                  phrases.size(), scratch.size(), maxPhonemes);
+  }
+  phrases.swap(scratch);
+}
+
 // Phonemize text and synthesize audio
-void textToAudio(PiperConfig &config, Voice &voice, std::string text,
-                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                 const std::function<void()> &audioCallback,
+void textToAudio(PiperConfig &config, Voice &voice, SynthesisInput input,
+                 SynthesisResult &result, const AudioCallback &audioCallback,
                  std::optional<size_t> speakerId,
                  std::optional<float> noiseScale,
                  std::optional<float> lengthScale,
-                 std::optional<float> noiseW) {
+                 std::optional<float> noiseW,
+                 SynthesisControl *control,
+                 SynthesisBuffers *scratch,
+                 const DurationCallback &durationCallback) {
+
+  CancelToken *cancel = control ? control->cancel : nullptr;
+  UnitGate *gate = control ? control->gate : nullptr;
+  SynthesisBuffers localBuffers;
+  SynthesisBuffers &buffers = scratch ? *scratch : localBuffers;
+  std::vector<float> &audioBuffer = buffers.audio;
+  audioBuffer.clear();
+
+  // Samples at the end of each decoder window that the next one crossfades
+  // into, so they are held back from the callback until it arrives
+  constexpr std::size_t compare_window = 24;
+
+  // Hand all of audioBuffer but its last `hold` samples to the callback, then
+  // move those to the front for the next window to crossfade into
+  std::size_t sentenceIdx = 0;
+  std::size_t emittedSamples = 0;
+  auto emit = [&](std::size_t hold, bool sentenceEnd) {
+    if (audioBuffer.size() <= hold && !sentenceEnd)
+      return;
+    hold = std::min(hold, audioBuffer.size());
+    AudioChunk chunk;
+    chunk.samples = std::span<const float>(audioBuffer.data(),
+                                             audioBuffer.size() - hold);
+    chunk.offset = emittedSamples;
+    chunk.sentence = sentenceIdx;
+    chunk.sentenceEnd = sentenceEnd;
+    if (audioCallback)
+      audioCallback(chunk);
+    emittedSamples += chunk.samples.size();
+    std::copy(audioBuffer.end() - hold, audioBuffer.end(), audioBuffer.begin());
+    audioBuffer.resize(hold);
+  };
 
   std::size_t sentenceSilenceSamples = 0;
   if (voice.synthesisConfig.sentenceSilenceSeconds > 0) {
@@ -517,40 +913,149 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
         voice.synthesisConfig.sampleRate * voice.synthesisConfig.channels);
   }
 
-  if (config.useTashkeel) {
-    if (!config.tashkeelState) {
-      throw std::runtime_error("Tashkeel model is not loaded");
-    }
-
-    spdlog::debug("Diacritizing text with libtashkeel: {}", text);
-    text = tashkeel::tashkeel_run(text, *config.tashkeelState);
+  const bool phonemizeText = !input.phonemes && !input.phonemeIds;
+  if (phonemizeText && config.useTashkeel && !config.tashkeel) {
+    throw std::runtime_error("Tashkeel model is not loaded");
   }
 
-  // Phonemes for each sentence
-  spdlog::debug("Phonemizing text: {}", text);
-  std::vector<std::vector<Phoneme>> phonemes;
-
-  if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes) {
-    // Use espeak-ng for phonemization
-    static std::mutex espeakMutex; // espak-ng is not thread-safe
-    std::lock_guard<std::mutex> lock(espeakMutex);
-    eSpeakPhonemeConfig eSpeakConfig;
-    eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
-    phonemize_eSpeak(text, eSpeakConfig, phonemes);
+  // Sentences are phonemized lazily, one piece of text at a time, right
+  // before they are needed. The first audio of a long text then waits only
+  // for its first sentence, and the eSpeak lock is held for one sentence at a
+  // time. Codepoint phonemization is cheap and takes the text as a whole.
+  std::vector<std::string> pieces;
+  std::deque<std::vector<Phoneme>> phonemes;
+  std::deque<std::vector<PhonemeId>> idSentences;
+  if (input.phonemeIds) {
+    for (auto &ids : *input.phonemeIds) {
+      if (!ids.empty()) {
+        idSentences.push_back(std::move(ids));
+      }
+    }
+  } else if (input.phonemes) {
+    std::vector<Phoneme> all;
+    utf8::utf8to32(input.phonemes->begin(), input.phonemes->end(),
+                   std::back_inserter(all));
+    std::vector<Phoneme> sentence;
+    for (auto phoneme : all) {
+      if (sentence.empty() && (phoneme == U' ' || phoneme == U'\n')) {
+        continue;
+      }
+      sentence.push_back(phoneme == U'\n' ? U' ' : phoneme);
+      if (phoneme == U'.' || phoneme == U'!' || phoneme == U'?') {
+        phonemes.push_back(std::move(sentence));
+        sentence.clear();
+      }
+    }
+    if (!sentence.empty()) {
+      phonemes.push_back(std::move(sentence));
+    }
+  } else if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes) {
+    pieces = splitSentences(input.text);
   } else {
-    // Use UTF-8 codepoints as "phonemes"
-    CodepointsPhonemeConfig codepointsConfig;
-    phonemize_codepoints(text, codepointsConfig, phonemes);
+    pieces.push_back(std::move(input.text));
   }
+  std::size_t nextPiece = 0;
+  bool audioStarted = false;
+
+  auto phonemizePiece = [&](std::string piece) {
+    auto start = std::chrono::steady_clock::now();
+    if (config.useTashkeel) {
+      spdlog::debug("Diacritizing text with libtashkeel: {}", piece);
+      piece = config.tashkeel->run(piece);
+    }
+
+    // Phonemes for each sentence
+    spdlog::debug("Phonemizing text: {}", piece);
+    std::vector<std::vector<Phoneme>> piecePhonemes;
+    if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes) {
+      // Use espeak-ng for phonemization
+      static std::mutex espeakMutex; // espak-ng is not thread-safe
+      std::lock_guard<std::mutex> lock(espeakMutex);
+      eSpeakPhonemeConfig eSpeakConfig;
+      eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
+      phonemize_eSpeak(piece, eSpeakConfig, piecePhonemes);
+    } else {
+      // Use UTF-8 codepoints as "phonemes"
+      CodepointsPhonemeConfig codepointsConfig;
+      phonemize_codepoints(piece, codepointsConfig, piecePhonemes);
+    }
+    for (auto &sentence : piecePhonemes) {
+      phonemes.push_back(std::move(sentence));
+    }
+
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    result.phonemizeSeconds += seconds;
+    if (!audioStarted) {
+      result.firstAudioPhonemizeSeconds += seconds;
+    }
+  };
+
+  // Next sentence to synthesize, phonemizing more text if needed. Sentences
+  // given as ids come back in `ids`, with no phonemes.
+  auto nextSentence = [&](std::vector<Phoneme> &sentence,
+                          std::vector<PhonemeId> &ids) {
+    ids.clear();
+    if (!idSentences.empty()) {
+      sentence.clear();
+      ids.assign(idSentences.front().begin(), idSentences.front().end());
+      idSentences.pop_front();
+      return true;
+    }
+    while (phonemes.empty() && nextPiece < pieces.size()) {
+      if (cancel)
+        cancel->throwIfCancelled();
+      phonemizePiece(std::move(pieces[nextPiece++]));
+    }
+    if (phonemes.empty()) {
+      return false;
+    }
+    // Copied rather than moved, so `sentence` keeps its capacity
+    sentence.assign(phonemes.front().begin(), phonemes.front().end());
+    phonemes.pop_front();
+    return true;
+  };
+
+  // Called once the decoder has produced the first audio
+  auto startAudio = [&]() {
+    if (audioStarted)
+      return;
+    audioStarted = true;
+    spdlog::debug("Phonemization before first audio: {} seconds",
+                  result.firstAudioPhonemizeSeconds);
+  };
+
+  // Use phoneme/id map from config. The pointer aliases the voice's map
+  // (which outlives this call) rather than copying it.
+  PhonemeIdConfig idConfig;
+  idConfig.phonemeIdMap = std::shared_ptr<PhonemeIdMap>(
+      std::shared_ptr<PhonemeIdMap>(), &voice.phonemizeConfig.phonemeIdMap);
 
   // Synthesize each sentence independently.
-  std::vector<PhonemeId> phonemeIds;
+  std::vector<PhonemeId> &phonemeIds = buffers.phonemeIds;
   std::map<Phoneme, std::size_t> missingPhonemes;
-  for (auto phonemesIter = phonemes.begin(); phonemesIter != phonemes.end();
-       ++phonemesIter) {
-    std::vector<Phoneme> &sentencePhonemes = *phonemesIter;
-
-    if (spdlog::should_log(spdlog::level::debug)) {
+  std::vector<Phoneme> &sentencePhonemes = buffers.sentencePhonemes;
+  std::vector<PhonemeId> &sentenceIds = buffers.sentenceIds;
+  std::vector<SynthesisBuffers::Phrase> &phrases = buffers.phrases;
+
+  // Decoder output per encoder frame
+  constexpr std::size_t samplesPerFrame = 256;
+
+  // A phrase through the encoder, waiting for the decoder
+  struct EncodedPhrase {
+    std::map<std::string, xt::xarray<float>> params;
+    std::size_t frames = 0;
+    std::size_t silenceSamples = 0;
+    std::size_t index = 0; // within its sentence
+    std::chrono::steady_clock::time_point encodeStart;
+    double encodeSeconds = 0;
+  };
+
+  // phonemes -> ids -> encoder output, for each phrase of the current
+  // sentence
+  auto encodeSentence = [&](const std::function<void(EncodedPhrase &)> &onPhrase) {
+    if (sentenceIds.empty() && spdlog::should_log(spdlog::level::debug)) {
       // DEBUG log for phonemes
       std::string phonemesStr;
       for (auto phoneme : sentencePhonemes) {
@@ -561,64 +1066,54 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                     sentencePhonemes.size(), phonemesStr);
     }
 
-    std::vector<std::shared_ptr<std::vector<Phoneme>>> phrasePhonemes;
-    std::vector<SynthesisResult> phraseResults;
-    std::vector<size_t> phraseSilenceSamples;
-
-    // Use phoneme/id map from config
-    PhonemeIdConfig idConfig;
-    idConfig.phonemeIdMap =
-        std::make_shared<PhonemeIdMap>(voice.phonemizeConfig.phonemeIdMap);
-
-    if (voice.synthesisConfig.phonemeSilenceSeconds) {
-      // Split into phrases
-      std::map<Phoneme, float> &phonemeSilenceSeconds =
-          *voice.synthesisConfig.phonemeSilenceSeconds;
-
-      auto currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-      phrasePhonemes.push_back(currentPhrasePhonemes);
-
-      for (auto sentencePhonemesIter = sentencePhonemes.begin();
-           sentencePhonemesIter != sentencePhonemes.end();
-           sentencePhonemesIter++) {
-        Phoneme &currentPhoneme = *sentencePhonemesIter;
-        currentPhrasePhonemes->push_back(currentPhoneme);
-
-        if (phonemeSilenceSeconds.count(currentPhoneme) > 0) {
-          // Split at phrase boundary
-          phraseSilenceSamples.push_back(
-              (std::size_t)(phonemeSilenceSeconds[currentPhoneme] *
-                            voice.synthesisConfig.sampleRate *
-                            voice.synthesisConfig.channels));
-
-          currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-          phrasePhonemes.push_back(currentPhrasePhonemes);
+    phrases.clear();
+    if (!sentenceIds.empty()) {
+      // Ids from the caller are one phrase, as given
+      phrases.emplace_back();
+    } else {
+      SynthesisBuffers::Phrase phrase;
+      if (voice.synthesisConfig.phonemeSilenceSeconds) {
+        // Split into phrases
+        std::map<Phoneme, float> &phonemeSilenceSeconds =
+            *voice.synthesisConfig.phonemeSilenceSeconds;
+
+        for (std::size_t i = 0; i < sentencePhonemes.size(); i++) {
+          auto silence = phonemeSilenceSeconds.find(sentencePhonemes[i]);
+          if (silence != phonemeSilenceSeconds.end()) {
+            // Split at phrase boundary
+            phrase.end = i + 1;
+            phrase.silenceSamples =
+                (std::size_t)(silence->second *
+                              voice.synthesisConfig.sampleRate *
+                              voice.synthesisConfig.channels);
+            phrases.push_back(phrase);
+            phrase = {i + 1, i + 1, 0};
+          }
         }
       }
-    } else {
-      // Use all phonemes
-      phrasePhonemes.push_back(
-          std::make_shared<std::vector<Phoneme>>(sentencePhonemes));
-    }
-
-    // Ensure results/samples are the same size
-    while (phraseResults.size() < phrasePhonemes.size()) {
-      phraseResults.emplace_back();
+      // The rest (or all) of the sentence
+      phrase.end = sentencePhonemes.size();
+      phrases.push_back(phrase);
     }
 
-    while (phraseSilenceSamples.size() < phrasePhonemes.size()) {
-      phraseSilenceSamples.push_back(0);
+    if (voice.synthesisConfig.maxPhrasePhonemes) {
+      splitLongPhrases(sentencePhonemes, phrases, buffers.splitPhrases,
+                       *voice.synthesisConfig.maxPhrasePhonemes);
     }
 
-    // phonemes -> ids -> audio
-    for (size_t phraseIdx = 0; phraseIdx < phrasePhonemes.size(); phraseIdx++) {
-      if (phrasePhonemes[phraseIdx]->size() <= 0) {
+    for (size_t phraseIdx = 0; phraseIdx < phrases.size(); phraseIdx++) {
+      const auto &phrase = phrases[phraseIdx];
+      if (!sentenceIds.empty()) {
+        phonemeIds.assign(sentenceIds.begin(), sentenceIds.end());
+      } else if (phrase.end <= phrase.begin) {
         continue;
+      } else {
+        // phonemes -> ids
+        buffers.phrasePhonemes.assign(sentencePhonemes.begin() + phrase.begin,
+                                      sentencePhonemes.begin() + phrase.end);
+        phonemes_to_ids(buffers.phrasePhonemes, idConfig, phonemeIds,
+                        missingPhonemes);
       }
-
-      // phonemes -> ids
-      phonemes_to_ids(*(phrasePhonemes[phraseIdx]), idConfig, phonemeIds,
-                      missingPhonemes);
       if (spdlog::should_log(spdlog::level::debug)) {
         // DEBUG log for phoneme ids
         std::stringstream phonemeIdsStr;
@@ -627,149 +1122,211 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
         }
 
         spdlog::debug("Converted {} phoneme(s) to {} phoneme id(s): {}",
-                      phrasePhonemes[phraseIdx]->size(), phonemeIds.size(),
+                      phrase.end - phrase.begin, phonemeIds.size(),
                       phonemeIdsStr.str());
       }
 
-      // ids -> audio
-      auto encode_start = std::chrono::steady_clock::now();
+      // ids -> encoder output
+      if (cancel)
+        cancel->throwIfCancelled();
+      EncodedPhrase encoded;
+      encoded.silenceSamples = phrase.silenceSamples;
+      encoded.index = phraseIdx;
+      encoded.encodeStart = std::chrono::steady_clock::now();
       std::optional<size_t> sid = speakerId;
       if(!sid && voice.synthesisConfig.speakerId)
         sid = voice.synthesisConfig.speakerId;
-      auto params = voice.encoder.infer(phonemeIds, phrasePhonemes[phraseIdx]->size(),
-                          sid,
-                          noiseScale.value_or(voice.synthesisConfig.noiseScale),
-                          lengthScale.value_or(voice.synthesisConfig.lengthScale),
-                          noiseW.value_or(voice.synthesisConfig.noiseW));
-      auto encode_end = std::chrono::steady_clock::now();
-      float encode_seconds = std::chrono::duration<double>(encode_end - encode_start).count();
-      std::optional<xt::xarray<float>> g;
-      if(params.count("g"))
-        g = std::move(params["g"]);
-      auto& y_mask = params["y_mask"];
-      auto& z = params["z"];
-
-      size_t nslices = z.shape()[2];
-      if(nslices != y_mask.shape()[2])
+      {
+        UnitScope unit(gate, cancel);
+        encoded.params = voice.encoder.infer(phonemeIds, phonemeIds.size(),
+                            sid,
+                            noiseScale.value_or(voice.synthesisConfig.noiseScale),
+                            lengthScale.value_or(voice.synthesisConfig.lengthScale),
+                            noiseW.value_or(voice.synthesisConfig.noiseW),
+                            cancel);
+      }
+      encoded.encodeSeconds = std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - encoded.encodeStart)
+                                  .count();
+      encoded.frames = encoded.params["z"].shape()[2];
+      if(encoded.frames != encoded.params["y_mask"].shape()[2])
         throw std::runtime_error("z and y_mask must have the same number of slices");
 
-      const size_t chunkSize = 45;
-      const size_t padding = 5;
+      onPhrase(encoded);
 
-      float audioSeconds = 0;
-      float inferSeconds = encode_seconds;
+      phonemeIds.clear();
+    }
 
-      // Too small to chunk, just pass it through
-      if(nslices < chunkSize + padding * 2) {
-          auto t0 = std::chrono::steady_clock::now();
-          audioBuffer = voice.decoder->infer(z, y_mask, g);
-          auto t1 = std::chrono::steady_clock::now();
-          inferSeconds += std::chrono::duration<double>(t1 - t0).count();
-          audioSeconds = (double)audioBuffer.size() / (double)voice.synthesisConfig.sampleRate;
-      }
-      else {
-        for(size_t i=0,idx=0;i<nslices;i+=chunkSize,idx++) {
-          size_t start = i > padding ? i - padding : 0;
-          size_t end = std::min(nslices, i + chunkSize + padding);
-          auto z_chunk = xt::view(z, xt::all(), xt::all(), xt::range(start, end));
-          auto y_mask_chunk = xt::view(y_mask, xt::all(), xt::all(), xt::range(start, end));
-
-          auto t0 = std::chrono::steady_clock::now();
-          auto chunk_audio = voice.decoder->infer(z_chunk, y_mask_chunk, g);
-          auto t1 = std::chrono::steady_clock::now();
-
-          auto real_start = chunk_audio.begin() + (i - start) * 256;
-          auto end_pad = padding;
-          if(i+chunkSize >= nslices)
-            end_pad = 0;
-          else if(i+chunkSize+padding >= nslices)
-            end_pad = nslices - (i+chunkSize);
-
-          // HACK: compare the end of the previous chunk and the start of the next chunk to determine the best
-          // place to stitch them together
-          // This is 99% good. Still get pops rarely.
-          constexpr size_t compare_window = 24;
-          constexpr size_t search_window = 44;
-          static_assert(compare_window < search_window, "compare_window must be less than search_window");
-          const bool do_depop = audioBuffer.size() >= compare_window && chunk_audio.size() >= search_window * 2;
-          if(do_depop) {
-            auto prev_chunk_end = audioBuffer.end() - compare_window;
-            auto next_chunk_start = real_start;
-            next_chunk_start -= std::min(std::distance(chunk_audio.begin(), next_chunk_start), (ptrdiff_t)compare_window);
-            size_t min_diff = std::numeric_limits<size_t>::max();
-            // increment by 2 to speed up the search
-            for(size_t j=0;j<search_window*2;j+=2) {
-              size_t diff = 0;
-              for(size_t k=0;k<compare_window;k++)
-                diff += std::abs(prev_chunk_end[k] - next_chunk_start[j+k]);
-              if(diff < min_diff) {
-                min_diff = diff;
-                real_start = next_chunk_start + j + compare_window;
-              }
-            }
-            // average the samples in the compare window to smooth out the transition even more
-            auto prev_base_ptr = audioBuffer.end() - compare_window;
-            auto next_base_ptr = real_start - compare_window;
-            for(size_t j=0;j<compare_window;j++) {
-                float weight = (float)j / (float)compare_window;
-                prev_base_ptr[j] = prev_base_ptr[j] * (1.0f - weight) + next_base_ptr[j] * weight;
+    phonemeIds.clear();
+  };
+
+  // Encoder output -> audio, with the phrase's silence after it
+  auto decodePhrase = [&](EncodedPhrase &encoded) {
+    const std::size_t phraseStart = emittedSamples + audioBuffer.size();
+    std::optional<xt::xarray<float>> g;
+    if(encoded.params.count("g"))
+      g = std::move(encoded.params["g"]);
+    auto& y_mask = encoded.params["y_mask"];
+    auto& z = encoded.params["z"];
+
+    size_t nslices = encoded.frames;
+
+    const size_t chunkSize = 45;
+    const size_t padding = 5;
+
+    float audioSeconds = 0;
+    float inferSeconds = encoded.encodeSeconds;
+    std::vector<float> &windowAudio = buffers.windowAudio;
+
+    // Too small to chunk, just pass it through
+    if(nslices < chunkSize + padding * 2) {
+        auto t0 = std::chrono::steady_clock::now();
+        {
+          UnitScope unit(gate, cancel);
+          voice.decoder->infer(z, y_mask, g, windowAudio, cancel);
+          unit.samples = windowAudio.size();
+        }
+        startAudio();
+        auto t1 = std::chrono::steady_clock::now();
+        audioBuffer.insert(audioBuffer.end(), windowAudio.begin(), windowAudio.end());
+        inferSeconds += std::chrono::duration<double>(t1 - t0).count();
+        audioSeconds = (double)windowAudio.size() / (double)voice.synthesisConfig.sampleRate;
+    }
+    else {
+      for(size_t i=0,idx=0;i<nslices;i+=chunkSize,idx++) {
+        // Chunk boundary: the only place a cancelled request can stop
+        // without an inference call to interrupt
+        if (cancel)
+          cancel->throwIfCancelled();
+        size_t start = i > padding ? i - padding : 0;
+        size_t end = std::min(nslices, i + chunkSize + padding);
+        buffers.zWindow = xt::view(z, xt::all(), xt::all(), xt::range(start, end));
+        buffers.maskWindow = xt::view(y_mask, xt::all(), xt::all(), xt::range(start, end));
+
+        auto t0 = std::chrono::steady_clock::now();
+        {
+          UnitScope unit(gate, cancel);
+          voice.decoder->infer(buffers.zWindow, buffers.maskWindow, g, windowAudio, cancel);
+          unit.samples = (std::min(nslices, i + chunkSize) - i) * samplesPerFrame;
+        }
+        startAudio();
+        auto t1 = std::chrono::steady_clock::now();
+        auto &chunk_audio = windowAudio;
+
+        auto real_start = chunk_audio.begin() + (i - start) * samplesPerFrame;
+        auto end_pad = padding;
+        if(i+chunkSize >= nslices)
+          end_pad = 0;
+        else if(i+chunkSize+padding >= nslices)
+          end_pad = nslices - (i+chunkSize);
+
+        // HACK: compare the end of the previous chunk and the start of the next chunk to determine the best
+        // place to stitch them together
+        // This is 99% good. Still get pops rarely.
+        constexpr size_t search_window = 44;
+        static_assert(compare_window < search_window, "compare_window must be less than search_window");
+        const bool do_depop = audioBuffer.size() >= compare_window && chunk_audio.size() >= search_window * 2;
+        if(do_depop) {
+          auto prev_chunk_end = audioBuffer.end() - compare_window;
+          auto next_chunk_start = real_start;
+          next_chunk_start -= std::min(std::distance(chunk_audio.begin(), next_chunk_start), (ptrdiff_t)compare_window);
+          float min_diff = std::numeric_limits<float>::max();
+          // increment by 2 to speed up the search
+          for(size_t j=0;j<search_window*2;j+=2) {
+            float diff = 0;
+            for(size_t k=0;k<compare_window;k++)
+              diff += std::abs(prev_chunk_end[k] - next_chunk_start[j+k]);
+            if(diff < min_diff) {
+              min_diff = diff;
+              real_start = next_chunk_start + j + compare_window;
             }
           }
-
-          auto real_end = chunk_audio.end() - end_pad * 256;
-          audioBuffer.insert(audioBuffer.end(), real_start, real_end);
-          float chunk_audio_seconds = (double)chunk_audio.size() / (double)voice.synthesisConfig.sampleRate;
-          float chunk_infer_seconds = std::chrono::duration<double>(t1 - t0).count();
-
-          if(audioCallback && audioBuffer.size() > compare_window) {
-            std::vector<int16_t> tmp;
-            tmp.insert(tmp.end(), audioBuffer.end() - compare_window, audioBuffer.end());
-            audioBuffer.resize(audioBuffer.size() - compare_window);
-            audioCallback();
-            audioBuffer.resize(tmp.size());
-            memcpy(audioBuffer.data(), tmp.data(), tmp.size() * sizeof(int16_t));
+          // average the samples in the compare window to smooth out the transition even more
+          auto prev_base_ptr = audioBuffer.end() - compare_window;
+          auto next_base_ptr = real_start - compare_window;
+          for(size_t j=0;j<compare_window;j++) {
+              float weight = (float)j / (float)compare_window;
+              prev_base_ptr[j] = prev_base_ptr[j] * (1.0f - weight) + next_base_ptr[j] * weight;
           }
+        }
 
-          audioSeconds += chunk_audio_seconds;
-          inferSeconds += chunk_infer_seconds;
-          auto rtf = chunk_infer_seconds / chunk_audio_seconds;
-          spdlog::debug("Chunk {} took {} seconds, RTF: {}", idx, std::chrono::duration<double>(t1 - t0).count(), rtf);
+        auto real_end = chunk_audio.end() - end_pad * samplesPerFrame;
+        audioBuffer.insert(audioBuffer.end(), real_start, real_end);
+        float chunk_audio_seconds = (double)chunk_audio.size() / (double)voice.synthesisConfig.sampleRate;
+        float chunk_infer_seconds = std::chrono::duration<double>(t1 - t0).count();
 
-          if(i == 0 && phraseIdx == 0) {
-            auto t = std::chrono::steady_clock::now();
-            auto first_chunk_duration = std::chrono::duration<double>(t - encode_start).count();
-            spdlog::debug("First chunk latency: {} seconds", first_chunk_duration);
-          }
+        emit(compare_window, false);
+
+        audioSeconds += chunk_audio_seconds;
+        inferSeconds += chunk_infer_seconds;
+        auto rtf = chunk_infer_seconds / chunk_audio_seconds;
+        spdlog::debug("Chunk {} took {} seconds, RTF: {}", idx, std::chrono::duration<double>(t1 - t0).count(), rtf);
+
+        if(i == 0 && encoded.index == 0) {
+          auto t = std::chrono::steady_clock::now();
+          auto first_chunk_duration = std::chrono::duration<double>(t - encoded.encodeStart).count();
+          spdlog::debug("First chunk latency: {} seconds", first_chunk_duration);
         }
-        phraseResults[phraseIdx].audioSeconds = audioSeconds;
-        phraseResults[phraseIdx].inferSeconds = inferSeconds;
       }
+    }
 
-      // Add end of phrase silence
-      for (std::size_t i = 0; i < phraseSilenceSamples[phraseIdx]; i++) {
-        audioBuffer.push_back(0);
+    if (durationCallback) {
+      // Stitching skips a few samples at each window seam. Make them up
+      // with silence, so the phrase is as long as was predicted.
+      std::size_t produced = emittedSamples + audioBuffer.size() - phraseStart;
+      std::size_t expected = nslices * samplesPerFrame;
+      if (produced < expected) {
+        audioBuffer.insert(audioBuffer.end(), expected - produced, 0);
+      } else {
+        audioBuffer.resize(audioBuffer.size() -
+                           std::min(produced - expected, audioBuffer.size()));
       }
+    }
 
-      result.audioSeconds += phraseResults[phraseIdx].audioSeconds;
-      result.inferSeconds += phraseResults[phraseIdx].inferSeconds;
+    // Add end of phrase silence
+    audioBuffer.insert(audioBuffer.end(), encoded.silenceSamples, 0);
+    emit(compare_window, false);
 
-      phonemeIds.clear();
-    }
+    result.audioSeconds += audioSeconds;
+    result.inferSeconds += inferSeconds;
+  };
 
+  auto endSentence = [&]() {
     // Add end of sentence silence
-    if (sentenceSilenceSamples > 0) {
-      for (std::size_t i = 0; i < sentenceSilenceSamples; i++) {
-        audioBuffer.push_back(0);
-      }
-    }
+    audioBuffer.insert(audioBuffer.end(), sentenceSilenceSamples, 0);
 
-    if (audioCallback) {
-      // Call back must copy audio since it is cleared afterwards.
-      audioCallback();
-      audioBuffer.clear();
+    emit(0, true);
+    sentenceIdx++;
+  };
+
+  if (!durationCallback) {
+    // Each phrase is decoded as soon as it is encoded
+    while (nextSentence(sentencePhonemes, sentenceIds)) {
+      encodeSentence(decodePhrase);
+      endSentence();
+    }
+  } else {
+    // Encode all of the input first: the encoder's frame counts fix the
+    // length of everything the decoder will produce
+    std::vector<std::vector<EncodedPhrase>> sentences;
+    std::size_t totalSamples = 0;
+    while (nextSentence(sentencePhonemes, sentenceIds)) {
+      auto &encodedPhrases = sentences.emplace_back();
+      encodeSentence([&](EncodedPhrase &encoded) {
+        totalSamples += encoded.frames * samplesPerFrame + encoded.silenceSamples;
+        encodedPhrases.push_back(std::move(encoded));
+      });
+      totalSamples += sentenceSilenceSamples;
     }
+    durationCallback(totalSamples);
 
-    phonemeIds.clear();
+    for (auto &encodedPhrases : sentences) {
+      for (auto &encoded : encodedPhrases) {
+        decodePhrase(encoded);
+        encoded.params.clear();
+      }
+      endSentence();
+    }
   }
 
   if (missingPhonemes.size() > 0) {
@@ -791,25 +1348,28 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
 } /* textToAudio */
 
 // Phonemize text and synthesize audio to WAV file
-void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
+void textToWavFile(PiperConfig &config, Voice &voice, SynthesisInput input,
                    std::ostream &audioFile, SynthesisResult &result,
                    std::optional<size_t> speakerId,
                    std::optional<float> noiseScale,
                    std::optional<float> lengthScale,
-                   std::optional<float> noiseW) {
+                   std::optional<float> noiseW,
+                   SynthesisControl *control) {
 
-  std::vector<int16_t> audioBuffer;
-  textToAudio(config, voice, text, audioBuffer, result, NULL, noiseScale,
-              lengthScale, noiseW);
-
-  // Write WAV
   auto synthesisConfig = voice.synthesisConfig;
-  writeWavHeader(synthesisConfig.sampleRate, synthesisConfig.sampleWidth,
-                 synthesisConfig.channels, (int32_t)audioBuffer.size(),
-                 audioFile);
-
-  audioFile.write((const char *)audioBuffer.data(),
-                  sizeof(int16_t) * audioBuffer.size());
+  std::vector<int16_t> pcm;
+  textToAudio(
+      config, voice, std::move(input), result,
+      [&](const AudioChunk &chunk) {
+        pcm.resize(chunk.samples.size());
+        audioToPcm16(chunk.samples, pcm.data());
+        audioFile.write((const char *)pcm.data(), sizeof(int16_t) * pcm.size());
+      },
+      speakerId, noiseScale, lengthScale, noiseW, control, nullptr,
+      [&](std::size_t samples) {
+        writeWavHeader(synthesisConfig.sampleRate, synthesisConfig.sampleWidth,
+                       synthesisConfig.channels, (int32_t)samples, audioFile);
+      });
 
 } /* textToWavFile */
 
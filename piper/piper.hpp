@@ -1,10 +1,16 @@
 #pragma once
 
+#include <condition_variable>
 #include <fstream>
 #include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "inferer.hpp"
@@ -28,13 +34,54 @@ struct eSpeakConfig {
   std::string voice = "en-us";
 };
 
+// Arabic diacritization with libtashkeel, safe to call from any number of
+// threads. Each call checks out its own model state, loading up to
+// `maxStates` of them on demand, so concurrent requests do not serialize on
+// (or race over) one session. Results are cached per sentence (LRU).
+class TashkeelPool {
+public:
+  TashkeelPool(std::string modelPath, std::size_t maxStates,
+               std::size_t cacheSize);
+
+  std::string run(const std::string &text);
+
+private:
+  std::unique_ptr<tashkeel::State> acquire();
+  void release(std::unique_ptr<tashkeel::State> state);
+
+  std::string modelPath_;
+  std::size_t maxStates_;
+  std::size_t cacheSize_;
+
+  std::mutex mutex_;
+  std::condition_variable available_;
+  std::vector<std::unique_ptr<tashkeel::State>> idle_;
+  std::size_t loaded_ = 0;
+
+  // Most recently used first
+  std::list<std::pair<std::string, std::string>> cache_;
+  std::unordered_map<std::string, decltype(cache_)::iterator> cacheIndex_;
+};
+
 struct PiperConfig {
   std::string eSpeakDataPath;
   bool useESpeak = true;
 
   bool useTashkeel = false;
   std::optional<std::string> tashkeelModelPath;
-  std::unique_ptr<tashkeel::State> tashkeelState;
+  // Diacritizations that may run at once, each with its own model state
+  std::size_t tashkeelStates = 1;
+  // Diacritized sentences kept for reuse; 0 disables the cache
+  std::size_t tashkeelCacheSize = 1024;
+  std::unique_ptr<TashkeelPool> tashkeel;
+
+  // Sizes the ONNX inputs are padded up to (sorted; empty disables padding):
+  // phoneme ids per encoder call, and frames per decoder window. With only a
+  // few distinct shapes, onnxruntime plans memory once per bucket instead of
+  // once per call. 55 frames is textToAudio's full decoder window, so every
+  // window fits it.
+  std::vector<int64_t> encoderShapeBuckets = {64, 128, 256, 512};
+  std::vector<int64_t> decoderShapeBuckets = {55};
 };
 
 enum PhonemeType { eSpeakPhonemes, TextPhonemes };
@@ -69,6 +116,11 @@ struct SynthesisConfig {
   // Extra silence
   float sentenceSilenceSeconds = 0.2f;
   std::optional<std::map<piper::Phoneme, float>> phonemeSilenceSeconds;
+
+  // Longest phrase passed to the encoder in one call. Longer phrases are
+  // split at clause punctuation, else at a word boundary, so encoder time
+  // per call (and the wait for the first audio) stays bounded.
+  std::optional<std::size_t> maxPhrasePhonemes;
 };
 
 struct ModelConfig {
@@ -89,8 +141,18 @@ struct EncoderInferer {
              std::optional<int64_t> sid,
              float noiseScale,
              float lengthScale,
-             float noiseW);
+             float noiseW,
+             CancelToken *cancel = nullptr);
   virtual void load(std::string modelPath, std::string accelerator="");
+  // Run once per shape bucket
+  void warmUp();
+
+  // See PiperConfig::encoderShapeBuckets
+  std::vector<int64_t> shapeBuckets;
+  PhonemeId padId = 0;
+
+  // Looked up once at load rather than on every call
+  std::vector<std::string> outputNames;
 
   EncoderInferer() : onnx(nullptr){};
 };
@@ -101,8 +163,12 @@ struct OnnxDecoderInferer : DecoderInferer {
   Ort::SessionOptions options;
   Ort::Env env;
 
-  std::vector<int16_t> infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g) override;
+  void infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& audio, CancelToken* cancel = nullptr) override;
   void load(std::string modelPath, std::string accelerator) override;
+  void warmUp() override;
+
+  // See PiperConfig::decoderShapeBuckets
+  std::vector<int64_t> shapeBuckets;
 
   OnnxDecoderInferer() : onnx(nullptr){};
 };
@@ -111,6 +177,9 @@ struct SynthesisResult {
   double inferSeconds;
   double audioSeconds;
   double realTimeFactor;
+  double phonemizeSeconds = 0;
+  // Part of phonemizeSeconds spent before the first audio was decoded
+  double firstAudioPhonemizeSeconds = 0;
 };
 
 struct Voice {
@@ -132,34 +201,134 @@ Phoneme getCodepoint(std::string s);
 // Get version of Piper
 std::string getVersion();
 
+// Smallest bucket that holds `size`, or `size` itself if none does
+int64_t shapeBucket(const std::vector<int64_t> &buckets, int64_t size);
+
+// Scale synthesized audio by `gain`, clip it to [-1, 1] and convert it to
+// 16-bit or float samples in a single pass. `out` holds audio.size() samples.
+void audioToPcm16(std::span<const float> audio, int16_t *out,
+                  float gain = 1.0f);
+void audioToPcmF32(std::span<const float> audio, float *out,
+                   float gain = 1.0f);
+
+// Parse "64,128,256" (or "none") into sorted shape buckets; empty items are
+// skipped and anything else that is not a number throws runtime_error
+std::vector<int64_t> parseShapeBuckets(const std::string &spec);
+
 // Must be called before using textTo* functions
 void initialize(PiperConfig &config);
 
 // Clean up
 void terminate(PiperConfig &config);
 
+// What to synthesize. Text is phonemized with eSpeak or as codepoints,
+// depending on the voice; phonemes and phoneme ids skip that stage (and the
+// eSpeak lock), e.g. when they were cached from an earlier run.
+struct SynthesisInput {
+  SynthesisInput() = default;
+  SynthesisInput(std::string text) : text(std::move(text)) {}
+  SynthesisInput(const char *text) : text(text) {}
+
+  std::string text;
+
+  // IPA, one codepoint per phoneme; a sentence ends after . ! or ?
+  std::optional<std::string> phonemes;
+
+  // Encoder input, one list per sentence, including BOS/EOS and padding
+  std::optional<std::vector<std::vector<PhonemeId>>> phonemeIds;
+};
+
+// Working memory of textToAudio. Every container keeps its capacity from one
+// sentence and decoder window to the next, and from one request to the next
+// when the same instance is passed again, so steady-state synthesis hardly
+// touches the heap. An instance serves one synthesis at a time.
+struct SynthesisBuffers {
+  // Phonemes [begin, end) of the current sentence, and the samples of
+  // silence after them
+  struct Phrase {
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    std::size_t silenceSamples = 0;
+  };
+
+  std::vector<Phoneme> sentencePhonemes;
+  std::vector<PhonemeId> sentenceIds;
+  std::vector<Phrase> phrases;
+  std::vector<Phrase> splitPhrases;
+  std::vector<Phoneme> phrasePhonemes;
+  std::vector<PhonemeId> phonemeIds;
+
+  // Decoder window in and out
+  xt::xarray<float> zWindow;
+  xt::xarray<float> maskWindow;
+  std::vector<float> windowAudio;
+
+  // Stitched audio not yet handed to the callback. Chunks are spans into it;
+  // only the crossfade tail stays behind, moved to the front after each one.
+  std::vector<float> audio;
+};
+
+// One piece of synthesized audio, as the decoder's float samples (nominally
+// in [-1, 1], not yet clipped). `samples` points into textToAudio's own
+// buffer and is only valid during the callback; copy or convert what must
+// outlive it.
+struct AudioChunk {
+  std::span<const float> samples;
+
+  // Samples of this synthesis passed to earlier chunks
+  std::size_t offset = 0;
+
+  // Sentence the chunk belongs to, and whether it is the last chunk of that
+  // sentence (silence included)
+  std::size_t sentence = 0;
+  bool sentenceEnd = false;
+};
+
+using AudioCallback = std::function<void(const AudioChunk &)>;
+
+// Exact number of samples a synthesis will produce: decoder frames x 256,
+// plus phrase and sentence silences
+using DurationCallback = std::function<void(std::size_t samples)>;
+
 // Load Onnx model and JSON config file
 void loadVoice(PiperConfig &config, std::string modelPath,
                std::string encoderPath, std::string decoderPath,
                std::string modelConfigPath, Voice &voice,
                std::optional<SpeakerId> &speakerId, std::string accelerator);
 
-// Phonemize text and synthesize audio
-void textToAudio(PiperConfig &config, Voice &voice, std::string text,
-                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                 const std::function<void()> &audioCallback,
+// Phonemize text (unless the input is phonemes or ids) and synthesize audio.
+// With `control`: each encoder call and decoder window passes through its
+// gate, and a cancelled token throws CancelledError at the next chunk
+// boundary (or out of the inference call in progress). `scratch` lends
+// working memory kept from earlier calls; without it, temporaries are
+// allocated for this call only. Audio reaches `audioCallback` as soon as a
+// decoder window is stitched, minus a short tail kept for the next window to
+// crossfade into.
+//
+// With `durationCallback`, all of the input is phonemized and encoded before
+// the first phrase is decoded, and the callback learns the total length
+// before any audio. The first audio then waits for every encoder call rather
+// than one, and encoder outputs for the whole input are held meanwhile.
+void textToAudio(PiperConfig &config, Voice &voice, SynthesisInput input,
+                 SynthesisResult &result, const AudioCallback &audioCallback,
                  std::optional<size_t> speakerId = std::nullopt,
                  std::optional<float> noiseScale = std::nullopt,
                  std::optional<float> lengthScale = std::nullopt,
-                 std::optional<float> noiseW = std::nullopt);
-
-// Phonemize text and synthesize audio to WAV file
-void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
+                 std::optional<float> noiseW = std::nullopt,
+                 SynthesisControl *control = nullptr,
+                 SynthesisBuffers *scratch = nullptr,
+                 const DurationCallback &durationCallback = nullptr);
+
+// Phonemize text and synthesize audio to WAV file. The header, with the
+// predicted length, goes out first and audio follows as it is synthesized,
+// so `audioFile` need not be seekable.
+void textToWavFile(PiperConfig &config, Voice &voice, SynthesisInput input,
                    std::ostream &audioFile, SynthesisResult &result,
                    std::optional<size_t> speakerId = std::nullopt,
                    std::optional<float> noiseScale = std::nullopt,
                    std::optional<float> lengthScale = std::nullopt,
-                   std::optional<float> noiseW = std::nullopt);
+                   std::optional<float> noiseW = std::nullopt,
+                   SynthesisControl *control = nullptr);
 
 } // namespace piper
 
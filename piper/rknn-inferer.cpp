@@ -80,7 +80,7 @@ RknnDecoderInfererImpl::RknnDecoderInfererImpl(rknn_context ctx)
     }
 }
 
-std::vector<int16_t> RknnDecoderInfererImpl::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g)
+void RknnDecoderInfererImpl::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& out)
 {
     std::vector<const xt::xarray<float>*> sources = {&z, &y_mask};
     if (g)
@@ -141,13 +141,10 @@ std::vector<int16_t> RknnDecoderInfererImpl::infer(const xt::xarray<float>& z, c
     size_t outsize = outattr.n_elems * (float)sz/55;
 
     __fp16* outbuf = reinterpret_cast<__fp16*>(outputs[0].buf);
-    std::vector<int16_t> out(outsize);
+    out.resize(outsize);
     for (size_t i = 0; i < outsize; i++) {
-        float val = static_cast<float>(outbuf[i]);
-        val = std::min(std::max(val, -1.0f), 1.0f) * SHRT_MAX;
-        out[i] = static_cast<int16_t>(val);
+        out[i] = static_cast<float>(outbuf[i]);
     }
-    return out;
 }
 
 RknnDecoderInfererImpl::RknnDecoderInfererImpl(RknnDecoderInfererImpl&& other)
@@ -191,8 +188,11 @@ void RknnDecoderInferer::load(std::string modelPath, std::string accelerator)
     implTracker = {0, 0, 0};
 }
 
-std::vector<int16_t> RknnDecoderInferer::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g)
+void RknnDecoderInferer::infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& audio, CancelToken* cancel)
 {
+    // rknn_run cannot be interrupted; a cancelled request stops before it
+    if (cancel)
+        cancel->throwIfCancelled();
     int idx = 0;
     do {
         std::unique_lock<std::mutex> lock(mtx);
@@ -209,12 +209,11 @@ std::vector<int16_t> RknnDecoderInferer::infer(const xt::xarray<float>& z, const
         idx = std::distance(implTracker.begin(), it);
     } while(false);
     auto& inferer = impls[idx];
-    auto ret = inferer.infer(z, y_mask, g);
+    inferer.infer(z, y_mask, g, audio);
     {
         std::lock_guard<std::mutex> lock(mtx);
         implTracker[idx] = 0;
         flag = true;
         cv.notify_one();
     }
-    return ret;
 }
@@ -21,7 +21,7 @@ struct RknnDecoderInfererImpl {
   std::vector<rknn_input> inputs;
   std::vector<rknn_output> outputs;
 
-  std::vector<int16_t> infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g);
+  void infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& out);
 };
 
 struct RknnDecoderInferer : public DecoderInferer {
@@ -31,6 +31,6 @@ struct RknnDecoderInferer : public DecoderInferer {
   std::condition_variable cv;
   bool flag = false;
 
-  std::vector<int16_t> infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g) override;
+  void infer(const xt::xarray<float>& z, const xt::xarray<float>& y_mask, const std::optional<xt::xarray<float>>& g, std::vector<float>& audio, CancelToken* cancel = nullptr) override;
   void load(std::string modelPath, std::string accelerator) override;
 };
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <iostream>
+
+// Minimal assertions for the unit tests: a failed CHECK reports where, and
+// main() returns failures() so CTest sees the test fail
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+#define CHECK(cond)                                                                      \
+    do {                                                                                 \
+        if (!(cond)) {                                                                   \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n";   \
+            failures()++;                                                                \
+        }                                                                                \
+    } while (0)
+
+#define CHECK_THROWS(expr)                                                               \
+    do {                                                                                 \
+        bool threw = false;                                                              \
+        try {                                                                            \
+            (void)(expr);                                                                \
+        } catch (...) {                                                                  \
+            threw = true;                                                                \
+        }                                                                                \
+        if (!threw) {                                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #expr " did not throw\n";  \
+            failures()++;                                                                \
+        }                                                                                \
+    } while (0)
@@ -0,0 +1,70 @@
+// Binary request records (Framing.hpp): how much of a record is needed to
+// size it, the length a header claims, and what decoding rejects.
+
+#include <string>
+
+#include "check.hpp"
+#include "paroli-daemon/Framing.hpp"
+
+using namespace std;
+
+static string header(uint8_t marker, uint32_t id, uint8_t format, uint32_t sampleRate, uint32_t textLength) {
+    string h(kBinaryRequestHeaderSize, '\0');
+    auto* p = reinterpret_cast<uint8_t*>(h.data());
+    p[0] = marker;
+    putLe32(p + 1, id);
+    p[5] = format;
+    putLe32(p + 6, sampleRate);
+    putLe32(p + 10, textLength);
+    return h;
+}
+
+static void shortHeaders() {
+    auto h = header(kBinaryRequestMarker, 1, 0, 0, 5);
+    for (size_t n = 0; n < kBinaryRequestHeaderSize; n++) CHECK(!binaryRequestSize(h.data(), n));
+    CHECK(binaryRequestSize(h.data(), h.size()) == kBinaryRequestHeaderSize + 5);
+    CHECK_THROWS(decodeBinaryRequest(h.substr(0, kBinaryRequestHeaderSize - 1)));
+}
+
+static void lengths() {
+    // Sized from the header alone, so readers can refuse a record before
+    // buffering its text
+    auto big = header(kBinaryRequestMarker, 1, 0, 0, uint32_t(kMaxLineBytes) + 1);
+    auto size = binaryRequestSize(big.data(), big.size());
+    CHECK(size && *size > kBinaryRequestHeaderSize + kMaxLineBytes);
+
+    auto huge = header(kBinaryRequestMarker, 1, 0, 0, UINT32_MAX);
+    size = binaryRequestSize(huge.data(), huge.size());
+    CHECK(size && *size == kBinaryRequestHeaderSize + size_t(UINT32_MAX));
+
+    auto exact = header(kBinaryRequestMarker, 1, 0, 0, uint32_t(kMaxLineBytes));
+    size = binaryRequestSize(exact.data(), exact.size());
+    CHECK(size && *size == kBinaryRequestHeaderSize + kMaxLineBytes);
+
+    // The record must be exactly as long as its header says
+    CHECK_THROWS(decodeBinaryRequest(header(kBinaryRequestMarker, 1, 0, 0, 4) + "hello"));
+    CHECK_THROWS(decodeBinaryRequest(header(kBinaryRequestMarker, 1, 0, 0, 6) + "hello"));
+}
+
+static void marker() {
+    CHECK_THROWS(decodeBinaryRequest(header(uint8_t('{'), 1, 0, 0, 5) + "hello"));
+    CHECK_THROWS(decodeBinaryRequest(header(kBinaryRequestMarker, 1, 9, 0, 5) + "hello"));
+
+    auto req = decodeBinaryRequest(header(kBinaryRequestMarker, 42, 2, 16000, 5) + "hello");
+    CHECK(req.id == 42);
+    CHECK(req.format == "opus");
+    CHECK(req.sampleRate && *req.sampleRate == 16000);
+    CHECK(req.text == "hello");
+
+    req = decodeBinaryRequest(header(kBinaryRequestMarker, 7, 0, 0, 0));
+    CHECK(req.format == "wav");
+    CHECK(!req.sampleRate);
+    CHECK(req.text.empty());
+}
+
+int main() {
+    shortHeaders();
+    lengths();
+    marker();
+    return failures() ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+// The built-in polyphase resampler: output lengths, chunking and agreement
+// with soxr.
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "check.hpp"
+#include "paroli-daemon/Resampler.hpp"
+
+using namespace std;
+
+constexpr int kVoiceRate = 22050;
+constexpr int kOutputRates[] = {8000, 16000, 24000, 48000};
+constexpr ResampleQuality kQualities[] = {ResampleQuality::Low, ResampleQuality::Medium, ResampleQuality::High};
+
+// Tones well inside the passband of every output rate
+static vector<float> speechLike(size_t samples) {
+    vector<float> audio(samples);
+    for (size_t i = 0; i < samples; i++) {
+        double t = double(i) / kVoiceRate;
+        audio[i] = float(0.3 * sin(2 * M_PI * 220 * t) + 0.2 * sin(2 * M_PI * 1100 * t) +
+                         0.1 * sin(2 * M_PI * 2300 * t));
+    }
+    return audio;
+}
+
+// `chunk` samples per process() call, then flush()
+static vector<float> inChunks(Resampler& resampler, span<const float> audio, size_t chunk) {
+    vector<float> out, piece;
+    for (size_t at = 0; at < audio.size(); at += chunk) {
+        resampler.process(audio.subspan(at, min(chunk, audio.size() - at)), piece);
+        out.insert(out.end(), piece.begin(), piece.end());
+    }
+    resampler.flush(piece);
+    out.insert(out.end(), piece.begin(), piece.end());
+    return out;
+}
+
+static void outputLength() {
+    for (size_t samples : {0, 1, 255, 256, 22050, 30001}) {
+        auto audio = speechLike(samples);
+        for (int rate : kOutputRates) {
+            for (auto quality : kQualities) {
+                uint64_t expected = Resampler::outputLength(samples, kVoiceRate, rate);
+                CHECK(Resampler::resample(audio, kVoiceRate, rate, quality).size() == expected);
+                Resampler chunked(kVoiceRate, rate, quality);
+                CHECK(chunked.builtIn());
+                CHECK(inChunks(chunked, audio, 256).size() == expected);
+            }
+        }
+    }
+}
+
+static void chunkSplitInvariance() {
+    auto audio = speechLike(10000);
+    for (int rate : kOutputRates) {
+        for (auto quality : kQualities) {
+            auto whole = Resampler::resample(audio, kVoiceRate, rate, quality);
+            // Chunks smaller than the filter, odd sizes and decoder-sized ones
+            for (size_t chunk : {1, 7, 100, 256, 4096}) {
+                Resampler resampler(kVoiceRate, rate, quality);
+                CHECK(inChunks(resampler, audio, chunk) == whole);
+            }
+        }
+    }
+}
+
+static void soxrParity() {
+    auto audio = speechLike(kVoiceRate);
+    for (int rate : kOutputRates) {
+        Resampler builtIn(kVoiceRate, rate);
+        Resampler soxr(kVoiceRate, rate, ResampleQuality::Medium, false);
+        CHECK(builtIn.builtIn());
+        CHECK(!soxr.builtIn());
+        auto a = inChunks(builtIn, audio, 256);
+        auto b = inChunks(soxr, audio, 256);
+        CHECK(a.size() == b.size());
+        if (a.size() != b.size()) continue;
+
+        // RMS difference away from the edges, where the two filters see
+        // different padding
+        const size_t edge = size_t(rate / 100);
+        double error = 0;
+        for (size_t i = edge; i + edge < a.size(); i++) error += double(a[i] - b[i]) * double(a[i] - b[i]);
+        error = sqrt(error / double(a.size() - 2 * edge));
+        if (error >= 0.01) cerr << "22050 -> " << rate << ": RMS difference from soxr " << error << "\n";
+        CHECK(error < 0.01);
+    }
+}
+
+int main() {
+    outputLength();
+    chunkSplitInvariance();
+    soxrParity();
+    return failures() ? 1 : 0;
+}
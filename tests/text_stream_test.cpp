@@ -0,0 +1,102 @@
+// Where TextStream cuts streamed text into segments for synthesis.
+
+#include <string>
+
+#include "check.hpp"
+#include "paroli-daemon/TextStream.hpp"
+
+using namespace std;
+
+static void terminatorNeedsNextCharacter() {
+    TextStream s;
+    s.append("Pi is 3.");
+    CHECK(!s.poll());
+    s.append("14 exactly. Next");
+    CHECK(s.poll() == "Pi is 3.14 exactly.");
+    CHECK(!s.poll());
+    s.end();
+    CHECK(s.poll() == " Next");
+    CHECK(!s.poll());
+    CHECK(!s.next(nullptr));
+}
+
+static void newline() {
+    TextStream s;
+    s.append("First line\nsecond");
+    CHECK(s.poll() == "First line\n");
+    CHECK(!s.poll());
+}
+
+static void minimumClause() {
+    TextStream s;
+    s.append("Yes, sure");
+    CHECK(!s.poll());
+
+    // Cut after a comma only once the clause is 32 bytes long
+    TextStream shortClause;
+    shortClause.append(string(30, 'a') + ", more");
+    CHECK(!shortClause.poll());
+
+    TextStream longClause;
+    longClause.append(string(31, 'a') + ", more");
+    CHECK(longClause.poll() == string(31, 'a') + ",");
+}
+
+static void wideTerminators() {
+    TextStream s;
+    s.append("こんにちは。世界！まだ");
+    CHECK(s.poll() == "こんにちは。");
+    CHECK(s.poll() == "世界！");
+    CHECK(!s.poll());
+}
+
+static void forcedCut() {
+    // No boundary: cut at the last space within 400 bytes
+    string words;
+    for (int i = 0; i < 100; i++) words += "abcd ";
+    TextStream s;
+    s.append(words);
+    auto segment = s.poll();
+    CHECK(segment && segment->size() == 399);
+    CHECK(segment && segment->back() == 'd');
+
+    TextStream noSpaces;
+    noSpaces.append(string(399, 'x'));
+    CHECK(!noSpaces.poll());
+    noSpaces.append(string(101, 'x'));
+    segment = noSpaces.poll();
+    CHECK(segment && segment->size() == 400);
+}
+
+static void multiByteCut() {
+    // The 400-byte cut lands inside "é" (2 bytes) and is moved past it
+    string text = string(399, 'x');
+    for (int i = 0; i < 10; i++) text += "é";
+    TextStream s;
+    s.append(text);
+    auto segment = s.poll();
+    CHECK(segment && segment->size() == 401);
+    CHECK(segment && segment->substr(399) == "é");
+    s.end();
+    auto rest = s.poll();
+    CHECK(rest && *rest == "ééééééééé");
+}
+
+static void blankSegmentsSkipped() {
+    TextStream s;
+    s.append("\n\n  \nHello. ");
+    CHECK(s.poll() == "Hello.");
+    s.end();
+    CHECK(!s.poll());
+}
+
+int main() {
+    terminatorNeedsNextCharacter();
+    newline();
+    minimumClause();
+    wideTerminators();
+    forcedCut();
+    multiByteCut();
+    blankSegmentsSkipped();
+    return failures() ? 1 : 0;
+}